@@ -100,21 +100,27 @@ var observe = function(host, resource, cb) {
 /**
  * Definition of CoAP endpoints
  */
+/* the endpoint table does not change at runtime, so the link-format
+ * listing is built on the first discovery request and reused after that */
+var core_links = null;
+
 var ep_wellknown_core = function(req, res) {
     console.log('EP_WELLKNOWN_CORE');
 
-    var links = "";
-
-    for (ep in eps) {
-        links += "<" + ep + ">";
-        for (l in eps[ep].desc) {
-            links += ';' + l + '="' + eps[ep]['desc'][l] + '"';
+    if (core_links === null) {
+        var links = [];
+        for (ep in eps) {
+            var link = "<" + ep + ">";
+            for (l in eps[ep].desc) {
+                link += ';' + l + '="' + eps[ep]['desc'][l] + '"';
+            }
+            links.push(link);
         }
-        links += ",";
+        core_links = links.join(",");
     }
 
     res.setOption("Content-Format", "application/link-format");
-    res.end(links);
+    res.end(core_links);
 }
 
 var ep_reg = function(req, res) {
@@ -62,6 +62,9 @@ static char stack[THREAD_STACKSIZE_DEFAULT];
 
 static saul_reg_t *light;
 
+/* time the last register request was sent, for its round-trip time */
+static uint32_t reg_sent;
+
 static size_t read_and_encode(char *buf)
 {
     phydat_t data;
@@ -88,7 +91,8 @@ static void reg_resp_handler(unsigned req_state, coap_pkt_t* pdu)
         return;
     }
 
-    printf("got response for CoAP POST request to %s\n", RES_REG);
+    printf("got response for CoAP POST request to %s after %u ms\n", RES_REG,
+           (unsigned)((xtimer_now_usec() - reg_sent) / US_PER_MS));
 }
 
 static int cmd_reg(int argc, char **argv)
@@ -117,6 +121,7 @@ static int cmd_reg(int argc, char **argv)
         return 1;
     }
 
+    reg_sent = xtimer_now_usec();
     gcoap_req_send2(coap_buf, n, &cloud, reg_resp_handler);
 
     printf("register node with CoAP server [%s]:%u\n", CLOUD_ADDR, CLOUD_PORT);
@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @{
+ *
+ * @file
+ * @brief       Host benchmark for the microcoap library of the longterm nodes
+ *
+ * Runs a fixed corpus of CoAP datagrams through coap_parse(), its unchecked
+ * variant coap_parse_trusted(), the lazy coap_parse_raw() and option iterator, coap_build() and the complete server
+ * path (parse, coap_handle_req(), build) and reports
+ * per packet: the time spent, the number of bytes read from and written to
+ * the wire buffers, the size of the packet state filled in and the peak
+ * stack usage of the path. A second run serves the corpus from several
+ * threads, each with its own request context, and reports the throughput.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include <pthread.h>
+
+#include "coap.h"
+
+#define ITERATIONS          (200000U)
+#define WARMUP              (1000U)
+#define PKT_MAX             (512U)
+
+#define STACK_SIZE          (16 * 1024U)
+#define STACK_MAGIC         (0xa5)
+
+#define WORKERS_MAX         (COAP_CTX_NUMOF)
+
+/**
+ * @brief   One datagram of the benchmark corpus
+ */
+typedef struct {
+    const char *name;
+    uint8_t buf[PKT_MAX];
+    size_t len;
+    bool valid;                 /**< parses without error */
+    coap_packet_t pkt;          /**< parsed form, input for the build path */
+    uint8_t tpl_buf[PKT_MAX];
+    coap_template_t tpl;        /**< request template with the payload in place */
+} bench_case_t;
+
+/**
+ * @brief   Bytes touched by one run of a benchmarked path
+ */
+typedef struct {
+    size_t in;                  /**< bytes read from the wire buffer */
+    size_t out;                 /**< bytes written to the wire buffer */
+    size_t state;               /**< bytes of packet state filled in */
+} bench_io_t;
+
+/**
+ * @brief   A benchmarked library path
+ */
+typedef struct {
+    const char *name;
+    int (*run)(const bench_case_t *c, bench_io_t *io);
+    bool needs_valid;           /**< skip corpus entries that do not parse */
+} bench_op_t;
+
+static uint8_t rsp_buf[PKT_MAX];
+
+static pthread_mutex_t coap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned worker_iterations;
+
+static volatile int sink;
+
+static uint8_t bench_stack[STACK_SIZE];
+static ucontext_t ctx_main, ctx_bench;
+static const bench_op_t *stack_op;
+static const bench_case_t *stack_case;
+
+/*
+ * Endpoints resembling the ones found on the longterm nodes, plus the URI
+ * layout of the agile light sensor and a maximum depth resource.
+ */
+static const coap_endpoint_path_t path_riot_board = { 2, { "riot", "board" } };
+static const coap_endpoint_path_t path_led = { 1, { "led" } };
+static const coap_endpoint_path_t path_light = { 3, { "trento", "light", "01" } };
+static const coap_endpoint_path_t path_agile = { 3, { "agile", "kickoff", "lightsense" } };
+static const coap_endpoint_path_t path_deep = { 8, { "s", "imu", "acc", "x",
+                                                     "raw", "avg", "1s", "v" } };
+
+static int handle_text(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    static const char board[] = "pba-d-01-kw2x";
+
+    (void)inpkt;
+    return coap_enc_response(rsp, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN,
+                             (const uint8_t *)board, sizeof(board) - 1);
+}
+
+static int handle_changed(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    (void)inpkt;
+    return coap_enc_response(rsp, COAP_RSPCODE_CHANGED, COAP_CONTENTTYPE_TEXT_PLAIN,
+                             NULL, 0);
+}
+
+const coap_endpoint_t endpoints[] =
+{
+    { COAP_METHOD_GET,  handle_text, &path_riot_board, "ct=0" },
+    { COAP_METHOD_POST, handle_changed, &path_led, "ct=0" },
+    { COAP_METHOD_POST, handle_changed, &path_light, "ct=0" },
+    { COAP_METHOD_GET,  handle_text, &path_agile, "ct=0" },
+    { COAP_METHOD_GET,  handle_text, &path_deep, "ct=0" },
+    /* marks the end of the endpoints array: */
+    { (coap_method_t)0, NULL, NULL, NULL }
+};
+
+/* SenML pack as composed by send_update() on node_iotlab-m3 */
+static const char senml[] =
+    "[{\"bn\":\"urn:dev:mac:0215fe0a0b0c0d0e\"},"
+    "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"1\"},"
+    "{\"n\":\"s:light\", \"u\":\"lux\", \"v\":\"318\"},"
+    "{\"n\":\"s:pressure\", \"u\":\"bar\", \"v\":\" 1.013\"},"
+    "{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"23.125\"}]";
+
+static const uint8_t token[] = { 0xde, 0xad, 0xbe, 0xef };
+
+enum {
+    CASE_SENML_POST,
+    CASE_URI_3SEG,
+    CASE_URI_AGILE,
+    CASE_OPT_HEAVY,
+    CASE_OPT_OVERFLOW,
+    CASE_SHORT_HDR,
+    CASE_BAD_VERSION,
+    CASE_BAD_TOKEN,
+    CASE_OPT_OVERRUN,
+    CASE_BAD_DELTA,
+    CASE_NUMOF
+};
+
+static bench_case_t corpus[CASE_NUMOF];
+
+#define OPT(n, s)   { { (const uint8_t *)(s), sizeof(s) - 1 }, (n) }
+
+static void corpus_build(bench_case_t *c, const char *name,
+                         const coap_packet_t *pkt)
+{
+    c->name = name;
+    c->len = sizeof(c->buf);
+    if (coap_build(c->buf, &c->len, pkt) != 0) {
+        printf("error: unable to build corpus entry '%s'\n", name);
+        exit(1);
+    }
+}
+
+static void corpus_raw(bench_case_t *c, const char *name,
+                       const uint8_t *raw, size_t len)
+{
+    c->name = name;
+    c->len = len;
+    memcpy(c->buf, raw, len);
+}
+
+/* prepare a request template holding the same request as the parsed packet */
+static void corpus_template(bench_case_t *c)
+{
+    const coap_packet_t *pkt = &c->pkt;
+    coap_encoder_t enc;
+    uint8_t *payload;
+    size_t avail;
+
+    coap_enc_init(&enc, c->tpl_buf, sizeof(c->tpl_buf), pkt->header.type,
+                  pkt->header.code, 0, 0, &pkt->token);
+    for (unsigned i = 0; i < pkt->numopts; i++) {
+        coap_enc_option(&enc, pkt->opts[i].num,
+                        pkt->opts[i].val.p, pkt->opts[i].val.len);
+    }
+    coap_tpl_init(&c->tpl, &enc);
+    payload = coap_tpl_payload(&c->tpl, &avail);
+    memcpy(payload, pkt->payload.p, pkt->payload.len);
+}
+
+static void corpus_init(void)
+{
+    /* NON POST to /senml, exactly as send_coap_post() puts it on the air */
+    coap_packet_t senml_post = {
+        .header  = { 1, COAP_TYPE_NONCON, 0, COAP_METHOD_POST, { 5, 57 } },
+        .numopts = 2,
+        .opts    = { OPT(COAP_OPTION_URI_PATH, "senml"),
+                     OPT(COAP_OPTION_NO_RESPONSE, "\x1a") },
+        .payload = { (const uint8_t *)senml, sizeof(senml) - 1 },
+    };
+    corpus_build(&corpus[CASE_SENML_POST], "senml_post", &senml_post);
+
+    /* multi segment Uri-Path, as used by the agile light sensor */
+    coap_packet_t uri_3seg = {
+        .header  = { 1, COAP_TYPE_NONCON, sizeof(token), COAP_METHOD_POST, { 0, 1 } },
+        .token   = { token, sizeof(token) },
+        .numopts = 3,
+        .opts    = { OPT(COAP_OPTION_URI_PATH, "trento"),
+                     OPT(COAP_OPTION_URI_PATH, "light"),
+                     OPT(COAP_OPTION_URI_PATH, "01") },
+        .payload = { (const uint8_t *)"1", 1 },
+    };
+    corpus_build(&corpus[CASE_URI_3SEG], "uri_3seg", &uri_3seg);
+
+    /* the route of the agile kickoff demo, segments of differing length */
+    coap_packet_t uri_agile = {
+        .header  = { 1, COAP_TYPE_CON, sizeof(token), COAP_METHOD_GET, { 0, 3 } },
+        .token   = { token, sizeof(token) },
+        .numopts = 3,
+        .opts    = { OPT(COAP_OPTION_URI_PATH, "agile"),
+                     OPT(COAP_OPTION_URI_PATH, "kickoff"),
+                     OPT(COAP_OPTION_URI_PATH, "lightsense") },
+    };
+    corpus_build(&corpus[CASE_URI_AGILE], "uri_agile", &uri_agile);
+
+    /* MAXOPT options with a maximum depth path, queries and long values */
+    coap_packet_t opt_heavy = {
+        .header  = { 1, COAP_TYPE_CON, sizeof(token), COAP_METHOD_GET, { 0, 2 } },
+        .token   = { token, sizeof(token) },
+        .numopts = MAXOPT,
+        .opts    = { OPT(COAP_OPTION_URI_HOST, "node-pba-d-01-kw2x.longterm.riot-os.org"),
+                     OPT(COAP_OPTION_URI_PATH, "s"),
+                     OPT(COAP_OPTION_URI_PATH, "imu"),
+                     OPT(COAP_OPTION_URI_PATH, "acc"),
+                     OPT(COAP_OPTION_URI_PATH, "x"),
+                     OPT(COAP_OPTION_URI_PATH, "raw"),
+                     OPT(COAP_OPTION_URI_PATH, "avg"),
+                     OPT(COAP_OPTION_URI_PATH, "1s"),
+                     OPT(COAP_OPTION_URI_PATH, "v"),
+                     OPT(COAP_OPTION_CONTENT_FORMAT, "\x00"),
+                     OPT(COAP_OPTION_URI_QUERY, "from=0"),
+                     OPT(COAP_OPTION_URI_QUERY, "to=1000"),
+                     OPT(COAP_OPTION_URI_QUERY, "unit=g"),
+                     OPT(COAP_OPTION_URI_QUERY, "window=1s"),
+                     OPT(COAP_OPTION_URI_QUERY, "format=senml"),
+                     OPT(COAP_OPTION_ACCEPT, "\x00") },
+    };
+    corpus_build(&corpus[CASE_OPT_HEAVY], "opt_heavy", &opt_heavy);
+
+    /* more than MAXOPT options, coap_build() can not create this one */
+    bench_case_t *c = &corpus[CASE_OPT_OVERFLOW];
+    uint8_t *p = c->buf;
+    *p++ = 0x40;                        /* CON, no token */
+    *p++ = COAP_METHOD_GET;
+    *p++ = 0;
+    *p++ = 3;
+    *p++ = 0xb5;                        /* Uri-Path: senml */
+    memcpy(p, "senml", 5);
+    p += 5;
+    for (unsigned i = 0; i < (2 * MAXOPT); i++) {
+        /* Uri-Query: q=XX */
+        *p++ = (i == 0) ? (((COAP_OPTION_URI_QUERY - COAP_OPTION_URI_PATH) << 4) | 4) : 4;
+        p += sprintf((char *)p, "q=%02u", i);
+    }
+    *p++ = 0xff;
+    *p++ = '1';
+    c->name = "opt_overflow";
+    c->len = p - c->buf;
+
+    /* malformed input, each one triggering a different parser error */
+    static const uint8_t short_hdr[] = { 0x50, 0x01 };
+    static const uint8_t bad_version[] = { 0x90, 0x01, 0x00, 0x01 };
+    static const uint8_t bad_token[] = { 0x59, 0x01, 0x00, 0x01,
+                                         1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    static const uint8_t opt_overrun[] = { 0x50, 0x01, 0x00, 0x01,
+                                           0xb5, 's', 'e' };
+    static const uint8_t bad_delta[] = { 0x50, 0x01, 0x00, 0x01,
+                                         0xf1, 0x00 };
+    corpus_raw(&corpus[CASE_SHORT_HDR], "short_hdr",
+               short_hdr, sizeof(short_hdr));
+    corpus_raw(&corpus[CASE_BAD_VERSION], "bad_version",
+               bad_version, sizeof(bad_version));
+    corpus_raw(&corpus[CASE_BAD_TOKEN], "bad_token",
+               bad_token, sizeof(bad_token));
+    corpus_raw(&corpus[CASE_OPT_OVERRUN], "opt_overrun",
+               opt_overrun, sizeof(opt_overrun));
+    corpus_raw(&corpus[CASE_BAD_DELTA], "bad_delta",
+               bad_delta, sizeof(bad_delta));
+
+    for (unsigned i = 0; i < CASE_NUMOF; i++) {
+        bench_case_t *c = &corpus[i];
+        c->valid = (coap_parse(&c->pkt, c->buf, c->len) == 0);
+        if (c->valid) {
+            corpus_template(c);
+        }
+    }
+}
+
+static int op_nop(const bench_case_t *c, bench_io_t *io)
+{
+    (void)c;
+    (void)io;
+    return 0;
+}
+
+static int op_parse(const bench_case_t *c, bench_io_t *io)
+{
+    coap_packet_t pkt;
+    int rc = coap_parse(&pkt, c->buf, c->len);
+
+    io->in = c->len;
+    io->state = sizeof(pkt);
+    return rc;
+}
+
+/* the same without the checks, only for entries that are well-formed */
+static int op_parse_trusted(const bench_case_t *c, bench_io_t *io)
+{
+    coap_packet_t pkt;
+    int rc = coap_parse_trusted(&pkt, c->buf, c->len);
+
+    io->in = c->len;
+    io->state = sizeof(pkt);
+    return rc;
+}
+
+/* header and token only, then walk all options and fetch the payload */
+static int op_parse_raw(const bench_case_t *c, bench_io_t *io)
+{
+    coap_raw_packet_t pkt;
+    coap_opt_iter_t it;
+    coap_option_t opt;
+    coap_buffer_t payload;
+    int rc;
+
+    io->in = c->len;
+    io->state = sizeof(pkt) + sizeof(it) + sizeof(opt);
+    if ((rc = coap_parse_raw(&pkt, c->buf, c->len)) != 0) {
+        return rc;
+    }
+    coap_opt_iter_init(&it, &pkt);
+    return coap_opt_iter_payload(&it, &payload);
+}
+
+/* the option lookups a typical handler and the dispatcher do */
+static const uint16_t find_nums[] = {
+    COAP_OPTION_URI_PATH, COAP_OPTION_CONTENT_FORMAT, COAP_OPTION_URI_QUERY,
+    COAP_OPTION_OBSERVE, COAP_OPTION_BLOCK2, COAP_OPTION_ACCEPT,
+};
+
+static int op_find_scan(const bench_case_t *c, bench_io_t *io)
+{
+    uint8_t count;
+    int found = 0;
+
+    for (unsigned i = 0; i < sizeof(find_nums) / sizeof(find_nums[0]); i++) {
+        if (coap_find_options(&c->pkt, find_nums[i], &count) != NULL) {
+            found += count;
+        }
+    }
+    (void)io;
+    sink = found;
+    return 0;
+}
+
+/* the same lookups through an index built for them */
+static int op_find_idx(const bench_case_t *c, bench_io_t *io)
+{
+    coap_optidx_t idx;
+    uint8_t count;
+    int found = 0;
+
+    coap_optidx_build(&idx, &c->pkt);
+    for (unsigned i = 0; i < sizeof(find_nums) / sizeof(find_nums[0]); i++) {
+        if (coap_optidx_find(&idx, &c->pkt, find_nums[i], &count) != NULL) {
+            found += count;
+        }
+    }
+    io->state = sizeof(idx);
+    sink = found;
+    return 0;
+}
+
+static int op_build(const bench_case_t *c, bench_io_t *io)
+{
+    size_t len = sizeof(rsp_buf);
+    int rc = coap_build(rsp_buf, &len, &c->pkt);
+
+    io->in = c->len;
+    io->out = len;
+    return rc;
+}
+
+/* send path with a prepared template, the payload is composed in place */
+static int op_template(const bench_case_t *c, bench_io_t *io)
+{
+    static uint16_t mid;
+    /* coap_tpl_finish() patches the message ID in place */
+    coap_template_t *tpl = (coap_template_t *)&c->tpl;
+
+    io->in = 0;
+    io->out = coap_tpl_finish(tpl, mid++, c->pkt.payload.len);
+    return (io->out == 0);
+}
+
+/* the payload streamed as link sized Block1 requests, as the nodes send it */
+static int op_block1(const bench_case_t *c, bench_io_t *io)
+{
+    coap_block1_tx_t tx;
+    size_t len;
+    uint16_t mid = 0;
+
+    coap_block1_init(&tx, &c->tpl, c->pkt.payload.p, c->pkt.payload.len, COAP_BLOCK_SZX);
+    /* the nodes upload confirmable blocks */
+    tx.con = true;
+    io->in = 0;
+    io->out = 0;
+    io->state = sizeof(tx);
+    while ((len = coap_block1_next(&tx, rsp_buf, sizeof(rsp_buf), mid++)) > 0) {
+        io->out += len;
+    }
+    return (io->out == 0);
+}
+
+/* the complete request path of microcoap_server() */
+static int op_dispatch(const bench_case_t *c, bench_io_t *io)
+{
+    coap_packet_t pkt;
+    size_t len = sizeof(rsp_buf);
+    int rc;
+
+    io->in = c->len;
+    io->state = sizeof(pkt);
+    if ((rc = coap_parse(&pkt, c->buf, c->len)) != 0) {
+        return rc;
+    }
+
+    rc = coap_handle_req(NULL, &pkt, rsp_buf, &len, false, false);
+    io->out = len;
+    io->state += sizeof(coap_encoder_t);
+    return rc;
+}
+
+static const bench_op_t ops[] = {
+    { "parse",     op_parse,     false },
+    { "parse_tr",  op_parse_trusted, true },
+    { "parse_raw", op_parse_raw, false },
+    { "find_scan", op_find_scan, true  },
+    { "find_idx",  op_find_idx,  true  },
+    { "build",     op_build,     true  },
+    { "template",  op_template,  true  },
+    { "block1",    op_block1,    true  },
+    { "dispatch",  op_dispatch,  false },
+};
+
+static void stack_entry(void)
+{
+    bench_io_t io = { 0 };
+    stack_op->run(stack_case, &io);
+}
+
+/* run the path once on a painted stack and return the number of bytes used */
+static size_t stack_usage(const bench_op_t *op, const bench_case_t *c)
+{
+    size_t unused = 0;
+
+    memset(bench_stack, STACK_MAGIC, sizeof(bench_stack));
+    stack_op = op;
+    stack_case = c;
+
+    getcontext(&ctx_bench);
+    ctx_bench.uc_stack.ss_sp = bench_stack;
+    ctx_bench.uc_stack.ss_size = sizeof(bench_stack);
+    ctx_bench.uc_link = &ctx_main;
+    makecontext(&ctx_bench, stack_entry, 0);
+    swapcontext(&ctx_main, &ctx_bench);
+
+    while ((unused < sizeof(bench_stack)) && (bench_stack[unused] == STACK_MAGIC)) {
+        unused++;
+    }
+    return sizeof(bench_stack) - unused;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+#ifdef COAP_WITH_STATS
+uint32_t coap_stats_usec(void)
+{
+    return (uint32_t)(now_ns() / 1000);
+}
+#endif
+
+void coap_lock(void)
+{
+    pthread_mutex_lock(&coap_mutex);
+}
+
+void coap_unlock(void)
+{
+    pthread_mutex_unlock(&coap_mutex);
+}
+
+/* one server thread: receive the corpus into its own context and handle it */
+static void *worker(void *arg)
+{
+    coap_ctx_t *ctx = coap_ctx_acquire();
+    uint16_t mid = 0;
+    size_t out = 0;
+
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    /* every worker is a different peer, so no request is a duplicate */
+    memset(&ctx->peer, 0, sizeof(ctx->peer));
+    ctx->peer.port = (uint16_t)(uintptr_t)arg;
+
+    for (unsigned i = 0; i < worker_iterations; i++) {
+        const bench_case_t *c = &corpus[i % CASE_NUMOF];
+
+        memcpy(ctx->rx, c->buf, c->len);
+        ctx->rxlen = c->len;
+        if (c->len >= 4) {
+            ctx->rx[2] = (mid >> 8);
+            ctx->rx[3] = (0xff & mid++);
+        }
+        coap_ctx_handle(ctx, 0, false, false);
+        out += ctx->txlen;
+    }
+
+    coap_ctx_release(ctx);
+    sink = (int)out;
+    return NULL;
+}
+
+/* returns the number of requests handled per second by all workers */
+static double throughput(unsigned workers)
+{
+    pthread_t threads[WORKERS_MAX];
+    uint64_t start = now_ns();
+
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)(i + 1));
+    }
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return (double)workers * worker_iterations * 1e9 / (now_ns() - start);
+}
+
+static double time_per_pkt(const bench_op_t *op, const bench_case_t *c,
+                           unsigned iterations)
+{
+    bench_io_t io = { 0 };
+    uint64_t start;
+
+    for (unsigned i = 0; i < WARMUP; i++) {
+        op->run(c, &io);
+    }
+    start = now_ns();
+    for (unsigned i = 0; i < iterations; i++) {
+        op->run(c, &io);
+    }
+    return (double)(now_ns() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    static const bench_op_t nop = { "nop", op_nop, false };
+    unsigned iterations = ITERATIONS;
+    size_t stack_base;
+
+    if (argc > 1) {
+        iterations = (unsigned)strtoul(argv[1], NULL, 0);
+        if (iterations == 0) {
+            printf("usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    corpus_init();
+    if (coap_init() != 0) {
+        puts("error: unable to build the routing trie");
+        return 1;
+    }
+    stack_base = stack_usage(&nop, &corpus[0]);
+
+    printf("microcoap host benchmark, %u iterations per path\n", iterations);
+    printf("sizeof(coap_packet_t) = %u\n\n", (unsigned)sizeof(coap_packet_t));
+    printf("%-12s %-10s %4s %10s %5s %5s %6s %6s\n",
+           "case", "path", "len", "ns/pkt", "in", "out", "state", "stack");
+
+    for (unsigned i = 0; i < CASE_NUMOF; i++) {
+        const bench_case_t *c = &corpus[i];
+
+        for (unsigned j = 0; j < sizeof(ops) / sizeof(ops[0]); j++) {
+            const bench_op_t *op = &ops[j];
+            bench_io_t io = { 0 };
+            int rc;
+
+            if (op->needs_valid && !c->valid) {
+                continue;
+            }
+
+            rc = op->run(c, &io);
+            printf("%-12s %-10s %4u %10.1f %5u %5u %6u %6u",
+                   c->name, op->name, (unsigned)c->len,
+                   time_per_pkt(op, c, iterations),
+                   (unsigned)io.in, (unsigned)io.out, (unsigned)io.state,
+                   (unsigned)(stack_usage(op, c) - stack_base));
+            if (rc != 0) {
+                printf("  (err %i)", rc);
+            }
+            puts("");
+        }
+    }
+
+    printf("\n%-8s %12s\n", "workers", "pkts/s");
+    worker_iterations = iterations * CASE_NUMOF;
+    for (unsigned n = 1; n <= WORKERS_MAX; n *= 2) {
+        printf("%-8u %12.0f\n", n, throughput(n));
+    }
+
+    return 0;
+}
@@ -0,0 +1,1138 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @{
+ *
+ * @file
+ * @brief       Gateway daemon ingesting the SenML reports of the longterm
+ *              nodes
+ *
+ * Receives the POSTs to /senml the nodes send to the gateway in batches of
+ * up to BATCH datagrams (recvmmsg()), runs each through the microcoap server
+ * path on its own request context and sends all replies of a batch at once
+ * (sendmmsg()). Block1 transfers are reassembled per node. Packs are SenML
+ * JSON, or SenML-CBOR when sent with Content-Format 112. The records of all
+ * packs in a batch are handed to the connected consumers as one message on a
+ * SOCK_SEQPACKET UNIX socket, one line per record:
+ *
+ *     <node address> TAB <name> TAB <unit> TAB <value> TAB <time> LF
+ *
+ * with the base name already prepended to the name and the time resolved
+ * to seconds since the epoch. Unit and value are left empty if a record
+ * does not carry them.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "coap.h"
+
+#define BATCH               (COAP_CTX_NUMOF)
+#define CONSUMERS_MAX       (8U)
+#define OUT_SIZE            (64 * 1024U)
+#define RCVBUF_SIZE         (4 * 1024 * 1024)
+
+#define REASM_NUMOF         (64U)       /**< Block1 transfers in progress */
+#define REASM_SIZE          (2048U)     /**< largest pack accepted */
+#define REASM_TIMEOUT       (10000U)    /**< drop unfinished transfers [in ms] */
+
+#define BN_NUMOF            (1024U)     /**< nodes whose base name is kept */
+#define BN_SIZE             (64U)       /**< longest base name kept */
+
+#define CT_TEXT             (0U)        /**< Content-Formats taken as SenML JSON */
+#define CT_JSON             (50U)
+#define CT_SENML_JSON       (110U)
+#define CT_SENML_CBOR       (112U)      /**< Content-Format of SenML-CBOR */
+
+#define SENML_REL_TIME      (268435456.0)   /**< times below 2^28 s are relative
+                                             *   to the time of reception */
+
+#define DEFAULT_PORT        (5683U)
+#define DEFAULT_SOCKET      "/tmp/coap_ingest.sock"
+
+/**
+ * @brief   Reassembly state of one Block1 transfer
+ */
+typedef struct {
+    coap_peer_t peer;
+    uint32_t expire;            /**< slot is free once this has passed */
+    size_t len;                 /**< bytes received so far */
+    uint8_t body[REASM_SIZE];
+} reasm_t;
+
+/**
+ * @brief   A string within the payload
+ */
+typedef struct {
+    const char *p;
+    size_t len;
+} span_t;
+
+/**
+ * @brief   Base name a node sent last, for its packs that leave it out
+ */
+typedef struct {
+    uint8_t addr[16];
+    uint8_t len;                /**< length of name, 0 for a free entry */
+    char name[BN_SIZE];
+} bn_entry_t;
+
+/**
+ * @brief   State of the pack being decoded
+ */
+typedef struct {
+    span_t addr;                /**< address of the node as text */
+    span_t bn;                  /**< base name */
+    bool bn_sent;               /**< the base name came with the pack */
+    double bt;                  /**< base time [in s] */
+} pack_t;
+
+/**
+ * @brief   One record of a pack
+ */
+typedef struct {
+    span_t n;
+    span_t u;
+    span_t v;                   /**< value of any type, as text */
+    double t;                   /**< time relative to the base time [in s] */
+    bool has_rec;               /**< carries more than a time */
+} rec_t;
+
+static coap_ctx_t *ctx[BATCH];
+static struct sockaddr_in6 src[BATCH];
+static struct mmsghdr rx_msg[BATCH];
+static struct iovec rx_iov[BATCH];
+static struct mmsghdr tx_msg[BATCH];
+static struct iovec tx_iov[BATCH];
+
+static reasm_t reasm[REASM_NUMOF];
+static bn_entry_t bn_cache[BN_NUMOF];
+
+static int consumer[CONSUMERS_MAX];
+static unsigned consumers;
+
+static char out[OUT_SIZE];
+static size_t out_len;
+
+static uint32_t now;
+static double rx_time;          /* wall clock at reception of the batch [in s] */
+static volatile sig_atomic_t running = 1;
+
+static struct {
+    unsigned long pkts;
+    unsigned long records;
+    unsigned long bad;
+    unsigned long lost;
+    unsigned long unsent;
+} cnt;
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* hands the records collected so far to every consumer, consumers that do
+ * not keep up lose the message, those that are gone are dropped */
+static void publish(void)
+{
+    unsigned i = 0;
+
+    if (out_len == 0) {
+        return;
+    }
+
+    while (i < consumers) {
+        if (send(consumer[i], out, out_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                cnt.lost++;
+            }
+            else {
+                close(consumer[i]);
+                consumer[i] = consumer[--consumers];
+                continue;
+            }
+        }
+        i++;
+    }
+
+    out_len = 0;
+}
+
+static void out_put(const char *s, size_t len, char sep)
+{
+    memcpy(&out[out_len], s, len);
+    out_len += len;
+    out[out_len++] = sep;
+}
+
+/* appends a record for the consumers, false if out is full */
+static bool emit(const pack_t *pk, const rec_t *rec)
+{
+    char time[24];
+    double t = pk->bt + rec->t;
+    size_t len;
+
+    if (t < SENML_REL_TIME) {
+        t += rx_time;
+    }
+    snprintf(time, sizeof(time), "%.3f", t);
+
+    /* name, unit, value and time plus one separator each */
+    len = pk->addr.len + pk->bn.len + rec->n.len + rec->u.len + rec->v.len + strlen(time) + 5;
+    if (out_len + len > OUT_SIZE) {
+        return false;
+    }
+
+    out_put(pk->addr.p, pk->addr.len, '\t');
+    memcpy(&out[out_len], pk->bn.p, pk->bn.len);
+    out_len += pk->bn.len;
+    out_put(rec->n.p, rec->n.len, '\t');
+    out_put(rec->u.p, rec->u.len, '\t');
+    out_put(rec->v.p, rec->v.len, '\t');
+    out_put(time, strlen(time), '\n');
+    cnt.records++;
+    return true;
+}
+
+static size_t bn_slot(const coap_peer_t *peer)
+{
+    uint32_t key = 2166136261UL;    /* FNV-1a over the address */
+
+    for (unsigned i = 0; i < sizeof(peer->addr); i++) {
+        key = (key ^ peer->addr[i]) * 16777619UL;
+    }
+    return key % BN_NUMOF;
+}
+
+/* starts a pack of peer: the base name is the one the node sent last, or
+ * derived from the interface identifier of its address as the nodes do */
+static void pack_init(pack_t *pk, const coap_peer_t *peer,
+                      char *addr_str, char *bn_str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const bn_entry_t *e = &bn_cache[bn_slot(peer)];
+
+    inet_ntop(AF_INET6, peer->addr, addr_str, INET6_ADDRSTRLEN);
+    pk->addr.p = addr_str;
+    pk->addr.len = strlen(addr_str);
+    pk->bn_sent = false;
+    pk->bt = 0;
+
+    if ((e->len > 0) && (memcmp(e->addr, peer->addr, sizeof(e->addr)) == 0)) {
+        pk->bn.p = e->name;
+        pk->bn.len = e->len;
+        return;
+    }
+
+    strcpy(bn_str, "urn:dev:mac:");
+    pk->bn.len = strlen(bn_str);
+    for (unsigned i = 8; i < sizeof(peer->addr); i++) {
+        bn_str[pk->bn.len++] = hex[peer->addr[i] >> 4];
+        bn_str[pk->bn.len++] = hex[peer->addr[i] & 0xf];
+    }
+    pk->bn.p = bn_str;
+}
+
+static void bn_remember(const coap_peer_t *peer, const span_t *bn)
+{
+    bn_entry_t *e = &bn_cache[bn_slot(peer)];
+
+    if ((bn->len == 0) || (bn->len >= sizeof(e->name))) {
+        return;
+    }
+    memcpy(e->addr, peer->addr, sizeof(e->addr));
+    memcpy(e->name, bn->p, bn->len);
+    e->len = (uint8_t)bn->len;
+}
+
+/* a number given as text, e.g. a time */
+static bool span_num(const span_t *s, double *num)
+{
+    char str[32];
+    char *end;
+
+    if ((s->len == 0) || (s->len >= sizeof(str))) {
+        return false;
+    }
+    memcpy(str, s->p, s->len);
+    str[s->len] = '\0';
+    *num = strtod(str, &end);
+    return (*end == '\0');
+}
+
+/* the records go out framed by TAB and LF, so text with control characters
+ * is not passed on */
+static bool span_printable(const span_t *s)
+{
+    for (size_t i = 0; i < s->len; i++) {
+        if (((unsigned char)s->p[i] < 0x20) || (s->p[i] == 0x7f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* value of a member: strings without their quotes, arrays (of numbers) as
+ * they are, anything else up to the next separator. Escapes are not
+ * decoded, the nodes send none, so strings with them are rejected */
+static const char *senml_value(const char *p, const char *end, span_t *val)
+{
+    if (*p == '"') {
+        val->p = ++p;
+        while (p < end && *p != '"' && *p != '\\') {
+            p++;
+        }
+        if (p >= end || *p == '\\') {
+            return NULL;
+        }
+        val->len = p++ - val->p;
+    }
+    else if (*p == '[') {
+        val->p = p;
+        while (p < end && *p != ']') {
+            p++;
+        }
+        if (p >= end) {
+            return NULL;
+        }
+        val->len = ++p - val->p;
+    }
+    else {
+        val->p = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ' ' && *p != '\t' &&
+               *p != '\r' && *p != '\n') {
+            p++;
+        }
+        val->len = p - val->p;
+    }
+    return span_printable(val) ? p : NULL;
+}
+
+static const char *skip_ws(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
+    return p;
+}
+
+static bool key_is(const span_t *key, const char *name)
+{
+    return (key->len == strlen(name)) && (memcmp(key->p, name, key->len) == 0);
+}
+
+/*
+ * Splits a SenML JSON pack into records. This is no general JSON parser, it
+ * accepts what the nodes send: an array of flat objects with string, number
+ * and boolean members, and arrays of numbers as values.
+ */
+static int senml_json(pack_t *pk, const char *p, size_t len)
+{
+    const char *end = p + len;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p++ != '[') {
+        return -1;
+    }
+
+    while ((p = skip_ws(p, end)) < end && *p != ']') {
+        rec_t rec = { { "", 0 }, { "", 0 }, { "", 0 }, 0, false };
+
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p++ != '{') {
+            return -1;
+        }
+
+        while ((p = skip_ws(p, end)) < end && *p != '}') {
+            span_t key, val;
+
+            if (*p == ',') {
+                p++;
+                continue;
+            }
+            if (*p != '"' || (p = senml_value(p, end, &key)) == NULL) {
+                return -1;
+            }
+            p = skip_ws(p, end);
+            if (p >= end || *p++ != ':') {
+                return -1;
+            }
+            p = skip_ws(p, end);
+            if (p >= end || (p = senml_value(p, end, &val)) == NULL) {
+                return -1;
+            }
+
+            if (key_is(&key, "bn")) {
+                pk->bn = val;
+                pk->bn_sent = true;
+            }
+            else if (key_is(&key, "bt")) {
+                if (!span_num(&val, &pk->bt)) {
+                    return -1;
+                }
+            }
+            else if (key_is(&key, "t")) {
+                if (!span_num(&val, &rec.t)) {
+                    return -1;
+                }
+            }
+            else if (key_is(&key, "n")) {
+                rec.n = val;
+                rec.has_rec = true;
+            }
+            else if (key_is(&key, "u")) {
+                rec.u = val;
+                rec.has_rec = true;
+            }
+            /* vs and vb are values as well */
+            else if (key_is(&key, "v") || key_is(&key, "vs") || key_is(&key, "vb")) {
+                rec.v = val;
+                rec.has_rec = true;
+            }
+        }
+        if (p >= end) {
+            return -1;
+        }
+        p++;
+
+        if (rec.has_rec && !emit(pk, &rec)) {
+            return -ENOBUFS;
+        }
+    }
+
+    return (p < end) ? 0 : -1;
+}
+
+/* SenML-CBOR labels, RFC 8428 */
+#define SENML_BN            (-2)
+#define SENML_BT            (-3)
+#define SENML_N             (0)
+#define SENML_U             (1)
+#define SENML_V             (2)
+#define SENML_VS            (3)
+#define SENML_VB            (4)
+#define SENML_T             (6)
+
+/* CBOR major types */
+#define CBOR_UINT           (0U)
+#define CBOR_NINT           (1U)
+#define CBOR_TEXT           (3U)
+#define CBOR_ARRAY          (4U)
+#define CBOR_MAP            (5U)
+#define CBOR_TAG            (6U)
+#define CBOR_SIMPLE         (7U)
+#define CBOR_BREAK          (0xff)
+
+#define CBOR_TAG_DECFRAC    (4U)
+
+/* head of the next item: major type, argument and whether it is of
+ * indefinite length, NULL if the pack ends early */
+static const uint8_t *cbor_head(const uint8_t *p, const uint8_t *end,
+                                unsigned *major, uint64_t *arg, bool *indef)
+{
+    unsigned info;
+    unsigned n;
+
+    if (p >= end) {
+        return NULL;
+    }
+    *major = *p >> 5;
+    info = *p++ & 0x1f;
+    *indef = (info == 31);
+    *arg = (info < 24) ? info : 0;
+    if ((info < 24) || (info == 31)) {
+        return p;
+    }
+    if (info > 27) {
+        return NULL;
+    }
+    n = 1U << (info - 24);
+    if ((size_t)(end - p) < n) {
+        return NULL;
+    }
+    while (n--) {
+        *arg = (*arg << 8) | *p++;
+    }
+    return p;
+}
+
+static const uint8_t *cbor_int(const uint8_t *p, const uint8_t *end, int64_t *val)
+{
+    unsigned major;
+    uint64_t arg;
+    bool indef;
+
+    if ((p = cbor_head(p, end, &major, &arg, &indef)) == NULL ||
+        (major > CBOR_NINT) || indef || (arg > INT64_MAX)) {
+        return NULL;
+    }
+    *val = (major == CBOR_UINT) ? (int64_t)arg : -1 - (int64_t)arg;
+    return p;
+}
+
+static double half_float(uint16_t h)
+{
+    double val = (double)(h & 0x3ff);
+    int exp = (h >> 10) & 0x1f;
+
+    if (exp == 0) {
+        val = val / 1024.0 / 16384.0;
+    }
+    else if (exp == 0x1f) {
+        val = (val == 0) ? HUGE_VAL : NAN;
+    }
+    else {
+        val = (1.0 + val / 1024.0);
+        for (; exp > 15; exp--) {
+            val *= 2;
+        }
+        for (; exp < 15; exp++) {
+            val /= 2;
+        }
+    }
+    return (h & 0x8000) ? -val : val;
+}
+
+/* a number: integer, decimal fraction (tag 4) or float, as text into buf
+ * and as value into num */
+static const uint8_t *cbor_number(const uint8_t *p, const uint8_t *end,
+                                  char *buf, size_t size, double *num)
+{
+    const uint8_t *start = p;
+    unsigned major;
+    uint64_t arg;
+    bool indef;
+    int64_t m, e;
+
+    if ((p = cbor_head(p, end, &major, &arg, &indef)) == NULL || indef) {
+        return NULL;
+    }
+
+    if (major <= CBOR_NINT) {
+        if (cbor_int(start, end, &m) == NULL) {
+            return NULL;
+        }
+        snprintf(buf, size, "%" PRId64, m);
+        *num = (double)m;
+        return p;
+    }
+
+    if (major == CBOR_SIMPLE) {
+        switch (start[0] & 0x1f) {
+            case 25:
+                *num = half_float((uint16_t)arg);
+                break;
+            case 26: {
+                uint32_t bits = (uint32_t)arg;
+                float f;
+                memcpy(&f, &bits, sizeof(f));
+                *num = f;
+                break;
+            }
+            case 27:
+                memcpy(num, &arg, sizeof(*num));
+                break;
+            default:
+                return NULL;
+        }
+        snprintf(buf, size, "%.17g", *num);
+        return p;
+    }
+
+    /* [exponent, mantissa], the nodes use it for fixed point values */
+    if ((major != CBOR_TAG) || (arg != CBOR_TAG_DECFRAC) ||
+        (p >= end) || (*p++ != ((CBOR_ARRAY << 5) | 2)) ||
+        (p = cbor_int(p, end, &e)) == NULL || (p = cbor_int(p, end, &m)) == NULL ||
+        (e < -18) || (e > 18)) {
+        return NULL;
+    }
+
+    *num = (double)m;
+    for (int64_t i = e; i < 0; i++) {
+        *num /= 10;
+    }
+    for (int64_t i = 0; i < e; i++) {
+        *num *= 10;
+    }
+
+    if (e >= 0) {
+        snprintf(buf, size, "%.0f", *num);
+    }
+    else {
+        uint64_t mag = (m < 0) ? -(uint64_t)m : (uint64_t)m;
+        uint64_t scale = 1;
+
+        for (int64_t i = e; i < 0; i++) {
+            scale *= 10;
+        }
+        snprintf(buf, size, "%s%" PRIu64 ".%0*" PRIu64, (m < 0) ? "-" : "",
+                 mag / scale, (int)-e, mag % scale);
+    }
+    return p;
+}
+
+/* a value as text: strings point into the pack, booleans, numbers and
+ * arrays of numbers are written to buf */
+static const uint8_t *cbor_value(const uint8_t *p, const uint8_t *end,
+                                 char *buf, size_t size, span_t *val)
+{
+    const uint8_t *start = p;
+    unsigned major;
+    uint64_t arg;
+    bool indef;
+    double num;
+
+    if ((p == NULL) || (p >= end)) {
+        return NULL;
+    }
+
+    val->p = buf;
+    if (*p == ((CBOR_SIMPLE << 5) | 20) || *p == ((CBOR_SIMPLE << 5) | 21)) {
+        strcpy(buf, (*p == ((CBOR_SIMPLE << 5) | 21)) ? "true" : "false");
+        val->len = strlen(buf);
+        return p + 1;
+    }
+
+    if ((p = cbor_head(p, end, &major, &arg, &indef)) == NULL || indef) {
+        return NULL;
+    }
+
+    if (major == CBOR_TEXT) {
+        if ((uint64_t)(end - p) < arg) {
+            return NULL;
+        }
+        val->p = (const char *)p;
+        val->len = (size_t)arg;
+        return span_printable(val) ? p + arg : NULL;
+    }
+
+    if (major == CBOR_ARRAY) {
+        size_t len = 0;
+
+        for (uint64_t i = 0; i < arg; i++) {
+            if ((len + 2 >= size) ||
+                (p = cbor_number(p, end, &buf[len + 1], size - len - 2, &num)) == NULL) {
+                return NULL;
+            }
+            buf[len] = (i == 0) ? '[' : ',';
+            len += strlen(&buf[len + 1]) + 1;
+        }
+        if (len + 2 > size) {
+            return NULL;
+        }
+        if (arg == 0) {
+            buf[len++] = '[';
+        }
+        buf[len++] = ']';
+        buf[len] = '\0';
+        val->len = len;
+        return p;
+    }
+
+    if ((p = cbor_number(start, end, buf, size, &num)) == NULL) {
+        return NULL;
+    }
+    val->len = strlen(buf);
+    return p;
+}
+
+/* a text string pointing into the pack */
+static const uint8_t *cbor_text(const uint8_t *p, const uint8_t *end, span_t *val)
+{
+    unsigned major;
+    uint64_t arg;
+    bool indef;
+
+    if ((p = cbor_head(p, end, &major, &arg, &indef)) == NULL ||
+        (major != CBOR_TEXT) || indef || ((uint64_t)(end - p) < arg)) {
+        return NULL;
+    }
+    val->p = (const char *)p;
+    val->len = (size_t)arg;
+    return span_printable(val) ? p + arg : NULL;
+}
+
+/* the end of an array or map: counts down n, or finds the break code of
+ * one of indefinite length */
+static bool cbor_more(const uint8_t **p, const uint8_t *end, bool indef, uint64_t *n)
+{
+    if (indef) {
+        if ((*p < end) && (**p == CBOR_BREAK)) {
+            (*p)++;
+            return false;
+        }
+        return true;
+    }
+    if (*n == 0) {
+        return false;
+    }
+    (*n)--;
+    return true;
+}
+
+/*
+ * Splits a SenML-CBOR pack into records. Like senml_json() this accepts what
+ * the nodes send: an array of maps whose values are strings, numbers
+ * (including decimal fractions), booleans or arrays of numbers.
+ */
+static int senml_cbor(pack_t *pk, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    unsigned major;
+    uint64_t recs;
+    bool indef;
+
+    if ((p = cbor_head(p, end, &major, &recs, &indef)) == NULL || (major != CBOR_ARRAY)) {
+        return -1;
+    }
+
+    while (cbor_more(&p, end, indef, &recs)) {
+        rec_t rec = { { "", 0 }, { "", 0 }, { "", 0 }, 0, false };
+        char vbuf[128];
+        char tmp[64];
+        uint64_t labels;
+        bool map_indef;
+
+        if ((p = cbor_head(p, end, &major, &labels, &map_indef)) == NULL || (major != CBOR_MAP)) {
+            return -1;
+        }
+
+        while (cbor_more(&p, end, map_indef, &labels)) {
+            span_t val;
+            int64_t label;
+
+            if ((p = cbor_int(p, end, &label)) == NULL) {
+                return -1;
+            }
+
+            switch (label) {
+                case SENML_BN:
+                    p = cbor_text(p, end, &pk->bn);
+                    pk->bn_sent = true;
+                    break;
+                case SENML_BT:
+                    p = cbor_number(p, end, tmp, sizeof(tmp), &pk->bt);
+                    break;
+                case SENML_T:
+                    p = cbor_number(p, end, tmp, sizeof(tmp), &rec.t);
+                    break;
+                case SENML_N:
+                    p = cbor_text(p, end, &rec.n);
+                    rec.has_rec = true;
+                    break;
+                case SENML_U:
+                    p = cbor_text(p, end, &rec.u);
+                    rec.has_rec = true;
+                    break;
+                case SENML_V:
+                case SENML_VS:
+                case SENML_VB:
+                    p = cbor_value(p, end, vbuf, sizeof(vbuf), &rec.v);
+                    rec.has_rec = true;
+                    break;
+                default:
+                    /* labels the gateway does not use */
+                    p = cbor_value(p, end, tmp, sizeof(tmp), &val);
+                    break;
+            }
+            if (p == NULL) {
+                return -1;
+            }
+        }
+
+        if (rec.has_rec && !emit(pk, &rec)) {
+            return -ENOBUFS;
+        }
+    }
+
+    return 0;
+}
+
+/* decodes a pack into records for the consumers, all or nothing: the
+ * records of a pack that turns out to be malformed are taken back */
+static int senml_decode(const coap_peer_t *peer, unsigned ct, const uint8_t *p, size_t len)
+{
+    char addr_str[INET6_ADDRSTRLEN];
+    char bn_str[BN_SIZE];
+    unsigned long records = cnt.records;
+    size_t mark = out_len;
+    pack_t pk;
+    int rc;
+
+    while (1) {
+        pack_init(&pk, peer, addr_str, bn_str);
+        if (ct == CT_SENML_CBOR) {
+            rc = senml_cbor(&pk, p, len);
+        }
+        else {
+            rc = senml_json(&pk, (const char *)p, len);
+        }
+        if (rc == 0) {
+            if (pk.bn_sent) {
+                bn_remember(peer, &pk.bn);
+            }
+            return 0;
+        }
+
+        out_len = mark;
+        cnt.records = records;
+
+        /* out is full, hand the packs before to the consumers and retry */
+        if ((rc != -ENOBUFS) || (mark == 0)) {
+            return -1;
+        }
+        publish();
+        mark = 0;
+    }
+}
+static reasm_t *reasm_find(const coap_peer_t *peer, bool first)
+{
+    reasm_t *free_slot = NULL;
+
+    for (unsigned i = 0; i < REASM_NUMOF; i++) {
+        reasm_t *r = &reasm[i];
+        bool used = (int32_t)(r->expire - now) > 0;
+
+        if (used && memcmp(&r->peer, peer, sizeof(*peer)) == 0) {
+            /* block 0 starts over, a transfer the node gave up on is
+             * dropped */
+            if (first) {
+                r->len = 0;
+            }
+            return r;
+        }
+        if (!used && free_slot == NULL) {
+            free_slot = r;
+        }
+    }
+
+    if (first && free_slot != NULL) {
+        free_slot->peer = *peer;
+        free_slot->len = 0;
+    }
+    return first ? free_slot : NULL;
+}
+
+/* Content-Format of the request, CT_TEXT if it has none */
+static unsigned content_format(const coap_packet_t *inpkt)
+{
+    const coap_option_t *opt;
+    unsigned ct = 0;
+    uint8_t count;
+
+    opt = coap_find_options(inpkt, COAP_OPTION_CONTENT_FORMAT, &count);
+    for (size_t i = 0; (opt != NULL) && (i < opt->val.len); i++) {
+        ct = (ct << 8) | opt->val.p[i];
+    }
+    return ct;
+}
+
+static int handle_post_senml(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    const coap_option_t *opt;
+    coap_block_t block;
+    coap_peer_t peer;
+    reasm_t *r;
+    uint8_t count;
+    size_t size;
+    unsigned ct = content_format(inpkt);
+
+    memcpy(&peer, rsp->peer, sizeof(peer));
+
+    if ((ct != CT_TEXT) && (ct != CT_JSON) && (ct != CT_SENML_JSON) && (ct != CT_SENML_CBOR)) {
+        return coap_enc_response(rsp, COAP_RSPCODE_UNSUPPORTED_FORMAT,
+                                 COAP_CONTENTTYPE_NONE, NULL, 0);
+    }
+
+    opt = coap_find_options(inpkt, COAP_OPTION_BLOCK1, &count);
+    if (opt == NULL) {
+        if (senml_decode(&peer, ct, inpkt->payload.p, inpkt->payload.len) != 0) {
+            cnt.bad++;
+            return coap_enc_response(rsp, COAP_RSPCODE_BAD_REQUEST,
+                                     COAP_CONTENTTYPE_NONE, NULL, 0);
+        }
+        return coap_enc_response(rsp, COAP_RSPCODE_CHANGED, COAP_CONTENTTYPE_NONE, NULL, 0);
+    }
+
+    if (coap_block_decode(opt, &block) != 0) {
+        return coap_enc_response(rsp, COAP_RSPCODE_BAD_OPTION, COAP_CONTENTTYPE_NONE, NULL, 0);
+    }
+    size = COAP_BLOCK_SIZE(block.szx);
+
+    /* blocks have to arrive in order, a lost one spoils the transfer */
+    r = reasm_find(&peer, block.num == 0);
+    if ((r == NULL) || (block.num * size != r->len)) {
+        if (r != NULL) {
+            r->expire = now;
+        }
+        return coap_enc_response(rsp, COAP_RSPCODE_ENTITY_INCOMPLETE,
+                                 COAP_CONTENTTYPE_NONE, NULL, 0);
+    }
+    if ((r->len + inpkt->payload.len > REASM_SIZE) ||
+        (block.more && inpkt->payload.len != size)) {
+        r->expire = now;
+        return coap_enc_response(rsp, COAP_RSPCODE_ENTITY_TOO_LARGE,
+                                 COAP_CONTENTTYPE_NONE, NULL, 0);
+    }
+    memcpy(&r->body[r->len], inpkt->payload.p, inpkt->payload.len);
+    r->len += inpkt->payload.len;
+    r->expire = now + REASM_TIMEOUT;
+
+    coap_enc_set_code(rsp, COAP_RSPCODE_CONTINUE);
+    if (!block.more) {
+        r->expire = now;
+        if (senml_decode(&peer, ct, r->body, r->len) != 0) {
+            cnt.bad++;
+            coap_enc_set_code(rsp, COAP_RSPCODE_BAD_REQUEST);
+        }
+        else {
+            coap_enc_set_code(rsp, COAP_RSPCODE_CHANGED);
+        }
+    }
+    coap_enc_block(rsp, COAP_OPTION_BLOCK1, &block);
+    return coap_enc_payload(rsp, NULL, 0);
+}
+
+static const coap_endpoint_path_t path_senml = { 1, { "senml" } };
+
+const coap_endpoint_t endpoints[] =
+{
+    { COAP_METHOD_POST, handle_post_senml, &path_senml, "ct=\"0 112\"" },
+    /* marks the end of the endpoints array: */
+    { (coap_method_t)0, NULL, NULL, NULL }
+};
+
+/* receives one batch, handles it and sends the replies */
+static void ingest(int sock)
+{
+    struct timespec ts;
+    unsigned replies = 0;
+    int n;
+
+    n = recvmmsg(sock, rx_msg, BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+        return;
+    }
+    now = now_ms();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rx_time = ts.tv_sec + ts.tv_nsec / 1e9;
+
+    for (int i = 0; i < n; i++) {
+        coap_ctx_t *c = ctx[i];
+        bool con;
+
+        memcpy(c->peer.addr, &src[i].sin6_addr, sizeof(c->peer.addr));
+        c->peer.port = ntohs(src[i].sin6_port);
+        c->rxlen = rx_msg[i].msg_len;
+
+        /* the datagram did not fit into the receive buffer and was cut */
+        if (rx_msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            cnt.bad++;
+            continue;
+        }
+        con = (c->rxlen > 0) && (((c->rx[0] >> 4) & 0x03) == COAP_TYPE_CON);
+
+        /* CON requests get a piggybacked reply, NON ones a NON reply */
+        if (coap_ctx_handle(c, now, con, false) < 0 || c->txlen == 0) {
+            continue;
+        }
+
+        tx_iov[replies].iov_base = c->tx;
+        tx_iov[replies].iov_len = c->txlen;
+        tx_msg[replies].msg_hdr.msg_name = &src[i];
+        tx_msg[replies].msg_hdr.msg_namelen = sizeof(src[i]);
+        replies++;
+    }
+    cnt.pkts += n;
+
+    /* sendmmsg() stops at the first reply that fails: that one is skipped
+     * and the rest sent again, unless the socket is full. The nodes repeat
+     * CON requests whose reply got lost */
+    for (unsigned sent = 0; sent < replies; ) {
+        int rc = sendmmsg(sock, &tx_msg[sent], replies - sent, MSG_DONTWAIT);
+
+        if (rc > 0) {
+            sent += rc;
+        }
+        else if ((rc < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+            cnt.unsent++;
+            sent++;
+        }
+        else {
+            cnt.unsent += replies - sent;
+            break;
+        }
+    }
+    publish();
+
+    /* recvmmsg() overwrites the name lengths */
+    for (int i = 0; i < n; i++) {
+        rx_msg[i].msg_hdr.msg_namelen = sizeof(src[i]);
+    }
+}
+
+static int udp_open(uint16_t port)
+{
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port),
+                                 .sin6_addr = IN6ADDR_ANY_INIT };
+    int size = RCVBUF_SIZE;
+    int no = 0;
+    int sock = socket(AF_INET6, SOCK_DGRAM, 0);
+
+    if (sock < 0) {
+        return -1;
+    }
+    /* nodes reporting over IPv4 end up here as mapped addresses */
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int unix_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+
+    if (sock < 0 || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = DEFAULT_SOCKET;
+    uint16_t port = DEFAULT_PORT;
+    bool verbose = false;
+    uint32_t report;
+    unsigned long last_pkts = 0, last_records = 0;
+    struct pollfd fds[2];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:u:v")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = (uint16_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                path = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                printf("usage: %s [-p port] [-u socket] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (coap_init() != 0) {
+        puts("error: unable to build the routing trie");
+        return 1;
+    }
+
+    /* one context per slot of a batch, kept for good */
+    for (unsigned i = 0; i < BATCH; i++) {
+        ctx[i] = coap_ctx_acquire();
+        rx_iov[i].iov_base = ctx[i]->rx;
+        rx_iov[i].iov_len = sizeof(ctx[i]->rx);
+        rx_msg[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx_msg[i].msg_hdr.msg_iovlen = 1;
+        rx_msg[i].msg_hdr.msg_name = &src[i];
+        rx_msg[i].msg_hdr.msg_namelen = sizeof(src[i]);
+        tx_msg[i].msg_hdr.msg_iov = &tx_iov[i];
+        tx_msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    fds[0].fd = udp_open(port);
+    fds[1].fd = unix_open(path);
+    if (fds[0].fd < 0 || fds[1].fd < 0) {
+        printf("error: unable to open the sockets: %s\n", strerror(errno));
+        return 1;
+    }
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    printf("ingesting SenML on port %u, records on %s\n", (unsigned)port, path);
+
+    report = now_ms() + 1000;
+    while (running) {
+        if (poll(fds, 2, 1000) < 0) {
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            int c = accept4(fds[1].fd, NULL, NULL, SOCK_NONBLOCK);
+            if (c >= 0 && consumers < CONSUMERS_MAX) {
+                consumer[consumers++] = c;
+            }
+            else if (c >= 0) {
+                close(c);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            ingest(fds[0].fd);
+        }
+
+        if (verbose && (int32_t)(now_ms() - report) >= 0) {
+            printf("%lu pkts/s, %lu records/s, %lu bad, %lu lost, %lu unsent, %u consumers\n",
+                   cnt.pkts - last_pkts, cnt.records - last_records,
+                   cnt.bad, cnt.lost, cnt.unsent, consumers);
+            last_pkts = cnt.pkts;
+            last_records = cnt.records;
+            report = now_ms() + 1000;
+        }
+    }
+
+    unlink(path);
+    return 0;
+}
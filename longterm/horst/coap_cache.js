@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/**
+ * @fileoverview    Response cache for GET requests to the nodes, so repeated
+ *                  reads of the same resource do not all cross the 6LoWPAN
+ *                  link
+ *
+ * Responses are kept per (node, Uri-Path, Uri-Query, Accept) for as long as their
+ * Max-Age allows. Stale entries that carry an ETag are revalidated instead of
+ * fetched again, and concurrent requests for the same key share a single
+ * upstream request.
+ *
+ * Usage:   var cache = require('./coap_cache')(require('coap'));
+ *          cache.get({'host': addr, 'path': '/temp'}, function(err, entry) {
+ *              ...entry.code, entry.payload...
+ *          });
+ */
+
+const DEFAULT_MAX_AGE   = 60;       /* Max-Age if a response has none [in s] */
+const CACHE_SIZE        = 64;       /* number of responses kept */
+
+module.exports = function(coap) {
+    /* cached 2.05 responses, oldest first */
+    var entries = new Map();
+    /* keys with a request to the node in flight, mapped to the callbacks
+     * waiting for it */
+    var pending = {};
+
+    var stats = {'hits': 0, 'misses': 0, 'revalidated': 0, 'collapsed': 0};
+
+    /* raw value of the first option called @p name, undefined if none */
+    var option = function(msg, name) {
+        for (var i = 0; i < msg.options.length; i++) {
+            if (msg.options[i].name == name) {
+                return msg.options[i].value;
+            }
+        }
+        return undefined;
+    }
+
+    var uint = function(buf) {
+        var val = 0;
+        for (var i = 0; i < buf.length; i++) {
+            val = val * 256 + buf[i];
+        }
+        return val;
+    }
+
+    var key_of = function(ctx) {
+        return ctx.host + ' ' + (ctx.port || '') + ' ' + ctx.path + ' ' +
+               (ctx.query || '') + ' ' + (ctx.accept ? ctx.accept.toString('hex') : '');
+    }
+
+    var store = function(key, entry) {
+        entries.delete(key);
+        entries.set(key, entry);
+        if (entries.size > CACHE_SIZE) {
+            entries.delete(entries.keys().next().value);
+        }
+    }
+
+    var fetch = function(key, ctx, stale) {
+        /* node-coap may report a failed request more than once */
+        var finished = false;
+        var done = function(err, entry) {
+            if (finished) {
+                return;
+            }
+            finished = true;
+            var cbs = pending[key];
+            delete pending[key];
+            for (var i = 0; i < cbs.length; i++) {
+                cbs[i](err, entry);
+            }
+        }
+
+        var opts = {'host': ctx.host,
+                    'method': 'GET',
+                    'pathname': ctx.path,
+                    'query': ctx.query || '',
+                    'confirmable': true};
+        if (ctx.port) {
+            opts.port = ctx.port;
+        }
+        var req = coap.request(opts);
+        if (ctx.accept) {
+            req.setOption('Accept', ctx.accept);
+        }
+        if (stale && stale.etag) {
+            req.setOption('ETag', stale.etag);
+        }
+
+        req.on('response', function(res) {
+            var max_age = option(res, 'Max-Age');
+            var expires = Date.now() + 1000 *
+                          ((max_age === undefined) ? DEFAULT_MAX_AGE : uint(max_age));
+
+            if (res.code == '2.03' && stale) {
+                stats.revalidated++;
+                stale.expires = expires;
+                store(key, stale);
+                done(null, stale);
+                return;
+            }
+
+            var entry = {'code': res.code,
+                         'format': option(res, 'Content-Format'),
+                         'etag': option(res, 'ETag'),
+                         'payload': res.payload,
+                         'expires': expires};
+            if (res.code == '2.05') {
+                store(key, entry);
+            }
+            else {
+                entries.delete(key);
+            }
+            done(null, entry);
+        });
+        req.on('timeout', function(err) {
+            done(err || new Error('timeout'));
+        });
+        req.on('error', function(err) {
+            done(err);
+        });
+        req.end();
+    }
+
+    /**
+     * Get a resource from a node, from the cache if it is still fresh.
+     *
+     * @param ctx   {'host', 'port', 'path', 'query', 'accept'}, port, query
+     *              (without '?', split into Uri-Query options at '&') and
+     *              accept (the raw option value) are optional
+     * @param cb    called as cb(err, entry), entry holds the response code,
+     *              the raw Content-Format and ETag values, the payload and
+     *              the time it expires [in ms]
+     */
+    var get = function(ctx, cb) {
+        var key = key_of(ctx);
+        var entry = entries.get(key);
+
+        if (entry && entry.expires > Date.now()) {
+            stats.hits++;
+            store(key, entry);
+            cb(null, entry);
+            return;
+        }
+        if (key in pending) {
+            stats.collapsed++;
+            pending[key].push(cb);
+            return;
+        }
+        stats.misses++;
+        pending[key] = [cb];
+        fetch(key, ctx, entry);
+    }
+
+    return {'get': get, 'option': option, 'stats': stats};
+}
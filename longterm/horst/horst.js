@@ -32,10 +32,18 @@ const WEB_PORT      = 12345;
 const WEB_DIR       = __dirname + '/web';
 
 const DB_UPDATE_INT = 500;      /* how often to update the node list [in ms] */
-const STALE_TIME    = 2000;     /* time until a node gets stale [in ms] */
+const STALE_TIME    = 150000;   /* time until a node gets stale, the nodes send
+                                 * at least one report a minute [in ms] */
 
 const DATA_HISTORY  = 50;      /* save this amount of datapoints per device */
 
+const EXCHANGE_LIFETIME = 247000;   /* remember message IDs this long [in ms] */
+
+const CT_SENML_CBOR = 112;      /* Content-Format of SenML-CBOR packs */
+
+const SENML_REL_TIME = 268435456;   /* SenML times below 2^28 s are relative
+                                     * to the time of reception */
+
 /**
  * Load Node packages and initialize global variables
  */
@@ -45,19 +53,51 @@ var exp_app         = require('express')();
 var web_server      = require('http').createServer(exp_app);
 var web_sock        = require('socket.io')(web_server);
 var fs              = require('fs');
+var url             = require('url');
+var coap_cache      = require('./coap_cache')(coap);
+var senml_cbor      = require('./senml_cbor');
 
 /**
  * This object holds known and previously known devices
  */
 var nodes = {};
 
+/**
+ * Message IDs seen recently, mapped to the time they may be forgotten
+ */
+var seen_mids = {};
+
+/**
+ * Base names by source address, for packs that leave the base name out
+ */
+var node_ids = {};
+
+/* the base name the nodes use, derived from the interface identifier of
+ * their address */
+var bn_from_addr = function(addr) {
+    var parts = addr.split('%')[0].split('::');
+    var head = parts[0] ? parts[0].split(':') : [];
+    var tail = (parts.length > 1 && parts[1]) ? parts[1].split(':') : [];
+    var groups = head.concat(new Array(8 - head.length - tail.length).fill('0'), tail);
+    var iid = groups.slice(4).map(function(g) {
+        return ('0000' + g).slice(-4);
+    });
+    return 'urn:dev:mac:' + iid.join('');
+}
+
 var db_update_senml = function(data, src_ip){
     /* check data */
-    if (!Array.isArray(data) || (data[0].bn == undefined)) {
+    if (!Array.isArray(data) || (data.length == 0)) {
         throw("invalid SenML input");
     }
 
     var id = data[0].bn;
+    if (id == undefined) {
+        id = node_ids[src_ip] || bn_from_addr(src_ip);
+    }
+    else {
+        node_ids[src_ip] = id;
+    }
     var now = Date.now();
 
     if (nodes[id] == undefined) {
@@ -72,22 +112,35 @@ var db_update_senml = function(data, src_ip){
     node.update = now;
     node.ip = src_ip;
 
+    /* batched readings carry their time, as offset to the base time */
+    var bt = data[0].bt || 0;
+    for (var k in node.devs) {
+        node.devs[k].fresh = 0;
+    }
+
     for (var i = 1; i < data.length; i++) {
         var sendev = data[i];
         if (!(sendev.n in node.devs)) {
             node.devs[sendev.n] = {
-                'unit': sendev.u,
+                'unit': '',
                 'time': [],
-                'vals': []
+                'vals': [],
+                'fresh': 0      /* values added by this pack */
             }
         }
         var dev = node.devs[sendev.n];
+        /* units are only sent now and then */
+        if (sendev.u != undefined) {
+            dev.unit = sendev.u;
+        }
         if (dev.time.length > DATA_HISTORY) {
             dev.time.pop();
             dev.vals.pop();
         }
-        dev.time.unshift(now);
+        var t = bt + (sendev.t || 0);
+        dev.time.unshift(Math.round((t < SENML_REL_TIME) ? now + t * 1000 : t * 1000));
         dev.vals.unshift(sendev.v);
+        dev.fresh++;
     }
 
     console.log("udpate from", id, '[' + node.ip + ']');
@@ -98,10 +151,26 @@ var db_update_senml = function(data, src_ip){
  * Define some CoAP helpers
  */
 var coap_resp = function(code, res, data) {
+    /* the client asked not to get responses of this class, a CON request
+     * still gets its empty ACK from node-coap */
+    if (res.noresp & (1 << (Math.floor(code / 100) - 1))) {
+        return;
+    }
     res.statusCode = code;
     res.end(data);
 }
 
+/* value of the No-Response option (RFC 7967), 0 if the request has none */
+var no_response = function(req) {
+    var opts = req._packet.options;
+    for (var i = 0; i < opts.length; i++) {
+        if (opts[i].name == '258' && opts[i].value.length == 1) {
+            return opts[i].value[0];
+        }
+    }
+    return 0;
+}
+
 /**
  * Definition of CoAP endpoints
  */
@@ -112,7 +181,27 @@ var ep_senml = function(req, res) {
     }
 
     try {
-        var data = JSON.parse(req.payload);
+        var ct = coap_cache.option(req._packet, 'Content-Format');
+        var data;
+        if (ct && ct.length > 0 && ct.readUIntBE(0, ct.length) == CT_SENML_CBOR) {
+            data = senml_cbor.decode(req.payload);
+            /* same shape as the JSON packs: base record first, values in v,
+             * booleans as 0 and 1 */
+            if (data.length == 0 || data[0].n != undefined) {
+                data.unshift({});
+            }
+            data.forEach(function(rec) {
+                if (rec.vs != undefined) {
+                    rec.v = rec.vs;
+                }
+                else if (rec.vb != undefined) {
+                    rec.v = (rec.vb) ? 1 : 0;
+                }
+            });
+        }
+        else {
+            data = JSON.parse(req.payload);
+        }
         db_update_senml(data, req.rsinfo.address);
         coap_resp(204, res);
     } catch (e) {
@@ -121,21 +210,27 @@ var ep_senml = function(req, res) {
     }
 }
 
+/* the endpoint table does not change at runtime, so the link-format
+ * listing is built on the first discovery request and reused after that */
+var core_links = null;
+
 var ep_wellknown_core = function(req, res) {
     console.log('EP_WELLKNOWN_CORE');
 
-    var links = "";
-
-    for (ep in eps) {
-        links += "<" + ep + ">";
-        for (l in eps[ep].desc) {
-            links += ';' + l + '="' + eps[ep]['desc'][l] + '"';
+    if (core_links === null) {
+        var links = [];
+        for (ep in eps) {
+            var link = "<" + ep + ">";
+            for (l in eps[ep].desc) {
+                link += ';' + l + '="' + eps[ep]['desc'][l] + '"';
+            }
+            links.push(link);
         }
-        links += ",";
+        core_links = links.join(",");
     }
 
     res.setOption("Content-Format", "application/link-format");
-    res.end(links);
+    res.end(core_links);
 }
 
 var ep_test = function(req, res) {
@@ -146,6 +241,52 @@ var ep_test = function(req, res) {
     res.end(JSON.stringify(foo));
 }
 
+/* forward proxy for GET requests carrying a Proxy-Uri, answered from the
+ * cache where possible */
+var ep_proxy = function(req, res, uri) {
+    console.log('EP_PROXY', uri);
+
+    /* the proxy only forwards reads */
+    if (req.method != 'GET') {
+        coap_resp(405, res);
+        return;
+    }
+    var target = url.parse(uri);
+    if (target.protocol != 'coap:' || !target.hostname) {
+        coap_resp(505, res);
+        return;
+    }
+
+    var ctx = {'host': target.hostname,
+               'port': target.port,
+               'path': target.pathname || '/',
+               'query': target.query || '',
+               'accept': coap_cache.option(req._packet, 'Accept')};
+    coap_cache.get(ctx, function(err, entry) {
+        if (err) {
+            coap_resp(504, res);
+            return;
+        }
+        var code = parseInt(entry.code.replace('.', ''));
+        if (code == 205) {
+            var max_age = Math.max(0, Math.ceil((entry.expires - Date.now()) / 1000));
+            res.setOption('Max-Age', max_age);
+            if (entry.etag) {
+                res.setOption('ETag', entry.etag);
+                var etag = coap_cache.option(req._packet, 'ETag');
+                if (etag && etag.equals(entry.etag)) {
+                    coap_resp(203, res);
+                    return;
+                }
+            }
+            if (entry.format) {
+                res.setOption('Content-Format', entry.format);
+            }
+        }
+        coap_resp(code, res, entry.payload);
+    });
+}
+
 var eps = {
     '/.well-known/core': {
         'cb': ep_wellknown_core,
@@ -165,7 +306,21 @@ var eps = {
  * Setup CoAP server
  */
 coap_server.on('request', function(req, res) {
-    if (req.url in eps) {
+    /* link layer retries of NON requests must not be processed twice,
+     * node-coap takes care of CON duplicates itself */
+    var mid_key = req.rsinfo.address + '%' + req.rsinfo.port + '#' + req._packet.messageId;
+    var now = Date.now();
+    if (seen_mids[mid_key] > now) {
+        return;
+    }
+    seen_mids[mid_key] = now + EXCHANGE_LIFETIME;
+
+    res.noresp = no_response(req);
+    var proxy_uri = coap_cache.option(req._packet, 'Proxy-Uri');
+    if (proxy_uri) {
+        ep_proxy(req, res, proxy_uri.toString());
+    }
+    else if (req.url in eps) {
         eps[req.url].cb(req, res);
     }
     else {
@@ -173,6 +328,15 @@ coap_server.on('request', function(req, res) {
     }
 });
 
+setInterval(function() {
+    var now = Date.now();
+    for (var key in seen_mids) {
+        if (seen_mids[key] <= now) {
+            delete seen_mids[key];
+        }
+    }
+}, EXCHANGE_LIFETIME);
+
 /**
  * Setup routes for the web server
  */
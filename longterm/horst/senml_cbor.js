@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+
+/**
+ * @fileoverview    Decoder for SenML-CBOR packs (RFC 8428, Content-Format 112)
+ *
+ * Turns a pack into the same array of records JSON.parse() gives for a SenML
+ * JSON pack, with the integer labels replaced by their JSON names. Decimal
+ * fractions (tag 4), as sent by the nodes for fixed-point values, become
+ * plain numbers.
+ *
+ * Usage:   var data = require('./senml_cbor').decode(req.payload);
+ */
+
+/* SenML labels and their JSON names */
+const LABELS = {
+    '-2': 'bn', '-3': 'bt', '-4': 'bu', '-5': 'bv', '-6': 'bs', '-1': 'bver',
+    '0': 'n', '1': 'u', '2': 'v', '3': 'vs', '4': 'vb', '5': 's', '6': 't',
+    '7': 'ut', '8': 'vd'
+};
+
+const BREAK = {};
+
+var decode_item = function(buf, st) {
+    if (st.pos >= buf.length) {
+        throw("truncated CBOR");
+    }
+    var ib = buf[st.pos++];
+    var major = ib >> 5;
+    var info = ib & 0x1f;
+    var arg;
+
+    if (ib == 0xff) {
+        return BREAK;
+    }
+    if (major == 7) {
+        switch (info) {
+            case 20: return false;
+            case 21: return true;
+            case 22: return null;
+            case 23: return undefined;
+            case 25: st.pos += 2; return half(buf.readUInt16BE(st.pos - 2));
+            case 26: st.pos += 4; return buf.readFloatBE(st.pos - 4);
+            case 27: st.pos += 8; return buf.readDoubleBE(st.pos - 8);
+            default: throw("unsupported CBOR simple value");
+        }
+    }
+
+    if (info < 24) {
+        arg = info;
+    }
+    else if (info == 24) {
+        arg = buf.readUInt8(st.pos);
+        st.pos += 1;
+    }
+    else if (info == 25) {
+        arg = buf.readUInt16BE(st.pos);
+        st.pos += 2;
+    }
+    else if (info == 26) {
+        arg = buf.readUInt32BE(st.pos);
+        st.pos += 4;
+    }
+    else if (info == 27) {
+        arg = buf.readUInt32BE(st.pos) * 0x100000000 + buf.readUInt32BE(st.pos + 4);
+        st.pos += 8;
+    }
+    else if (info == 31 && major >= 2 && major <= 5) {
+        arg = -1;           /* indefinite length */
+    }
+    else {
+        throw("invalid CBOR");
+    }
+
+    switch (major) {
+        case 0:
+            return arg;
+        case 1:
+            return -1 - arg;
+        case 2:
+        case 3:
+            if (arg < 0) {
+                throw("indefinite CBOR strings are not supported");
+            }
+            if (st.pos + arg > buf.length) {
+                throw("truncated CBOR");
+            }
+            var str = buf.slice(st.pos, st.pos + arg);
+            st.pos += arg;
+            return (major == 2) ? str : str.toString('utf8');
+        case 4:
+            var arr = [];
+            for (var i = 0; arg < 0 || i < arg; i++) {
+                var item = decode_item(buf, st);
+                if (item === BREAK) {
+                    if (arg < 0) {
+                        break;
+                    }
+                    throw("invalid CBOR");
+                }
+                arr.push(item);
+            }
+            return arr;
+        case 5:
+            var map = {};
+            for (var i = 0; arg < 0 || i < arg; i++) {
+                var key = decode_item(buf, st);
+                if (key === BREAK) {
+                    if (arg < 0) {
+                        break;
+                    }
+                    throw("invalid CBOR");
+                }
+                map[key] = decode_item(buf, st);
+            }
+            return map;
+        case 6:
+            var content = decode_item(buf, st);
+            /* decimal fraction [exponent, mantissa] */
+            if (arg == 4 && Array.isArray(content) && content.length == 2) {
+                return Number((content[1] * Math.pow(10, content[0])).toFixed(Math.max(0, -content[0])));
+            }
+            return content;
+    }
+}
+
+var half = function(h) {
+    var exp = (h >> 10) & 0x1f;
+    var mant = h & 0x3ff;
+    var val;
+
+    if (exp == 0) {
+        val = mant * Math.pow(2, -24);
+    }
+    else if (exp == 31) {
+        val = (mant == 0) ? Infinity : NaN;
+    }
+    else {
+        val = (mant + 1024) * Math.pow(2, exp - 25);
+    }
+    return (h & 0x8000) ? -val : val;
+}
+
+/**
+ * Decode a SenML-CBOR pack.
+ *
+ * @param buf   the payload
+ * @return      array of records with JSON labels, throws on malformed input
+ */
+var decode = function(buf) {
+    var st = {'pos': 0};
+    var pack = decode_item(buf, st);
+
+    if (!Array.isArray(pack) || st.pos != buf.length) {
+        throw("invalid SenML-CBOR pack");
+    }
+    return pack.map(function(rec) {
+        var res = {};
+        for (var key in rec) {
+            res[(key in LABELS) ? LABELS[key] : key] = rec[key];
+        }
+        return res;
+    });
+}
+
+module.exports = {'decode': decode};
@@ -40,7 +40,8 @@ const VIEW_A_LED    = 'a:led';
 const VIEW_A_BUTTON = 's:btn';
 const VIEW_A_WINDOW = 'a:window';
 
-const STALE_TIME    = 5000;     /* node gets stale if no updated in 5 seconds */
+const STALE_TIME    = 150000;   /* node gets stale if not updated in 2.5 minutes,
+                                 * unchanged values are only sent once a minute */
 
 /**
  * Define some global variables
@@ -423,13 +424,18 @@ var add_chart = function(k, dev) {
 }
 
 var update_chart = function(k, dev) {
-    if (Array.isArray(dev.vals[0])) {
-        for (var i = 0; i < dev.vals[0].length; i++) {
-            charts[k].data[i].append(dev.time[0], dev.vals[0][i]);
+    /* a batch brings several values, the newest first */
+    var fresh = Math.max(1, Math.min(dev.fresh || 0, dev.time.length));
+
+    for (var s = fresh - 1; s >= 0; s--) {
+        if (Array.isArray(dev.vals[s])) {
+            for (var i = 0; i < dev.vals[s].length; i++) {
+                charts[k].data[i].append(dev.time[s], dev.vals[s][i]);
+            }
+        }
+        else {
+            charts[k].data[0].append(dev.time[s], dev.vals[s]);
         }
-    }
-    else {
-        charts[k].data[0].append(dev.time[0], dev.vals[0]);
     }
 };
 
@@ -444,11 +450,21 @@ socket.on('init', function(data) {
 socket.on('update', function(data) {
     var new_node = !(data.id in nodes);
 
-    /* hack: update time stamps */
+    /* hack: update time stamps, the new values of a batch keep their
+     * spacing */
     var now = Date.now();
+    var skew = now - data.node.update;
     data.node.update = now;
     for (k in data.node.devs) {
-        data.node.devs[k].time[0] = now;
+        var dev = data.node.devs[k];
+        if (dev.fresh > 0) {
+            for (var s = 0; s < dev.fresh && s < dev.time.length; s++) {
+                dev.time[s] += skew;
+            }
+        }
+        else {
+            dev.time[0] = now;
+        }
     }
 
     nodes[data.id] = data.node;
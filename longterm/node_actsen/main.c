@@ -28,23 +28,27 @@
 #include "board.h"
 #include "shell.h"
 #include "xtimer.h"
+#include "mutex.h"
 #include "net/gnrc.h"
 #include "net/gnrc/ipv6.h"
 #include "net/gnrc/udp.h"
 #include "net/conn.h"
 #include "net/conn/udp.h"
 #include "coap.h"
+#include "senml.h"
 #include "saul_reg.h"
 #include "periph/gpio.h"
 
 #define UPDATE_INTERVAL     (1000 * 1000U)
-#define EVT_REPEAT_DELAY    (1000)
+#define HEARTBEAT_INTERVAL  (60 * 1000U)    /* full report at least this often [in ms] */
 #define DEBOUNCE_TIME       (50 * 1000)
-
-#define EVT_REPEAT          (2)
+#define EVT_TIMEOUT         (93 * 1000U)    /* MAX_TRANSMIT_WAIT [in ms] */
 
 #define MSG_UPDATE_EVENT    (0x3338)
 #define MSG_BUTTON_EVENT    (0x3339)
+#define MSG_CON_TIMER       (0x333a)
+#define MSG_SENSOR_READ     (0x333b)
+#define MSG_BLOCK1_DONE     (0x333c)
 
 
 #define Q_SZ                (8)
@@ -52,32 +56,65 @@
 #define COAP_SERVER_PORT    (5683)
 #define SPORT               (1234)
 #define UDP_PORT            (5683)
-#define MAX_RESPONSE_LEN    500
 
 static msg_t _coap_msg_q[Q_SZ], _beac_msg_q[Q_SZ];
 static char coap_stack[THREAD_STACKSIZE_MAIN], beac_stack[THREAD_STACKSIZE_MAIN];
 
-static uint8_t udp_buf[512];
-static uint8_t scratch_raw[1024];      /* microcoap scratch buffer */
-static coap_rw_buffer_t scratch_buf = { scratch_raw, sizeof(scratch_raw) };
 static ipv6_addr_t dst_addr;
 
 static xtimer_t debounce_timer;
 
-/* buffer for composing SemML messages in */
-static char p_buf[512];
+/* request template for SenML reports, the pack is composed in place behind
+ * the CoAP header */
+static uint8_t snd_buf[512];
+static coap_template_t senml_tpl;
+static char *p_buf;
+static size_t p_size;
 static size_t initial_pos;
 
-static uint8_t response[MAX_RESPONSE_LEN] = { 0 };
+/* one block of a SenML pack plus header, Uri-Path and Block1 option */
+static uint8_t blk_buf[COAP_BLOCK_SIZE(COAP_BLOCK_SZX) + 32];
+
+/* larger packs are uploaded one confirmable block at a time, the pack and
+ * blk_buf belong to the upload until the gateway answered the last block */
+static coap_block1_tx_t blk_tx;
+static bool blk_busy;
+
+/* reporting policy, the LED and the button are sent when they change and with
+ * every heartbeat */
+static senml_field_t heartbeat = SENML_FIELD(0, 0, HEARTBEAT_INTERVAL);
+static senml_field_t fld_led = SENML_FIELD(0, 0, 0);
+static senml_field_t fld_button = SENML_FIELD(0, 0, 0);
+
+/* button events are sent as confirmable requests, evt_buf belongs to the
+ * request table until the gateway responded or the event is given up on */
+static uint8_t evt_buf[128];
+static uint16_t evt_mid;
+static bool evt_pending;
+static unsigned evt_sent, evt_lost;
+/* room for a 4 byte token, the value is replaced by coap_req_send() */
+static const uint8_t evt_tok[4];
+static const coap_buffer_t evt_token = { evt_tok, sizeof(evt_tok) };
+static coap_peer_t gw_peer;
+static xtimer_t con_timer;
+static msg_t con_msg = { .type = MSG_CON_TIMER };
+
+/* notifications to observers of the button are encoded in here */
+static uint8_t obs_buf[64];
+
+/* separate responses to GET /temp, one buffer per pending request, each is
+ * owned by the transmission table until the response is acknowledged */
+static uint8_t sep_buf[COAP_SEP_MAX][64];
+static kernel_pid_t beac_pid = KERNEL_PID_UNDEF;
 
 
 
 static const coap_endpoint_path_t path_riot_board = { 2, { "riot", "board" } };
 static const coap_endpoint_path_t path_led = {1, {"led"} };
+static const coap_endpoint_path_t path_button = {1, {"button"} };
+static const coap_endpoint_path_t path_temp = {1, {"temp"} };
 
-static int handle_post_led(coap_rw_buffer_t *scratch,
-                                 const coap_packet_t *inpkt, coap_packet_t *outpkt,
-                                 uint8_t id_hi, uint8_t id_lo)
+static int handle_post_led(const coap_packet_t *inpkt, coap_encoder_t *rsp)
 {
     coap_responsecode_t resp = COAP_RSPCODE_CHANGED;
     printf("Hello, we got a post request to LED\n");
@@ -95,66 +132,99 @@ static int handle_post_led(coap_rw_buffer_t *scratch,
     }
 
 
-    return coap_make_response(scratch, outpkt, NULL, 0,
-                              id_hi, id_lo, &inpkt->token, resp,
-                              COAP_CONTENTTYPE_TEXT_PLAIN, false);
+    return coap_enc_response(rsp, resp, COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
 }
 
-static int handle_get_riot_board(coap_rw_buffer_t *scratch,
-                                 const coap_packet_t *inpkt, coap_packet_t *outpkt,
-                                 uint8_t id_hi, uint8_t id_lo)
+static int handle_get_riot_board(const coap_packet_t *inpkt, coap_encoder_t *rsp)
 {
-    const char *riot_name = RIOT_BOARD;
-    int len = strlen(RIOT_BOARD);
+    return coap_enc_block2_response(rsp, inpkt, COAP_RSPCODE_CONTENT,
+                                    COAP_CONTENTTYPE_TEXT_PLAIN,
+                                    (const uint8_t *)RIOT_BOARD, strlen(RIOT_BOARD));
+}
 
-    memcpy(response, riot_name, len);
+static int handle_get_button(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    (void)inpkt;
+    uint8_t btn = (gpio_read(BUTTON_GPIO)) ? '0' : '1';
 
-    return coap_make_response(scratch, outpkt, (const uint8_t *)response, len,
-                              id_hi, id_lo, &inpkt->token, COAP_RSPCODE_CONTENT,
-                              COAP_CONTENTTYPE_TEXT_PLAIN, false);
+    return coap_enc_response(rsp, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN, &btn, 1);
+}
+
+/* the sensor sits on I2C and may take a while, so the request is handed to
+ * the beaconing thread and answered separately (see send_temp()) */
+static int handle_get_temp(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    msg_t m = { .type = MSG_SENSOR_READ };
+    int id;
+
+    if (coap_defer(inpkt, rsp, &id) != 0) {
+        return coap_enc_response(rsp, COAP_RSPCODE_SERVICE_UNAVAILABLE,
+                                 COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
+    }
+
+    m.content.value = id;
+    msg_send(&m, beac_pid);
+    return 0;
 }
 
 const coap_endpoint_t endpoints[] =
 {
     { COAP_METHOD_GET,	handle_get_riot_board, &path_riot_board, "ct=0" },
     { COAP_METHOD_POST,  handle_post_led, &path_led, "ct=0" },
+    { COAP_METHOD_GET,   handle_get_button, &path_button, "ct=0;obs" },
+    { COAP_METHOD_GET,   handle_get_temp, &path_temp, "ct=0" },
     /* marks the end of the endpoints array: */
     { (coap_method_t)0, NULL, NULL, NULL }
 };
 
+/* microcoap's shared state (messages in flight, observers, duplicate cache,
+ * IDs) is used from more than one thread */
+static mutex_t coap_mutex = MUTEX_INIT;
+
+void coap_lock(void)
+{
+    mutex_lock(&coap_mutex);
+}
+
+void coap_unlock(void)
+{
+    mutex_unlock(&coap_mutex);
+}
+
+#ifdef COAP_WITH_STATS
+/* handler times for GET /.well-known/stats */
+uint32_t coap_stats_usec(void)
+{
+    return xtimer_now();
+}
+#endif
+
 void *microcoap_server(void *arg)
 {
     (void) arg;
     msg_init_queue(_coap_msg_q, Q_SZ);
 
     uint8_t laddr[16] = { 0 };
-    uint8_t raddr[16] = { 0 };
     size_t raddr_len;
-    uint16_t rport;
     conn_udp_t conn;
     int rc = conn_udp_create(&conn, laddr, sizeof(laddr), AF_INET6, COAP_SERVER_PORT);
+    /* this thread is the only worker, it keeps its context for good */
+    coap_ctx_t *ctx = coap_ctx_acquire();
 
     while (1) {
-        if ((rc = conn_udp_recvfrom(&conn, (char *)udp_buf, sizeof(udp_buf),
-                                    raddr, &raddr_len, &rport)) < 0) {
+        if ((rc = conn_udp_recvfrom(&conn, (char *)ctx->rx, sizeof(ctx->rx),
+                                    ctx->peer.addr, &raddr_len, &ctx->peer.port)) < 0) {
             continue;
         }
+        ctx->rxlen = rc;
+
+        /* parse, drop duplicates and handle, the reply is encoded into ctx->tx */
+        coap_ctx_handle(ctx, (uint32_t)(xtimer_now64() / 1000), false, false);
 
-        coap_packet_t pkt;
-        /* parse UDP packet to CoAP */
-        if (0 == (rc = coap_parse(&pkt, udp_buf, rc))) {
-            coap_packet_t rsppkt;
-
-            /* handle CoAP request */
-            coap_handle_req(&scratch_buf, &pkt, &rsppkt, false, false);
-
-            /* build reply */
-            size_t rsplen = sizeof(udp_buf);
-            if ((rc = coap_build(udp_buf, &rsplen, &rsppkt)) == 0) {
-                /* send reply via UDP */
-                rc = conn_udp_sendto(udp_buf, rsplen, NULL, 0, raddr, raddr_len,
-                                     AF_INET6, COAP_SERVER_PORT, rport);
-            }
+        /* send reply via UDP */
+        if (ctx->txlen > 0) {
+            rc = conn_udp_sendto(ctx->tx, ctx->txlen, NULL, 0, ctx->peer.addr, raddr_len,
+                                 AF_INET6, COAP_SERVER_PORT, ctx->peer.port);
         }
     }
 
@@ -162,33 +232,127 @@ void *microcoap_server(void *arg)
     return NULL;
 }
 
-void send_coap_post(uint8_t *data, size_t len)
+static void senml_tpl_init(void)
+{
+    coap_encoder_t enc;
+    size_t len;
+
+    coap_enc_init(&enc, snd_buf, sizeof(snd_buf), COAP_TYPE_NONCON,
+                  COAP_METHOD_POST, 0, 0, NULL);
+    coap_enc_option(&enc, COAP_OPTION_URI_PATH, (const uint8_t *)"senml", 5);
+#if SENML_CONTENT_FORMAT >= 0
+    coap_enc_option_uint(&enc, COAP_OPTION_CONTENT_FORMAT, SENML_CONTENT_FORMAT);
+#endif
+    /* the node never reads the reply, ask the gateway not to send one */
+    coap_enc_option_uint(&enc, COAP_OPTION_NO_RESPONSE, COAP_NORESP_ALL);
+    coap_tpl_init(&senml_tpl, &enc);
+    p_buf = (char *)coap_tpl_payload(&senml_tpl, &len);
+    p_size = len;
+}
+
+static int send_from_server(const coap_peer_t *peer, const uint8_t *buf, size_t len)
+{
+    /* sent from the server port, so ACKs and Resets end up in microcoap_server() */
+    int rc = conn_udp_sendto(buf, len, NULL, 0, peer->addr, sizeof(peer->addr),
+                             AF_INET6, COAP_SERVER_PORT, peer->port);
+
+    return (rc < 0) ? rc : 0;
+}
+
+/* runs due retransmissions and request timeouts and re-arms the timer for
+ * whatever is due next */
+static void con_timer_update(void)
+{
+    uint32_t now = (uint32_t)(xtimer_now64() / 1000);
+    uint32_t next = coap_con_tick(now);
+    uint32_t req_next = coap_req_tick(now);
+
+    if ((next == 0) || ((req_next > 0) && (req_next < next))) {
+        next = req_next;
+    }
+
+    if (next > 0) {
+        xtimer_set_msg(&con_timer, next * 1000, &con_msg, thread_getpid());
+    }
+}
+
+static void blk_done(void *arg, int result, const coap_packet_t *rsp)
 {
-    uint8_t  snd_buf[128];
-    size_t   req_pkt_sz;
+    msg_t m = { .type = MSG_BLOCK1_DONE };
+    (void)arg;
 
-    coap_buffer_t payload = {
-            .p   = data,
-            .len = len
-    };
+    /* the ACK arrives in the server thread, the upload goes on in the
+     * beaconing thread; 0 stands for a block that got lost */
+    m.content.value = ((result == 0) && (rsp != NULL)) ? rsp->header.code : 0;
+    msg_send(&m, beac_pid);
+}
 
-    coap_packet_t req_pkt = {
-            .header  = req_hdr,
-            .token   = (coap_buffer_t) { 0 },
-            .numopts = 1,
-            .opts    = {{{(uint8_t *)"senml", 5}, (uint8_t)COAP_OPTION_URI_PATH}},
-            .payload = payload
-    };
+/* sends block blk_tx.num, it is repeated until the gateway acknowledges it */
+static void blk_send(void)
+{
+    size_t pkt_len = coap_block1_build(&blk_tx, blk_tx.num, blk_buf, sizeof(blk_buf),
+                                       coap_mid_next());
+
+    blk_busy = (pkt_len > 0) &&
+               (coap_con_send(&gw_peer, blk_buf, pkt_len, (uint32_t)(xtimer_now64() / 1000),
+                              send_from_server, blk_done, NULL) == 0);
+    if (!blk_busy) {
+        printf("SenML upload failed at block %u\n", (unsigned)blk_tx.num);
+    }
+    con_timer_update();
+}
 
-    req_pkt_sz = sizeof(req_pkt);
+/* the gateway answered the current block with code, the next one goes out
+ * once it asked for it with 2.31 */
+static void blk_next(unsigned code)
+{
+    blk_busy = false;
+    if (code == COAP_RSPCODE_CONTINUE) {
+        blk_tx.num++;
+        blk_send();
+    }
+    else if (code != COAP_RSPCODE_CHANGED) {
+        printf("SenML upload failed at block %u (%u.%02u)\n", (unsigned)blk_tx.num,
+               code >> 5, code & 0x1f);
+    }
+}
 
-    if (coap_build(snd_buf, &req_pkt_sz, &req_pkt) != 0) {
+void send_coap_post(size_t len)
+{
+    size_t pkt_len;
+
+    /* a pack that fits into one block goes out straight from the template */
+    if (len <= COAP_BLOCK_SIZE(COAP_BLOCK_SZX)) {
+        pkt_len = coap_tpl_finish(&senml_tpl, coap_mid_next(), len);
+        if (pkt_len == 0) {
             printf("CoAP build failed :(\n");
             return;
+        }
+        conn_udp_sendto(snd_buf, pkt_len, NULL, 0, &dst_addr, sizeof(dst_addr),
+                        AF_INET6, SPORT, UDP_PORT);
+        return;
     }
 
-    conn_udp_sendto(snd_buf, req_pkt_sz, NULL, 0, &dst_addr, sizeof(dst_addr),
-                    AF_INET6, SPORT, UDP_PORT);
+    /* larger ones are uploaded as link sized blocks (Block1) */
+    coap_block1_init(&blk_tx, &senml_tpl, (uint8_t *)p_buf, len, COAP_BLOCK_SZX);
+    blk_tx.con = true;
+    blk_send();
+}
+
+static void btn_evt_done(void *arg, int result, const coap_packet_t *rsp, uint32_t rtt)
+{
+    (void)arg;
+
+    evt_pending = false;
+    if (result != 0) {
+        evt_lost++;
+        printf("button event lost (%i), %u of %u\n", result, evt_lost, evt_sent);
+    }
+    else {
+        printf("button event answered with %u.%02u after %u ms\n",
+               (unsigned)(rsp->header.code >> 5), (unsigned)(rsp->header.code & 0x1f),
+               (unsigned)rtt);
+    }
 }
 
 static void btn_debounce_evt(void *arg)
@@ -207,28 +371,111 @@ static void btn_evt(void *arg)
 
 static void send_btn_evt(size_t pos, char *buf)
 {
-    char btn = (gpio_read(BUTTON_GPIO)) ? '0' : '1';
+    coap_encoder_t enc;
+    senml_enc_t senml;
+    size_t avail;
+    char *p;
+
+    /* a newer button state supersedes the one still in flight */
+    if (evt_pending) {
+        coap_req_cancel(evt_mid);
+        evt_pending = false;
+    }
 
-    pos += sprintf(&buf[pos], "{\"n\":\"a:button\", \"u\":\"bool\", \"v\":\"%c\"}]",
-                   btn);
+    /* the token is filled in by coap_req_send(), the 2.04 of the gateway is
+     * matched against it to measure the round-trip time */
+    evt_mid = coap_mid_next();
+    coap_enc_init(&enc, evt_buf, sizeof(evt_buf), COAP_TYPE_CON, COAP_METHOD_POST,
+                  (evt_mid >> 8), (evt_mid & 0xff), &evt_token);
+    coap_enc_option(&enc, COAP_OPTION_URI_PATH, (const uint8_t *)"senml", 5);
+#if SENML_CONTENT_FORMAT >= 0
+    coap_enc_option_uint(&enc, COAP_OPTION_CONTENT_FORMAT, SENML_CONTENT_FORMAT);
+#endif
+
+    /* same base record as the reports, followed by the button only */
+    p = (char *)coap_enc_payload_buf(&enc, &avail);
+    if (pos >= avail) {
+        return;
+    }
+    memcpy(p, buf, pos);
+    senml_init(&senml, p, avail, pos);
+    senml_bool(&senml, "a:button", "bool", !gpio_read(BUTTON_GPIO));
+    if ((pos = senml_end(&senml)) == 0 || coap_enc_payload_commit(&enc, pos) != 0) {
+        return;
+    }
+
+    /* sent once, repeated only until the gateway acknowledges it */
+    evt_pending = (coap_req_send(&gw_peer, evt_buf, enc.pos, (uint32_t)(xtimer_now64() / 1000),
+                                 EVT_TIMEOUT, send_from_server, btn_evt_done, NULL) == 0);
+    evt_sent++;
+
+    coap_notify(&path_button, obs_buf, sizeof(obs_buf), (uint32_t)(xtimer_now64() / 1000),
+                send_from_server);
+    con_timer_update();
+}
+
+static void send_temp(int id)
+{
+    saul_reg_t *dev = saul_reg_find_type(SAUL_SENSE_TEMP);
+    uint8_t *buf = sep_buf[id];
+    coap_encoder_t enc;
+    coap_peer_t peer;
+    phydat_t data;
+    char str[16];
+    int len;
+
+    /* a buffer that was used before may still wait for its ACK */
+    if (buf[0] != 0) {
+        coap_con_cancel((buf[2] << 8) | buf[3]);
+    }
+    if (coap_separate_init(&enc, id, buf, sizeof(sep_buf[id]), &peer) != 0) {
+        return;
+    }
 
-    for (int i = 0; i < EVT_REPEAT; i++) {
-        send_coap_post((uint8_t *)buf, pos);
-        xtimer_usleep(EVT_REPEAT_DELAY);
+    if ((dev == NULL) || (saul_reg_read(dev, &data) < 0)) {
+        coap_enc_response(&enc, COAP_RSPCODE_SERVICE_UNAVAILABLE,
+                          COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
+    }
+    else {
+        len = snprintf(str, sizeof(str), "%ie%i", data.val[0], data.scale);
+        coap_enc_response(&enc, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN,
+                          (const uint8_t *)str, len);
     }
+
+    coap_separate_send(&peer, &enc, (uint32_t)(xtimer_now64() / 1000), send_from_server);
+    con_timer_update();
 }
 
 static void send_update(size_t pos, char *buf)
 {
-    char led = (gpio_read(LED0_PIN)) ? '0' : '1';
-    char btn = (gpio_read(BUTTON_PIN)) ? '1' : '0';
+    senml_enc_t enc;
+    uint32_t now = (uint32_t)(xtimer_now64() / 1000);
+    bool full;
+    int32_t led = !gpio_read(LED0_PIN);
+    int32_t button = gpio_read(BUTTON_PIN);
+
+    /* the previous pack is still being uploaded, the changes wait for the
+     * next update */
+    if (blk_busy) {
+        return;
+    }
+    full = senml_heartbeat(&heartbeat, now);
 
-    pos += sprintf(&buf[pos], "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"%c\"},",
-                   led);
-    pos += sprintf(&buf[pos], "{\"n\":\"a:button\", \"u\":\"bool\", \"v\":\"%c\"}]",
-                   btn);
+    senml_init(&enc, buf, p_size, pos);
+    if (senml_due(&fld_led, led, now, full)) {
+        senml_bool(&enc, "a:led", "bool", led);
+    }
+    if (senml_due(&fld_button, button, now, full)) {
+        senml_bool(&enc, "a:button", "bool", button);
+    }
 
-    send_coap_post((uint8_t *)buf, pos);
+    /* nothing changed */
+    if (senml_pos(&enc) == pos) {
+        return;
+    }
+    if ((pos = senml_end(&enc)) > 0) {
+        send_coap_post(pos);
+    }
 }
 
 void *beaconing(void *arg)
@@ -261,6 +508,15 @@ void *beaconing(void *arg)
             case MSG_BUTTON_EVENT:
                 send_btn_evt(initial_pos, p_buf);
                 break;
+            case MSG_CON_TIMER:
+                con_timer_update();
+                break;
+            case MSG_SENSOR_READ:
+                send_temp((int)msg.content.value);
+                break;
+            case MSG_BLOCK1_DONE:
+                blk_next((unsigned)msg.content.value);
+                break;
             default:
                 break;
         }
@@ -275,6 +531,7 @@ static const shell_command_t shell_commands[] = { { NULL, NULL, NULL } };
 int main(void)
 {
     eui64_t iid;
+    senml_enc_t senml;
     // uint16_t chan = 15;
     netopt_enable_t acks = NETOPT_DISABLE;
     kernel_pid_t ifs[GNRC_NETIF_NUMOF];
@@ -282,25 +539,34 @@ int main(void)
     gnrc_netif_get(ifs);
     gnrc_netapi_set(ifs[0], NETOPT_AUTOACK, 0, &acks, sizeof(acks));
     ipv6_addr_from_str(&dst_addr, "2001:affe:1234::1");
+    memcpy(gw_peer.addr, &dst_addr, sizeof(gw_peer.addr));
+    gw_peer.port = UDP_PORT;
     // gnrc_netapi_set(ifs[0], NETOPT_CHANNEL, 0, &chan, sizeof(chan));
     // ipv6_addr_from_str(&dst_addr, "fd38:3734:ad48:0:211d:50ce:a189:7cc4");
 
 
 
     /* initialize senml payload */
+    senml_tpl_init();
     gnrc_netapi_get(ifs[0], NETOPT_IPV6_IID, 0, &iid, sizeof(eui64_t));
 
-    initial_pos  = sprintf(&p_buf[initial_pos], "[{\"bn\":\"urn:dev:mac:");
-    initial_pos += sprintf(&p_buf[initial_pos], "%02x%02x%02x%02x%02x%02x%02x%02x",
-                           iid.uint8[0], iid.uint8[1], iid.uint8[2], iid.uint8[3],
-                           iid.uint8[4], iid.uint8[5], iid.uint8[6], iid.uint8[7]);
-    initial_pos += sprintf(&p_buf[initial_pos], "\"},");
+    /* message IDs and tokens start at a node specific value */
+    coap_seed((((uint32_t)iid.uint8[4] << 24) | ((uint32_t)iid.uint8[5] << 16) |
+               ((uint32_t)iid.uint8[6] << 8) | iid.uint8[7]) ^ xtimer_now());
+
+    /* the base record is written once, the reports continue behind it */
+    senml_init(&senml, p_buf, p_size, 0);
+    senml_base(&senml, "urn:dev:mac:", iid.uint8, sizeof(iid.uint8));
+    initial_pos = senml_pos(&senml);
 
 
+    /* build the CoAP routing table before the server thread starts */
+    coap_init();
+    /* deferred requests go to the beaconing thread, so it has to run first */
+    beac_pid = thread_create(beac_stack, sizeof(beac_stack), PRIO, THREAD_CREATE_STACKTEST,
+                             beaconing, NULL, "beaconing");
     thread_create(coap_stack, sizeof(coap_stack), PRIO - 1, THREAD_CREATE_STACKTEST, microcoap_server,
                   NULL, "coap");
-    thread_create(beac_stack, sizeof(beac_stack), PRIO, THREAD_CREATE_STACKTEST, beaconing,
-                  NULL, "beaconing");
 
 
     char line_buf[SHELL_DEFAULT_BUFSIZE];
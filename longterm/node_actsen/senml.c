@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     demo_embedded_world_2016
+ * @{
+ *
+ * @file
+ * @brief       SenML (JSON or CBOR) encoder for the reports of the longterm nodes
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#include <string.h>
+
+#include "senml.h"
+
+static const char hex[] = "0123456789abcdef";
+
+static char *reserve(senml_enc_t *enc, size_t len)
+{
+    char *p;
+
+    if (enc->overflow || (len > enc->size - enc->pos)) {
+        enc->overflow = true;
+        return NULL;
+    }
+    p = &enc->buf[enc->pos];
+    enc->pos += len;
+    return p;
+}
+
+static void put(senml_enc_t *enc, const char *str, size_t len)
+{
+    char *p = reserve(enc, len);
+
+    if (p != NULL) {
+        memcpy(p, str, len);
+    }
+}
+
+static void put_str(senml_enc_t *enc, const char *str)
+{
+    put(enc, str, strlen(str));
+}
+
+void senml_init(senml_enc_t *enc, char *buf, size_t size, size_t pos)
+{
+    enc->buf = buf;
+    enc->size = size;
+    enc->pos = pos;
+    enc->overflow = (pos > size);
+    enc->units = true;
+    enc->timed = false;
+    enc->time = 0;
+}
+
+/* a time in ms as seconds with as few decimals as needed, e.g. 100 as 1
+ * with 1 decimal */
+static unsigned time_scale(int32_t *ms)
+{
+    unsigned decimals = 3;
+
+    while (decimals > 0 && (*ms % 10) == 0) {
+        *ms /= 10;
+        decimals--;
+    }
+    return decimals;
+}
+
+/* |a - b| > band, without overflowing */
+static bool outside(int32_t a, int32_t b, uint32_t band)
+{
+    uint32_t diff = (a > b) ? (uint32_t)a - (uint32_t)b : (uint32_t)b - (uint32_t)a;
+
+    return diff > band;
+}
+
+bool senml_due_vector(senml_field_t *field, const int32_t *vals, unsigned dim,
+                      uint32_t now, bool full)
+{
+    bool due = full || !field->valid ||
+               (field->max_silence > 0 && (now - field->sent) >= field->max_silence);
+
+    if (dim > SENML_DIM_MAX) {
+        dim = SENML_DIM_MAX;
+    }
+    for (unsigned i = 0; i < dim && !due; i++) {
+        uint32_t last_abs = (field->last[i] < 0) ? 0U - (uint32_t)field->last[i]
+                                                 : (uint32_t)field->last[i];
+        uint32_t band = (uint32_t)(((uint64_t)last_abs * field->rel) / 1000);
+
+        if (band < field->abs) {
+            band = field->abs;
+        }
+        due = outside(vals[i], field->last[i], band);
+    }
+
+    if (due) {
+        if (dim > 0) {
+            memcpy(field->last, vals, dim * sizeof(int32_t));
+        }
+        field->sent = now;
+        field->valid = true;
+    }
+    return due;
+}
+
+#ifndef SENML_WITH_CBOR
+/* decimal digits of val, at least min of them (zero padded) */
+static void put_uint(senml_enc_t *enc, uint32_t val, unsigned min)
+{
+    char tmp[10];
+    unsigned n = 0;
+
+    do {
+        tmp[sizeof(tmp) - ++n] = '0' + (val % 10);
+        val /= 10;
+    } while ((val > 0 || n < min) && n < sizeof(tmp));
+
+    put(enc, &tmp[sizeof(tmp) - n], n);
+}
+
+static void put_int(senml_enc_t *enc, int32_t val)
+{
+    if (val < 0) {
+        put(enc, "-", 1);
+        /* negating in unsigned is fine for INT32_MIN as well */
+        put_uint(enc, 0U - (uint32_t)val, 1);
+    }
+    else {
+        put_uint(enc, (uint32_t)val, 1);
+    }
+}
+
+/* val in units of 10^-decimals, without quotes */
+static void put_fixed(senml_enc_t *enc, int32_t val, unsigned decimals)
+{
+    uint32_t div = 1;
+    uint32_t abs;
+
+    for (unsigned i = 0; i < decimals && i < 9; i++) {
+        div *= 10;
+    }
+
+    /* the sign is written once, so -0.250 does not come out as 0.-250 */
+    if (val < 0) {
+        put(enc, "-", 1);
+        abs = 0U - (uint32_t)val;
+    }
+    else {
+        abs = (uint32_t)val;
+    }
+    put_uint(enc, abs / div, 1);
+    if (div > 1) {
+        put(enc, ".", 1);
+        put_uint(enc, abs % div, (decimals < 9) ? decimals : 9);
+    }
+}
+
+/* times are numbers, unlike the values */
+static void put_time(senml_enc_t *enc, int32_t ms)
+{
+    unsigned decimals = time_scale(&ms);
+
+    put_fixed(enc, ms, decimals);
+}
+
+/* everything in front of the value */
+static void record(senml_enc_t *enc, const char *name, const char *unit)
+{
+    put(enc, ",{\"n\":\"", 7);
+    put_str(enc, name);
+    if (enc->units) {
+        put(enc, "\", \"u\":\"", 8);
+        put_str(enc, unit);
+    }
+    if (enc->timed) {
+        put(enc, "\", \"t\":", 7);
+        put_time(enc, enc->time);
+        put(enc, ", \"v\":", 6);
+    }
+    else {
+        put(enc, "\", \"v\":", 7);
+    }
+}
+
+/* the base name, without the braces of the record */
+static void put_bn(senml_enc_t *enc, const char *prefix,
+                   const uint8_t *id, size_t id_len)
+{
+    char *p;
+
+    put(enc, "\"bn\":\"", 6);
+    put_str(enc, prefix);
+    if ((p = reserve(enc, id_len * 2)) != NULL) {
+        for (size_t i = 0; i < id_len; i++) {
+            *(p++) = hex[id[i] >> 4];
+            *(p++) = hex[id[i] & 0x0f];
+        }
+    }
+    put(enc, "\"", 1);
+}
+
+void senml_base(senml_enc_t *enc, const char *prefix,
+                const uint8_t *id, size_t id_len)
+{
+    put(enc, "[{", 2);
+    put_bn(enc, prefix, id, id_len);
+    put(enc, "}", 1);
+}
+
+void senml_base_time(senml_enc_t *enc, const char *prefix,
+                     const uint8_t *id, size_t id_len, int32_t bt)
+{
+    put(enc, "[{", 2);
+    if (prefix != NULL) {
+        put_bn(enc, prefix, id, id_len);
+        put(enc, ", ", 2);
+    }
+    put(enc, "\"bt\":", 5);
+    put_time(enc, bt);
+    put(enc, "}", 1);
+}
+
+void senml_open(senml_enc_t *enc)
+{
+    /* an empty base record, so every record can start with a comma */
+    put(enc, "[{}", 3);
+}
+
+void senml_bool(senml_enc_t *enc, const char *name, const char *unit, bool val)
+{
+    record(enc, name, unit);
+    put(enc, (val) ? "\"1\"}" : "\"0\"}", 4);
+}
+
+void senml_int(senml_enc_t *enc, const char *name, const char *unit, int32_t val)
+{
+    record(enc, name, unit);
+    put(enc, "\"", 1);
+    put_int(enc, val);
+    put(enc, "\"}", 2);
+}
+
+void senml_fixed(senml_enc_t *enc, const char *name, const char *unit,
+                 int32_t val, unsigned decimals)
+{
+    record(enc, name, unit);
+    put(enc, "\"", 1);
+    put_fixed(enc, val, decimals);
+    put(enc, "\"}", 2);
+}
+
+void senml_hex(senml_enc_t *enc, const char *name, const char *unit,
+               const char *prefix, uint32_t val)
+{
+    char tmp[8];
+    unsigned n = 0;
+
+    do {
+        tmp[sizeof(tmp) - ++n] = hex[val & 0x0f];
+        val >>= 4;
+    } while (val > 0);
+
+    record(enc, name, unit);
+    put(enc, "\"", 1);
+    put_str(enc, prefix);
+    put(enc, &tmp[sizeof(tmp) - n], n);
+    put(enc, "\"}", 2);
+}
+
+void senml_vector(senml_enc_t *enc, const char *name, const char *unit,
+                  const int32_t *vals, unsigned dim)
+{
+    record(enc, name, unit);
+    put(enc, "[", 1);
+    for (unsigned i = 0; i < dim; i++) {
+        if (i > 0) {
+            put(enc, ", ", 2);
+        }
+        put_int(enc, vals[i]);
+    }
+    put(enc, "]}", 2);
+}
+
+size_t senml_end(senml_enc_t *enc)
+{
+    put(enc, "]", 1);
+    return (enc->overflow) ? 0 : enc->pos;
+}
+
+#else /* SENML_WITH_CBOR */
+/* CBOR major types */
+#define CBOR_UINT           (0x00)
+#define CBOR_NINT           (0x20)
+#define CBOR_TEXT           (0x60)
+#define CBOR_ARRAY          (0x80)
+#define CBOR_MAP            (0xa0)
+#define CBOR_TAG            (0xc0)
+#define CBOR_FALSE          (0xf4)
+#define CBOR_TRUE           (0xf5)
+#define CBOR_INDEF          (0x1f)
+#define CBOR_BREAK          (0xff)
+
+/* tag of a decimal fraction [exponent, mantissa] */
+#define CBOR_TAG_DECFRAC    (4)
+
+/* SenML labels (RFC 8428, section 6) */
+#define SENML_BN            (CBOR_NINT | 1)     /* -2 */
+#define SENML_BT            (CBOR_NINT | 2)     /* -3 */
+#define SENML_N             (CBOR_UINT | 0)
+#define SENML_U             (CBOR_UINT | 1)
+#define SENML_V             (CBOR_UINT | 2)
+#define SENML_VS            (CBOR_UINT | 3)
+#define SENML_VB            (CBOR_UINT | 4)
+#define SENML_T             (CBOR_UINT | 6)
+
+/* initial byte plus argument in the shortest form */
+static void put_head(senml_enc_t *enc, uint8_t major, uint32_t arg)
+{
+    uint8_t head[5];
+    unsigned len;
+
+    if (arg < 24) {
+        head[0] = major | arg;
+        len = 1;
+    }
+    else if (arg <= 0xff) {
+        head[0] = major | 24;
+        head[1] = arg;
+        len = 2;
+    }
+    else if (arg <= 0xffff) {
+        head[0] = major | 25;
+        head[1] = arg >> 8;
+        head[2] = arg & 0xff;
+        len = 3;
+    }
+    else {
+        head[0] = major | 26;
+        head[1] = arg >> 24;
+        head[2] = (arg >> 16) & 0xff;
+        head[3] = (arg >> 8) & 0xff;
+        head[4] = arg & 0xff;
+        len = 5;
+    }
+    put(enc, (const char *)head, len);
+}
+
+static void put_byte(senml_enc_t *enc, uint8_t byte)
+{
+    put(enc, (const char *)&byte, 1);
+}
+
+static void put_cint(senml_enc_t *enc, int32_t val)
+{
+    if (val < 0) {
+        /* -1 - val, without overflowing for INT32_MIN */
+        put_head(enc, CBOR_NINT, (uint32_t)(-(val + 1)));
+    }
+    else {
+        put_head(enc, CBOR_UINT, (uint32_t)val);
+    }
+}
+
+static void put_text(senml_enc_t *enc, const char *str)
+{
+    size_t len = strlen(str);
+
+    put_head(enc, CBOR_TEXT, len);
+    put(enc, str, len);
+}
+
+/* a decimal fraction carries the value exactly, without floats */
+static void put_fixed(senml_enc_t *enc, int32_t val, unsigned decimals)
+{
+    if (decimals > 0) {
+        put_head(enc, CBOR_TAG, CBOR_TAG_DECFRAC);
+        put_byte(enc, CBOR_ARRAY | 2);
+        put_cint(enc, -(int32_t)((decimals < 9) ? decimals : 9));
+    }
+    put_cint(enc, val);
+}
+
+static void put_time(senml_enc_t *enc, int32_t ms)
+{
+    unsigned decimals = time_scale(&ms);
+
+    put_fixed(enc, ms, decimals);
+}
+
+/* the map of a record up to the value label */
+static void record(senml_enc_t *enc, const char *name, const char *unit,
+                   uint8_t label)
+{
+    put_byte(enc, CBOR_MAP | (2 + enc->units + enc->timed));
+    put_byte(enc, SENML_N);
+    put_text(enc, name);
+    if (enc->units) {
+        put_byte(enc, SENML_U);
+        put_text(enc, unit);
+    }
+    if (enc->timed) {
+        put_byte(enc, SENML_T);
+        put_time(enc, enc->time);
+    }
+    put_byte(enc, label);
+}
+
+/* the base name label and text */
+static void put_bn(senml_enc_t *enc, const char *prefix,
+                   const uint8_t *id, size_t id_len)
+{
+    char *p;
+
+    put_byte(enc, SENML_BN);
+    put_head(enc, CBOR_TEXT, strlen(prefix) + id_len * 2);
+    put_str(enc, prefix);
+    if ((p = reserve(enc, id_len * 2)) != NULL) {
+        for (size_t i = 0; i < id_len; i++) {
+            *(p++) = hex[id[i] >> 4];
+            *(p++) = hex[id[i] & 0x0f];
+        }
+    }
+}
+
+void senml_base(senml_enc_t *enc, const char *prefix,
+                const uint8_t *id, size_t id_len)
+{
+    /* the number of records is not known up front */
+    put_byte(enc, CBOR_ARRAY | CBOR_INDEF);
+    put_byte(enc, CBOR_MAP | 1);
+    put_bn(enc, prefix, id, id_len);
+}
+
+void senml_base_time(senml_enc_t *enc, const char *prefix,
+                     const uint8_t *id, size_t id_len, int32_t bt)
+{
+    put_byte(enc, CBOR_ARRAY | CBOR_INDEF);
+    put_byte(enc, CBOR_MAP | ((prefix != NULL) ? 2 : 1));
+    if (prefix != NULL) {
+        put_bn(enc, prefix, id, id_len);
+    }
+    put_byte(enc, SENML_BT);
+    put_time(enc, bt);
+}
+
+void senml_open(senml_enc_t *enc)
+{
+    put_byte(enc, CBOR_ARRAY | CBOR_INDEF);
+}
+
+void senml_bool(senml_enc_t *enc, const char *name, const char *unit, bool val)
+{
+    record(enc, name, unit, SENML_VB);
+    put_byte(enc, (val) ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void senml_int(senml_enc_t *enc, const char *name, const char *unit, int32_t val)
+{
+    record(enc, name, unit, SENML_V);
+    put_cint(enc, val);
+}
+
+void senml_fixed(senml_enc_t *enc, const char *name, const char *unit,
+                 int32_t val, unsigned decimals)
+{
+    record(enc, name, unit, SENML_V);
+    put_fixed(enc, val, decimals);
+}
+
+void senml_hex(senml_enc_t *enc, const char *name, const char *unit,
+               const char *prefix, uint32_t val)
+{
+    char tmp[8];
+    unsigned n = 0;
+
+    do {
+        tmp[sizeof(tmp) - ++n] = hex[val & 0x0f];
+        val >>= 4;
+    } while (val > 0);
+
+    record(enc, name, unit, SENML_VS);
+    put_head(enc, CBOR_TEXT, strlen(prefix) + n);
+    put_str(enc, prefix);
+    put(enc, &tmp[sizeof(tmp) - n], n);
+}
+
+void senml_vector(senml_enc_t *enc, const char *name, const char *unit,
+                  const int32_t *vals, unsigned dim)
+{
+    record(enc, name, unit, SENML_V);
+    put_head(enc, CBOR_ARRAY, dim);
+    for (unsigned i = 0; i < dim; i++) {
+        put_cint(enc, vals[i]);
+    }
+}
+
+size_t senml_end(senml_enc_t *enc)
+{
+    put_byte(enc, CBOR_BREAK);
+    return (enc->overflow) ? 0 : enc->pos;
+}
+#endif /* SENML_WITH_CBOR */
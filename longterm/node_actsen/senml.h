@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     demo_embedded_world_2016
+ * @{
+ *
+ * @file
+ * @brief       SenML (JSON or CBOR) encoder for the reports of the longterm nodes
+ *
+ * Writes a SenML pack straight into the output buffer, without printf. A
+ * pack starts with a base record carrying the base name, followed by one
+ * record per sensor or actuator:
+ *
+ *     [{"bn":"urn:dev:mac:0215fe0a0b0c0d0e"},{"n":"a:led", "u":"bool", "v":"1"}]
+ *
+ * Scalar values are sent as strings, vectors as arrays of numbers, as the
+ * gateway expects them.
+ *
+ * With SENML_WITH_CBOR defined, the same calls write SenML-CBOR (RFC 8428)
+ * with integer labels instead, to be sent with Content-Format
+ * SENML_CONTENT_FORMAT. Booleans go out as "vb", hex values as "vs",
+ * numbers as CBOR integers and fixed-point values as decimal fractions
+ * (tag 4), so no float arithmetic is needed on the node.
+ *
+ * All append functions check the remaining space;
+ * once something did not fit, the encoder stops writing and senml_end()
+ * returns 0.
+ *
+ * Usually the base record is written once at startup and every report
+ * continues behind it: keep the position returned by senml_pos() and hand
+ * it to senml_init() for each report.
+ *
+ * To report changes only, keep a senml_field_t per record and append the
+ * record only when senml_due() says so: when its value moved out of the
+ * deadband around the value reported last, when it was silent for too long,
+ * or when the node sends a full report (heartbeat).
+ *
+ * Readings taken over a while can go out together in one pack: open it with
+ * senml_base_time(), giving the time of the first reading, and set the
+ * offset of each reading with senml_time() before appending its records.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ */
+
+#ifndef SENML_H
+#define SENML_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Maximum number of values of a field tracked by senml_due()
+ */
+#ifndef SENML_DIM_MAX
+#define SENML_DIM_MAX               (3U)
+#endif
+
+/**
+ * @brief   Content-Format to send the packs with, -1 for none
+ */
+#ifdef SENML_WITH_CBOR
+#define SENML_CONTENT_FORMAT        (112)
+#else
+#define SENML_CONTENT_FORMAT        (-1)
+#endif
+
+/**
+ * @brief   State of the encoder
+ */
+typedef struct {
+    char *buf;          /**< output buffer */
+    size_t size;        /**< size of buf in bytes */
+    size_t pos;         /**< number of bytes written */
+    bool overflow;      /**< something did not fit into buf */
+    bool units;         /**< write the unit of each record */
+    bool timed;         /**< write the time of each record */
+    int32_t time;       /**< time of the following records, relative to
+                         *   the base time [in ms] */
+} senml_enc_t;
+
+/**
+ * @brief   Reporting policy and state of one record
+ *
+ * A new value is due if it differs from the one reported last by more than
+ * both the absolute and the relative deadband; with both 0, every change is
+ * due.
+ */
+typedef struct {
+    uint32_t abs;                   /**< absolute deadband, in units of the value */
+    uint16_t rel;                   /**< relative deadband [in 1/1000 of the
+                                     *   value reported last] */
+    uint32_t max_silence;           /**< report at least this often, 0 for
+                                     *   the heartbeat only [in ms] */
+    int32_t last[SENML_DIM_MAX];    /**< values reported last */
+    uint32_t sent;                  /**< time of the last report [in ms] */
+    bool valid;                     /**< reported at least once */
+} senml_field_t;
+
+/**
+ * @brief   Static initializer for a senml_field_t
+ */
+#define SENML_FIELD(abs, rel, max_silence)  { (abs), (rel), (max_silence), { 0 }, 0, false }
+
+/**
+ * @brief   Start encoding into @p buf
+ *
+ * @param[out] enc      encoder state
+ * @param[out] buf      output buffer
+ * @param[in] size      size of @p buf in bytes
+ * @param[in] pos       number of bytes already in @p buf, e.g. the base
+ *                      record written once before
+ */
+void senml_init(senml_enc_t *enc, char *buf, size_t size, size_t pos);
+
+/**
+ * @brief   Open the pack with the base record, the base name is @p prefix
+ *          followed by @p id in hex
+ */
+void senml_base(senml_enc_t *enc, const char *prefix,
+                const uint8_t *id, size_t id_len);
+
+/**
+ * @brief   Open the pack without a base name
+ *
+ * The gateway takes the base name from an earlier pack of the same source
+ * address, so only every n-th pack needs to carry it.
+ */
+void senml_open(senml_enc_t *enc);
+
+/**
+ * @brief   Open the pack with a base record carrying a base time
+ *
+ * The nodes have no wall clock, so the base time is relative to the time
+ * the pack is sent, e.g. -900 for a reading taken 0.9s before. The gateway
+ * adds it to the time it received the pack.
+ *
+ * @param[in] prefix    as for senml_base(), NULL to leave the base name out
+ * @param[in] bt        base time, relative to now [in ms]
+ */
+void senml_base_time(senml_enc_t *enc, const char *prefix,
+                     const uint8_t *id, size_t id_len, int32_t bt);
+
+/**
+ * @brief   Set the time of the following records
+ *
+ * @param[in] t         time relative to the base time [in ms]
+ */
+static inline void senml_time(senml_enc_t *enc, int32_t t)
+{
+    enc->time = t;
+    enc->timed = true;
+}
+
+/**
+ * @brief   Write the units of the following records or leave them out
+ *
+ * Units are written by default. The gateway keeps the unit of a record
+ * once it has seen it, so like the base name it is only needed now and then.
+ */
+static inline void senml_units(senml_enc_t *enc, bool on)
+{
+    enc->units = on;
+}
+
+/**
+ * @brief   Append a boolean record, the value is sent as "0" or "1"
+ */
+void senml_bool(senml_enc_t *enc, const char *name, const char *unit, bool val);
+
+/**
+ * @brief   Append an integer record
+ */
+void senml_int(senml_enc_t *enc, const char *name, const char *unit, int32_t val);
+
+/**
+ * @brief   Append a fixed-point record
+ *
+ * @param[in] val       value in units of 10^-@p decimals, e.g. 23125 with
+ *                      3 decimals is sent as "23.125"
+ * @param[in] decimals  number of decimal places (at most 9)
+ */
+void senml_fixed(senml_enc_t *enc, const char *name, const char *unit,
+                 int32_t val, unsigned decimals);
+
+/**
+ * @brief   Append an integer record in hex, e.g. a color as "#ff8000"
+ *
+ * @param[in] prefix    written in front of the digits, may be ""
+ */
+void senml_hex(senml_enc_t *enc, const char *name, const char *unit,
+               const char *prefix, uint32_t val);
+
+/**
+ * @brief   Append a vector record, e.g. the 3 axes of an accelerometer
+ *
+ * @param[in] vals      the values
+ * @param[in] dim       number of values
+ */
+void senml_vector(senml_enc_t *enc, const char *name, const char *unit,
+                  const int32_t *vals, unsigned dim);
+
+/**
+ * @brief   Number of bytes written so far
+ */
+static inline size_t senml_pos(const senml_enc_t *enc)
+{
+    return enc->pos;
+}
+
+/**
+ * @brief   Check if a record is due, and remember its value if so
+ *
+ * @param[in,out] field policy and state of the record
+ * @param[in] vals      current value(s), at most SENML_DIM_MAX are compared
+ * @param[in] dim       number of values
+ * @param[in] now       current time [in ms]
+ * @param[in] full      the node sends a full report, every record is due
+ *
+ * @return  true if the record should go into the pack
+ */
+bool senml_due_vector(senml_field_t *field, const int32_t *vals, unsigned dim,
+                      uint32_t now, bool full);
+
+/**
+ * @brief   Check if a single value record is due, see senml_due_vector()
+ */
+static inline bool senml_due(senml_field_t *field, int32_t val,
+                             uint32_t now, bool full)
+{
+    return senml_due_vector(field, &val, 1, now, full);
+}
+
+/**
+ * @brief   Check if a full report is due
+ *
+ * Uses a field without values: true on the first call and whenever
+ * @p heartbeat has been silent for its max_silence since.
+ */
+static inline bool senml_heartbeat(senml_field_t *heartbeat, uint32_t now)
+{
+    return senml_due_vector(heartbeat, NULL, 0, now, false);
+}
+
+/**
+ * @brief   Close the pack
+ *
+ * @return  length of the pack in bytes
+ * @return  0 if it did not fit into the buffer
+ */
+size_t senml_end(senml_enc_t *enc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SENML_H */
+/** @} */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     demo_embedded_world_2016
+ * @{
+ *
+ * @file
+ * @brief       Running statistics over a window of sensor readings
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#include "aggr.h"
+
+static const uint16_t scale[] = { 1, 10, 100, 1000 };
+
+static uint64_t scale_of(unsigned decimals)
+{
+    return scale[(decimals < 3) ? decimals : 3];
+}
+
+void aggr_reset(aggr_t *aggr)
+{
+    aggr->n = 0;
+    aggr->min = 0;
+    aggr->max = 0;
+    aggr->sum = 0;
+    aggr->sumsq = 0;
+}
+
+void aggr_add(aggr_t *aggr, int32_t val)
+{
+    if (aggr->n >= AGGR_N_MAX) {
+        return;
+    }
+    if (aggr->n == 0 || val < aggr->min) {
+        aggr->min = val;
+    }
+    if (aggr->n == 0 || val > aggr->max) {
+        aggr->max = val;
+    }
+    aggr->n++;
+    aggr->sum += val;
+    aggr->sumsq += (uint64_t)((int64_t)val * val);
+}
+
+int32_t aggr_mean(const aggr_t *aggr, unsigned decimals)
+{
+    int64_t x;
+    uint64_t q;
+
+    if (aggr->n == 0) {
+        return 0;
+    }
+
+    /* rounded half away from zero, on the magnitude */
+    x = aggr->sum * (int64_t)scale_of(decimals);
+    q = (((x < 0) ? 0U - (uint64_t)x : (uint64_t)x) + aggr->n / 2) / aggr->n;
+    return (x < 0) ? -(int32_t)q : (int32_t)q;
+}
+
+int32_t aggr_var(const aggr_t *aggr, unsigned decimals)
+{
+    uint64_t n = aggr->n;
+    uint64_t s = scale_of(decimals);
+    uint64_t sum, d, v;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    /* n^2 times the variance, exact in integers and never negative */
+    sum = (aggr->sum < 0) ? 0U - (uint64_t)aggr->sum : (uint64_t)aggr->sum;
+    d = n * aggr->sumsq - sum * sum;
+
+    /* d * s / n^2, split up so d * s can not overflow */
+    v = (d / n) * s + ((d % n) * s) / n;
+    v /= n;
+    return (v > INT32_MAX) ? INT32_MAX : (int32_t)v;
+}
@@ -20,9 +20,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <net/af.h>
 
 #include "board.h"
+#include "thread.h"
 #include "xtimer.h"
+#include "mutex.h"
 #include "byteorder.h"
 
 #include "saul_reg.h"
@@ -30,7 +33,11 @@
 #include "net/gnrc.h"
 #include "net/gnrc/ipv6.h"
 #include "net/gnrc/udp.h"
+#include "net/conn.h"
+#include "net/conn/udp.h"
 #include "coap.h"
+#include "senml.h"
+#include "aggr.h"
 
 /**
  * @brief   The maximal expected link layer address length in byte
@@ -39,16 +46,203 @@
 
 #define DELAY                   (100000U)
 
+#define Q_SZ                    (4)
+#define COAP_SERVER_PORT        (5683)
+#define MSG_BLOCK1_DONE         (0x333b)
+
+/**
+ * @brief   Readings per summary in the aggregated mode, 1s at 10Hz
+ */
+#ifndef AGGR_WINDOW
+#define AGGR_WINDOW             (10U)
+#endif
+
+/**
+ * @brief   Largest pack of readings in Block1 blocks. Each block waits for
+ *          the 2.31 of the one before, so a pack is kept to a few blocks
+ */
+#ifndef PACK_BLOCKS
+#define PACK_BLOCKS             (4U)
+#endif
+#define PACK_SIZE               (PACK_BLOCKS * COAP_BLOCK_SIZE(COAP_BLOCK_SZX))
+
+/**
+ * @brief   Readings that fill a pack: the first one takes 112 byte as
+ *          SenML-CBOR and 213 byte as JSON, each further one 73 or 142 byte
+ */
+#ifndef BATCH_SIZE
+#ifdef SENML_WITH_CBOR
+#define BATCH_SIZE              (2U)
+#else
+#define BATCH_SIZE              (1U)
+#endif
+#endif
+
+/**
+ * @brief   Readings kept while a pack is uploaded, the oldest ones are
+ *          dropped when the gateway falls further behind
+ */
+#ifndef RING_SIZE
+#define RING_SIZE               (16U)
+#endif
+
+/**
+ * @brief   Send the pack at the latest this long after its first reading
+ *          [in us]
+ */
+#ifndef BATCH_DEADLINE
+#define BATCH_DEADLINE          (1000000U)
+#endif
+
+/**
+ * @brief   Room for the CoAP header and the summary of a window as JSON,
+ *          12 records of at most 64 byte, which is larger than PACK_SIZE
+ */
+#define SND_BUF_SIZE            (12 * 64U + 128U)
+
 static const ipv6_addr_t gw_addr = {{ 0x20, 0x01, 0xaf, 0xfe, \
                                       0x12, 0x34, 0x00, 0x00, \
                                       0x00, 0x00, 0x00, 0x00, \
                                       0x00, 0x00, 0x00, 0x01 }};
 
 static const uint16_t gw_port = 5683;
+static coap_peer_t gw_peer;
+
+/* names of the readings and of their statistics per window */
+static const char *names[3][4] = {
+    { "s:acc", "s:acc_min", "s:acc_max", "s:acc_var" },
+    { "s:mag", "s:mag_min", "s:mag_max", "s:mag_var" },
+    { "s:gyro", "s:gyro_min", "s:gyro_max", "s:gyro_var" },
+};
 
+/**
+ * @brief   What the node reports, switched with POST /mode
+ */
+typedef enum {
+    MODE_AGGR,                  /**< statistics of each window of readings */
+    MODE_RAW,                   /**< every reading, in batches */
+} report_mode_t;
+
+static const char *mode_names[] = { "aggr", "raw" };
+static volatile report_mode_t mode = MODE_AGGR;
+
+/**
+ * @brief   One set of readings of the three sensors
+ */
+typedef struct {
+    uint32_t time;              /**< time of the reading [in us] */
+    int16_t val[3][3];          /**< acc, mag and gyro */
+} reading_t;
 
-static char payload[512];
-static size_t pos;
+/* request template for the SenML reports, the pack is composed in place
+ * behind the CoAP header */
+static uint8_t snd_buf[SND_BUF_SIZE];
+static coap_template_t senml_tpl;
+static char *payload;
+static size_t payload_size;
+static eui64_t iid;
+
+/* readings not sent yet, the oldest first */
+static reading_t ring[RING_SIZE];
+static unsigned ring_first, ring_len;
+
+/* statistics of the current window, per sensor and axis */
+static aggr_t aggr[3][3];
+
+static msg_t _main_msg_q[Q_SZ], _coap_msg_q[Q_SZ];
+static kernel_pid_t main_pid;
+static char coap_stack[THREAD_STACKSIZE_DEFAULT];
+
+static const coap_endpoint_path_t path_mode = { 1, { "mode" } };
+
+static int handle_get_mode(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    (void)inpkt;
+    const char *name = mode_names[mode];
+
+    return coap_enc_response(rsp, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN,
+                             (const uint8_t *)name, strlen(name));
+}
+
+/* "aggr" or "raw", the main loop picks the new mode up with its next
+ * reading */
+static int handle_post_mode(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    coap_responsecode_t resp = COAP_RSPCODE_BAD_REQUEST;
+
+    for (unsigned i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+        if ((inpkt->payload.len == strlen(mode_names[i])) &&
+            (memcmp(inpkt->payload.p, mode_names[i], inpkt->payload.len) == 0)) {
+            mode = (report_mode_t)i;
+            resp = COAP_RSPCODE_CHANGED;
+        }
+    }
+
+    return coap_enc_response(rsp, resp, COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
+}
+
+const coap_endpoint_t endpoints[] =
+{
+    { COAP_METHOD_GET,   handle_get_mode, &path_mode, "ct=0" },
+    { COAP_METHOD_POST,  handle_post_mode, &path_mode, "ct=0" },
+    /* marks the end of the endpoints array: */
+    { (coap_method_t)0, NULL, NULL, NULL }
+};
+
+/* one block of a SenML pack plus header, Uri-Path and Block1 option */
+static uint8_t blk_buf[COAP_BLOCK_SIZE(COAP_BLOCK_SZX) + 32];
+
+/* larger packs are uploaded one confirmable block at a time, the pack and
+ * blk_buf belong to the upload until the gateway answered the last block */
+static coap_block1_tx_t blk_tx;
+static bool blk_busy;
+
+/* microcoap's shared state (messages in flight, observers, duplicate cache,
+ * IDs) is used from more than one thread */
+static mutex_t coap_mutex = MUTEX_INIT;
+
+void coap_lock(void)
+{
+    mutex_lock(&coap_mutex);
+}
+
+void coap_unlock(void)
+{
+    mutex_unlock(&coap_mutex);
+}
+
+void *microcoap_server(void *arg)
+{
+    (void) arg;
+    msg_init_queue(_coap_msg_q, Q_SZ);
+
+    uint8_t laddr[16] = { 0 };
+    size_t raddr_len;
+    conn_udp_t conn;
+    int rc = conn_udp_create(&conn, laddr, sizeof(laddr), AF_INET6, COAP_SERVER_PORT);
+    /* this thread is the only worker, it keeps its context for good */
+    coap_ctx_t *ctx = coap_ctx_acquire();
+
+    while (1) {
+        if ((rc = conn_udp_recvfrom(&conn, (char *)ctx->rx, sizeof(ctx->rx),
+                                    ctx->peer.addr, &raddr_len, &ctx->peer.port)) < 0) {
+            continue;
+        }
+        ctx->rxlen = rc;
+
+        /* parse, drop duplicates and handle, the reply is encoded into ctx->tx */
+        coap_ctx_handle(ctx, (uint32_t)(xtimer_now64() / 1000), false, false);
+
+        /* send reply via UDP */
+        if (ctx->txlen > 0) {
+            rc = conn_udp_sendto(ctx->tx, ctx->txlen, NULL, 0, ctx->peer.addr, raddr_len,
+                                 AF_INET6, COAP_SERVER_PORT, ctx->peer.port);
+        }
+    }
+
+    /* never reached */
+    return NULL;
+}
 
 void udp_send(ipv6_addr_t addr, uint16_t port, uint8_t *data, size_t len)
 {
@@ -83,48 +277,178 @@ void udp_send(ipv6_addr_t addr, uint16_t port, uint8_t *data, size_t len)
 }
 
 
-void send_coap_post(uint8_t *data, size_t len)
+void senml_tpl_init(void)
 {
-        uint8_t  snd_buf[128];
-        size_t   req_pkt_sz;
+        coap_encoder_t enc;
+        size_t len;
+
+        coap_enc_init(&enc, snd_buf, sizeof(snd_buf), COAP_TYPE_NONCON,
+                      COAP_METHOD_POST, 0, 0, NULL);
+        coap_enc_option(&enc, COAP_OPTION_URI_PATH, (const uint8_t *)"senml", 5);
+#if SENML_CONTENT_FORMAT >= 0
+        coap_enc_option_uint(&enc, COAP_OPTION_CONTENT_FORMAT, SENML_CONTENT_FORMAT);
+#endif
+        /* the node never reads the reply, ask the gateway not to send one */
+        coap_enc_option_uint(&enc, COAP_OPTION_NO_RESPONSE, COAP_NORESP_ALL);
+        coap_tpl_init(&senml_tpl, &enc);
+        payload = (char *)coap_tpl_payload(&senml_tpl, &len);
+        payload_size = len;
+}
+
+/* udp_send() uses the server port as source port, so the ACKs end up in
+ * microcoap_server() */
+static int send_to_gw(const coap_peer_t *peer, const uint8_t *buf, size_t len)
+{
+        (void)peer;
 
-        coap_header_t req_hdr = {
-                .version = 1,
-                .type    = COAP_TYPE_NONCON,
-                .tkllen  = 0,
-                .code    = COAP_METHOD_POST,
-                .mid     = {5, 57}            // is equivalent to 1337 when converted to uint16_t
-        };
+        udp_send(gw_addr, gw_port, (uint8_t *)buf, len);
+        return 0;
+}
+
+static void blk_done(void *arg, int result, const coap_packet_t *rsp)
+{
+        msg_t m = { .type = MSG_BLOCK1_DONE };
+        (void)arg;
 
-        coap_buffer_t payload = {
-                .p   = data,
-                .len = len
-        };
+        /* the ACK arrives in the server thread, the upload goes on in the
+         * main loop; 0 stands for a block that got lost */
+        m.content.value = ((result == 0) && (rsp != NULL)) ? rsp->header.code : 0;
+        msg_send(&m, main_pid);
+}
 
-        coap_packet_t req_pkt = {
-                .header  = req_hdr,
-                .token   = (coap_buffer_t) {},
-                .numopts = 1,
-                .opts    = {{{(uint8_t *)"senml", 5}, (uint8_t)COAP_OPTION_URI_PATH}},
-                .payload = payload
-        };
+/* sends block blk_tx.num, it is repeated until the gateway acknowledges it */
+static void blk_send(void)
+{
+        size_t pkt_len = coap_block1_build(&blk_tx, blk_tx.num, blk_buf, sizeof(blk_buf),
+                                           coap_mid_next());
+
+        blk_busy = (pkt_len > 0) &&
+                   (coap_con_send(&gw_peer, blk_buf, pkt_len, (uint32_t)(xtimer_now64() / 1000),
+                                  send_to_gw, blk_done, NULL) == 0);
+        if (!blk_busy) {
+                printf("SenML upload failed at block %u\n", (unsigned)blk_tx.num);
+        }
+}
 
-        req_pkt_sz = sizeof(req_pkt);
+/* the gateway answered the current block with code, the next one goes out
+ * once it asked for it with 2.31 */
+static void blk_next(unsigned code)
+{
+        blk_busy = false;
+        if (code == COAP_RSPCODE_CONTINUE) {
+                blk_tx.num++;
+                blk_send();
+        }
+        else if (code != COAP_RSPCODE_CHANGED) {
+                printf("SenML upload failed at block %u (%u.%02u)\n", (unsigned)blk_tx.num,
+                       code >> 5, code & 0x1f);
+        }
+}
 
-        if (coap_build(snd_buf, &req_pkt_sz, &req_pkt) != 0) {
-                printf("CoAP build failed :(\n");
+void send_coap_post(size_t len)
+{
+        size_t pkt_len;
+
+        /* a pack that fits into one block goes out straight from the template */
+        if (len <= COAP_BLOCK_SIZE(COAP_BLOCK_SZX)) {
+                pkt_len = coap_tpl_finish(&senml_tpl, coap_mid_next(), len);
+                if (pkt_len == 0) {
+                        printf("CoAP build failed :(\n");
+                        return;
+                }
+                udp_send(gw_addr, gw_port, snd_buf, pkt_len);
                 return;
         }
 
-        udp_send(gw_addr, gw_port, snd_buf, req_pkt_sz);
+        /* larger ones are uploaded as link sized blocks (Block1) */
+        coap_block1_init(&blk_tx, &senml_tpl, (uint8_t *)payload, len, COAP_BLOCK_SZX);
+        blk_tx.con = true;
+        blk_send();
+}
+
+/* one pack for the oldest readings, as many as fit into PACK_SIZE: the
+ * base time is the one of the first reading, the records of each reading
+ * carry its offset. Only the records of the first reading carry the units,
+ * the readings left over wait for the next pack */
+void send_batch(void)
+{
+        senml_enc_t senml;
+        uint32_t first = ring[ring_first].time;
+        unsigned n;
+        size_t p;
+
+        senml_init(&senml, payload, PACK_SIZE, 0);
+        senml_base_time(&senml, "urn:dev:mac:", iid.uint8, sizeof(iid.uint8),
+                        -(int32_t)((xtimer_now() - first) / 1000));
+        for (n = 0; n < ring_len; n++) {
+                const reading_t *r = &ring[(ring_first + n) % RING_SIZE];
+                size_t mark = senml_pos(&senml);
+
+                senml_units(&senml, n == 0);
+                senml_time(&senml, (int32_t)((r->time - first) / 1000));
+                for (int i = 0; i < 3; i++) {
+                        int32_t val[3] = { r->val[i][0], r->val[i][1], r->val[i][2] };
+                        senml_vector(&senml, names[i][0], "g", val, 3);
+                }
+
+                /* take the reading back if it leaves no room to close the
+                 * pack, a single one that does not fit is dropped */
+                if (senml.overflow || (senml_pos(&senml) >= PACK_SIZE)) {
+                        senml_init(&senml, payload, PACK_SIZE, mark);
+                        n += (n == 0);
+                        break;
+                }
+        }
+        ring_first = (ring_first + n) % RING_SIZE;
+        ring_len -= n;
+
+        p = senml_end(&senml);
+        if (p > 0) {
+                send_coap_post(p);
+        }
+}
+
+/* mean, minimum, maximum and variance of each axis of the window, rounded
+ * to the units of the readings. The variance goes without unit */
+void send_summary(void)
+{
+        senml_enc_t senml;
+        size_t p;
+
+        senml_init(&senml, payload, payload_size, 0);
+        senml_base(&senml, "urn:dev:mac:", iid.uint8, sizeof(iid.uint8));
+        for (int i = 0; i < 3; i++) {
+                int32_t mean[3], min[3], max[3], var[3];
+
+                for (int j = 0; j < 3; j++) {
+                        mean[j] = aggr_mean(&aggr[i][j], 0);
+                        min[j] = aggr[i][j].min;
+                        max[j] = aggr[i][j].max;
+                        var[j] = aggr_var(&aggr[i][j], 0);
+                        aggr_reset(&aggr[i][j]);
+                }
+                senml_units(&senml, true);
+                senml_vector(&senml, names[i][0], "g", mean, 3);
+                senml_vector(&senml, names[i][1], "g", min, 3);
+                senml_vector(&senml, names[i][2], "g", max, 3);
+                senml_units(&senml, false);
+                senml_vector(&senml, names[i][3], "g", var, 3);
+        }
+
+        p = senml_end(&senml);
+        if (p > 0) {
+                send_coap_post(p);
+        }
 }
 
 
 int main(void)
 {
     uint32_t last_wakeup = xtimer_now();
+    int32_t left;
+    msg_t msg;
     phydat_t data[3];
-    const char *types[] = {"s:acc", "s:mag", "s:gyro"};
+    report_mode_t cur = mode;
 
     /* get the network device */
     kernel_pid_t ifs[GNRC_NETIF_NUMOF];
@@ -135,16 +459,20 @@ int main(void)
     gnrc_netapi_set(ifs[0], NETOPT_AUTOACK, 0, &acks, sizeof(acks));
 
     /* get EUID (same than hardware address...) */
-    eui64_t iid;
     gnrc_netapi_get(ifs[0], NETOPT_IPV6_IID, 0, &iid, sizeof(eui64_t));
 
-    /* prepare JSON payload */
-    pos = sprintf(payload, "[{\"bn\":\"urn:dev:mac:");
-    for (int i = 0; i < 8; i++) {
-        sprintf(&payload[pos], "%02x", iid.uint8[i]);
-        pos += 2;
-    }
-    pos += sprintf(&payload[pos], "\"},");
+    /* blk_done() sends the answers of the gateway here */
+    msg_init_queue(_main_msg_q, Q_SZ);
+    main_pid = thread_getpid();
+    memcpy(gw_peer.addr, &gw_addr, sizeof(gw_peer.addr));
+    gw_peer.port = gw_port;
+
+    /* message IDs and tokens start at a node specific value */
+    coap_seed((((uint32_t)iid.uint8[4] << 24) | ((uint32_t)iid.uint8[5] << 16) |
+               ((uint32_t)iid.uint8[6] << 8) | iid.uint8[7]) ^ xtimer_now());
+
+    /* prepare the request, the packs are written behind its header */
+    senml_tpl_init();
 
     /* get sensors */
     saul_reg_t *acc = saul_reg_find_type(SAUL_SENSE_ACCEL);
@@ -155,6 +483,11 @@ int main(void)
         return 1;
     }
 
+    /* build the CoAP routing table before the server thread starts */
+    coap_init();
+    thread_create(coap_stack, sizeof(coap_stack), THREAD_PRIORITY_MAIN - 1,
+                  THREAD_CREATE_STACKTEST, microcoap_server, NULL, "coap");
+
 
 
     while (1) {
@@ -167,23 +500,64 @@ int main(void)
         //     phydat_dump(&data[i], 3);
         // }
 
-        size_t p = pos;
-        for (int i = 0; i < 3; i++) {
-            p += sprintf(&payload[p],
-                    "{\"n\":\"%s\", \"u\":\"g\", \"v\":[%i, %i, %i]},",
-                    types[i], (int)data[i].val[0], (int)data[i].val[1], (int)data[i].val[2]);
+        /* whatever the previous mode still holds goes out first, once the
+         * payload area is free; readings that do not fit into one pack are
+         * dropped */
+        if ((cur != mode) && !blk_busy) {
+            if (ring_len > 0) {
+                send_batch();
+                ring_len = 0;
+            }
+            if (aggr[0][0].n > 0) {
+                send_summary();
+            }
+            cur = mode;
         }
-        p--;
-        p += sprintf(&payload[p], "]");
-        payload[p] = '\0';
 
         LED0_TOGGLE;
 
-        /* push value using CoAP */
-        send_coap_post((uint8_t *)payload, p);
+        if (cur == MODE_AGGR) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    aggr_add(&aggr[i][j], data[i].val[j]);
+                }
+            }
+            /* while the previous pack is uploaded, the window grows */
+            if ((aggr[0][0].n >= AGGR_WINDOW) && !blk_busy) {
+                send_summary();
+            }
+        }
+        else {
+            /* keep the readings, the sampling rate stays at 10Hz. While
+             * the gateway falls behind, the oldest ones are dropped */
+            if (ring_len == RING_SIZE) {
+                ring_first = (ring_first + 1) % RING_SIZE;
+                ring_len--;
+            }
+            reading_t *r = &ring[(ring_first + ring_len++) % RING_SIZE];
+            r->time = xtimer_now();
+            for (int i = 0; i < 3; i++) {
+                memcpy(r->val[i], data[i].val, sizeof(r->val[i]));
+            }
+
+            /* push them using CoAP once they fill a pack or the oldest one
+             * is getting old */
+            if (!blk_busy && ((ring_len >= BATCH_SIZE) ||
+                              ((xtimer_now() - ring[ring_first].time) >= BATCH_DEADLINE))) {
+                send_batch();
+            }
+        }
 
-        /* sleep a while */
-        xtimer_usleep_until(&last_wakeup, DELAY);
+        /* sleep until the next reading, an answer of the gateway continues
+         * the upload right away and a lost block is repeated in between */
+        last_wakeup += DELAY;
+        while ((left = (int32_t)(last_wakeup - xtimer_now())) > 0) {
+            if ((xtimer_msg_receive_timeout(&msg, (uint32_t)left) >= 0) &&
+                (msg.type == MSG_BLOCK1_DONE)) {
+                blk_next((unsigned)msg.content.value);
+            }
+            coap_con_tick((uint32_t)(xtimer_now64() / 1000));
+        }
     }
 
     return 0;
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @ingroup     demo_embedded_world_2016
+ * @{
+ *
+ * @file
+ * @brief       Running statistics over a window of sensor readings
+ *
+ * Keeps minimum, maximum, sum and sum of squares of the readings of one
+ * channel, so adding a reading takes constant time and memory. Mean and
+ * variance are computed from the sums in integer arithmetic when the window
+ * is reported, and returned in fixed point.
+ *
+ * The sums are exact as long as the readings stay below 2^20 in magnitude
+ * and a window holds at most AGGR_N_MAX of them.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ */
+
+#ifndef AGGR_H
+#define AGGR_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   Maximum number of readings per window
+ */
+#define AGGR_N_MAX          (1024U)
+
+/**
+ * @brief   Statistics of one channel
+ */
+typedef struct {
+    uint32_t n;         /**< number of readings */
+    int32_t min;        /**< smallest reading */
+    int32_t max;        /**< largest reading */
+    int64_t sum;        /**< sum of the readings */
+    uint64_t sumsq;     /**< sum of their squares */
+} aggr_t;
+
+/**
+ * @brief   Start a new window
+ */
+void aggr_reset(aggr_t *aggr);
+
+/**
+ * @brief   Add a reading to the window
+ *
+ * Readings beyond AGGR_N_MAX in one window are ignored.
+ */
+void aggr_add(aggr_t *aggr, int32_t val);
+
+/**
+ * @brief   Mean of the window
+ *
+ * @param[in] decimals  number of decimal places to add (at most 3), e.g.
+ *                      the mean of 1 and 2 with 1 decimal is 15
+ *
+ * @return  the rounded mean in units of 10^-@p decimals of the readings
+ * @return  0 for an empty window
+ */
+int32_t aggr_mean(const aggr_t *aggr, unsigned decimals);
+
+/**
+ * @brief   Variance (population) of the window
+ *
+ * @param[in] decimals  number of decimal places to add (at most 3)
+ *
+ * @return  the variance in units of 10^-@p decimals of the squared
+ *          readings, rounded down and at most INT32_MAX
+ * @return  0 for an empty window
+ */
+int32_t aggr_var(const aggr_t *aggr, unsigned decimals);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AGGR_H */
+/** @} */
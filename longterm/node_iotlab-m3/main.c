@@ -28,19 +28,27 @@
 #include "board.h"
 #include "shell.h"
 #include "xtimer.h"
+#include "mutex.h"
 #include "net/gnrc.h"
 #include "net/gnrc/ipv6.h"
 #include "net/gnrc/udp.h"
 #include "net/conn.h"
 #include "net/conn/udp.h"
 #include "coap.h"
+#include "senml.h"
+#include "aggr.h"
 #include "periph/gpio.h"
 #include "isl29020.h"
 #include "lps331ap.h"
 #include "periph/gpio.h"
 
 #define UPDATE_INTERVAL     (1000 * 1000U)
+#define SAMPLE_INTERVAL     (100 * 1000U)   /* aggregated readings are taken this often */
+#define AGGR_WINDOW         (10U)           /* readings per summary, 1s */
+#define HEARTBEAT_INTERVAL  (60 * 1000U)    /* full report at least this often [in ms] */
 #define MSG_UPDATE_EVENT    (0x3338)
+#define MSG_CON_TIMER       (0x333a)
+#define MSG_BLOCK1_DONE     (0x333b)
 
 #define Q_SZ                (4)
 #define PRIO                (THREAD_PRIORITY_MAIN - 1)
@@ -50,7 +58,7 @@
 
 #define LIGHT_MODE          ISL29020_MODE_AMBIENT
 #define LIGHT_RANGE         ISL29020_RANGE_16K
-#define TP_RATE             LPS331AP_RATE_7HZ
+#define TP_RATE             LPS331AP_RATE_12HZ5
 
 #ifdef WITH_SHELL
 static msg_t _main_msg_q[Q_SZ];
@@ -62,28 +70,63 @@ static char coap_stack[THREAD_STACKSIZE_DEFAULT];
 static isl29020_t light_dev;
 static lps331ap_t tp_dev;
 
-static uint8_t udp_buf[512];
-static uint8_t scratch_raw[1024];      /* microcoap scratch buffer */
-static coap_rw_buffer_t scratch_buf = { scratch_raw, sizeof(scratch_raw) };
+/**
+ * @brief   What the node reports, switched with POST /mode
+ */
+typedef enum {
+    MODE_AGGR,          /**< statistics of each window of readings */
+    MODE_RAW,           /**< one reading per update interval */
+} report_mode_t;
+
+static const char *mode_names[] = { "aggr", "raw" };
+static volatile report_mode_t mode = MODE_AGGR;
+
+/* statistics of the current window, in the units of send_update() */
+static aggr_t aggr_light, aggr_pres, aggr_temp;
+
 static ipv6_addr_t dst_addr;
 
-/* buffer for composing SemML messages in */
-static char p_buf[512];
+/* the gateway, the blocks of larger packs are sent to it confirmable */
+static coap_peer_t gw_peer;
+static xtimer_t con_timer;
+static msg_t con_msg = { .type = MSG_CON_TIMER };
+static kernel_pid_t beac_pid = KERNEL_PID_UNDEF;
+
+/* request template for SenML reports, the pack is composed in place behind
+ * the CoAP header. The largest pack is the full summary, 644 byte as JSON
+ * with every value at its extreme */
+static uint8_t snd_buf[704];
+static coap_template_t senml_tpl;
+static char *p_buf;
+static size_t p_size;
 static size_t initial_pos;
 
-static const coap_header_t req_hdr = {
-        .version = 1,
-        .type    = COAP_TYPE_NONCON,
-        .tkllen  = 0,
-        .code    = COAP_METHOD_POST,
-        .mid     = {5, 57}            // is equivalent to 1337 when converted to uint16_t
-};
+/* one block of a SenML pack plus header, Uri-Path and Block1 option */
+static uint8_t blk_buf[COAP_BLOCK_SIZE(COAP_BLOCK_SZX) + 32];
+
+/* larger packs are uploaded one confirmable block at a time, the pack and
+ * blk_buf belong to the upload until the gateway answered the last block */
+static coap_block1_tx_t blk_tx;
+static bool blk_busy;
+
+/* reporting policy, the LED is sent when it changes, the sensors when they
+ * leave their deadband or were silent for 30s, everything with every
+ * heartbeat */
+static senml_field_t heartbeat = SENML_FIELD(0, 0, HEARTBEAT_INTERVAL);
+static senml_field_t fld_led = SENML_FIELD(0, 0, 0);
+static senml_field_t fld_light = SENML_FIELD(5, 50, 30000);
+static senml_field_t fld_pres = SENML_FIELD(2, 0, 30000);
+static senml_field_t fld_temp = SENML_FIELD(100, 0, 30000);
+
+/* the records of a report are only taken as reported once its pack was
+ * built, a pack that does not fit restores them */
+static senml_field_t *const fields[] = { &heartbeat, &fld_led, &fld_light, &fld_pres, &fld_temp };
+#define FIELDS_NUMOF        (sizeof(fields) / sizeof(fields[0]))
 
 static const coap_endpoint_path_t path_led = { 1, { "led" } };
+static const coap_endpoint_path_t path_mode = { 1, { "mode" } };
 
-static int handle_post_led(coap_rw_buffer_t *scratch,
-                           const coap_packet_t *inpkt, coap_packet_t *outpkt,
-                           uint8_t id_hi, uint8_t id_lo)
+static int handle_post_led(const coap_packet_t *inpkt, coap_encoder_t *rsp)
 {
     coap_responsecode_t resp = COAP_RSPCODE_CHANGED;
     uint8_t val = inpkt->payload.p[0];
@@ -95,51 +138,92 @@ static int handle_post_led(coap_rw_buffer_t *scratch,
         resp = COAP_RSPCODE_NOT_ACCEPTABLE;
     }
 
-    return coap_make_response(scratch, outpkt, NULL, 0,
-                              id_hi, id_lo, &inpkt->token, resp,
-                              COAP_CONTENTTYPE_TEXT_PLAIN, false);
+    return coap_enc_response(rsp, resp, COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
+}
+
+static int handle_get_mode(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    (void)inpkt;
+    const char *name = mode_names[mode];
+
+    return coap_enc_response(rsp, COAP_RSPCODE_CONTENT, COAP_CONTENTTYPE_TEXT_PLAIN,
+                             (const uint8_t *)name, strlen(name));
+}
+
+/* "aggr" or "raw", the beaconing thread picks the new mode up with its next
+ * update */
+static int handle_post_mode(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+    coap_responsecode_t resp = COAP_RSPCODE_BAD_REQUEST;
+
+    for (unsigned i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+        if ((inpkt->payload.len == strlen(mode_names[i])) &&
+            (memcmp(inpkt->payload.p, mode_names[i], inpkt->payload.len) == 0)) {
+            mode = (report_mode_t)i;
+            resp = COAP_RSPCODE_CHANGED;
+        }
+    }
+
+    return coap_enc_response(rsp, resp, COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
 }
 
 const coap_endpoint_t endpoints[] =
 {
     { COAP_METHOD_POST,  handle_post_led, &path_led, "ct=0" },
+    { COAP_METHOD_GET,   handle_get_mode, &path_mode, "ct=0" },
+    { COAP_METHOD_POST,  handle_post_mode, &path_mode, "ct=0" },
     /* marks the end of the endpoints array: */
     { (coap_method_t)0, NULL, NULL, NULL }
 };
 
+/* microcoap's shared state (messages in flight, observers, duplicate cache,
+ * IDs) is used from more than one thread */
+static mutex_t coap_mutex = MUTEX_INIT;
+
+void coap_lock(void)
+{
+    mutex_lock(&coap_mutex);
+}
+
+void coap_unlock(void)
+{
+    mutex_unlock(&coap_mutex);
+}
+
+#ifdef COAP_WITH_STATS
+/* handler times for GET /.well-known/stats */
+uint32_t coap_stats_usec(void)
+{
+    return xtimer_now();
+}
+#endif
+
 void *microcoap_server(void *arg)
 {
     (void) arg;
     msg_init_queue(_coap_msg_q, Q_SZ);
 
     uint8_t laddr[16] = { 0 };
-    uint8_t raddr[16] = { 0 };
     size_t raddr_len;
-    uint16_t rport;
     conn_udp_t conn;
     int rc = conn_udp_create(&conn, laddr, sizeof(laddr), AF_INET6, COAP_SERVER_PORT);
+    /* this thread is the only worker, it keeps its context for good */
+    coap_ctx_t *ctx = coap_ctx_acquire();
 
     while (1) {
-        if ((rc = conn_udp_recvfrom(&conn, (char *)udp_buf, sizeof(udp_buf),
-                                    raddr, &raddr_len, &rport)) < 0) {
+        if ((rc = conn_udp_recvfrom(&conn, (char *)ctx->rx, sizeof(ctx->rx),
+                                    ctx->peer.addr, &raddr_len, &ctx->peer.port)) < 0) {
             continue;
         }
+        ctx->rxlen = rc;
 
-        coap_packet_t pkt;
-        /* parse UDP packet to CoAP */
-        if (0 == (rc = coap_parse(&pkt, udp_buf, rc))) {
-            coap_packet_t rsppkt;
-
-            /* handle CoAP request */
-            coap_handle_req(&scratch_buf, &pkt, &rsppkt, false, false);
-
-            /* build reply */
-            size_t rsplen = sizeof(udp_buf);
-            if ((rc = coap_build(udp_buf, &rsplen, &rsppkt)) == 0) {
-                /* send reply via UDP */
-                rc = conn_udp_sendto(udp_buf, rsplen, NULL, 0, raddr, raddr_len,
-                                     AF_INET6, COAP_SERVER_PORT, rport);
-            }
+        /* parse, drop duplicates and handle, the reply is encoded into ctx->tx */
+        coap_ctx_handle(ctx, (uint32_t)(xtimer_now64() / 1000), false, false);
+
+        /* send reply via UDP */
+        if (ctx->txlen > 0) {
+            rc = conn_udp_sendto(ctx->tx, ctx->txlen, NULL, 0, ctx->peer.addr, raddr_len,
+                                 AF_INET6, COAP_SERVER_PORT, ctx->peer.port);
         }
     }
 
@@ -147,59 +231,253 @@ void *microcoap_server(void *arg)
     return NULL;
 }
 
-void send_coap_post(uint8_t *data, size_t len)
+static void senml_tpl_init(void)
+{
+    coap_encoder_t enc;
+    size_t len;
+
+    coap_enc_init(&enc, snd_buf, sizeof(snd_buf), COAP_TYPE_NONCON,
+                  COAP_METHOD_POST, 0, 0, NULL);
+    coap_enc_option(&enc, COAP_OPTION_URI_PATH, (const uint8_t *)"senml", 5);
+#if SENML_CONTENT_FORMAT >= 0
+    coap_enc_option_uint(&enc, COAP_OPTION_CONTENT_FORMAT, SENML_CONTENT_FORMAT);
+#endif
+    /* the node never reads the reply, ask the gateway not to send one */
+    coap_enc_option_uint(&enc, COAP_OPTION_NO_RESPONSE, COAP_NORESP_ALL);
+    coap_tpl_init(&senml_tpl, &enc);
+    p_buf = (char *)coap_tpl_payload(&senml_tpl, &len);
+    p_size = len;
+}
+
+static int send_from_server(const coap_peer_t *peer, const uint8_t *buf, size_t len)
+{
+    /* sent from the server port, so ACKs and Resets end up in microcoap_server() */
+    int rc = conn_udp_sendto(buf, len, NULL, 0, peer->addr, sizeof(peer->addr),
+                             AF_INET6, COAP_SERVER_PORT, peer->port);
+
+    return (rc < 0) ? rc : 0;
+}
+
+/* runs due retransmissions and re-arms the timer for the next one */
+static void con_timer_update(void)
 {
-    uint8_t  snd_buf[128];
-    size_t   req_pkt_sz;
+    uint32_t next = coap_con_tick((uint32_t)(xtimer_now64() / 1000));
 
-    coap_buffer_t payload = {
-            .p   = data,
-            .len = len
-    };
+    if (next > 0) {
+        xtimer_set_msg(&con_timer, next * 1000, &con_msg, thread_getpid());
+    }
+}
 
-    coap_packet_t req_pkt = {
-            .header  = req_hdr,
-            .token   = (coap_buffer_t) { 0 },
-            .numopts = 1,
-            .opts    = {{{(uint8_t *)"senml", 5}, (uint8_t)COAP_OPTION_URI_PATH}},
-            .payload = payload
-    };
+static void blk_done(void *arg, int result, const coap_packet_t *rsp)
+{
+    msg_t m = { .type = MSG_BLOCK1_DONE };
+    (void)arg;
 
-    req_pkt_sz = sizeof(req_pkt);
+    /* the ACK arrives in the server thread, the upload goes on in the
+     * beaconing thread; 0 stands for a block that got lost */
+    m.content.value = ((result == 0) && (rsp != NULL)) ? rsp->header.code : 0;
+    msg_send(&m, beac_pid);
+}
+
+/* sends block blk_tx.num, it is repeated until the gateway acknowledges it */
+static void blk_send(void)
+{
+    size_t pkt_len = coap_block1_build(&blk_tx, blk_tx.num, blk_buf, sizeof(blk_buf),
+                                       coap_mid_next());
+
+    blk_busy = (pkt_len > 0) &&
+               (coap_con_send(&gw_peer, blk_buf, pkt_len, (uint32_t)(xtimer_now64() / 1000),
+                              send_from_server, blk_done, NULL) == 0);
+    if (!blk_busy) {
+        printf("SenML upload failed at block %u\n", (unsigned)blk_tx.num);
+    }
+    con_timer_update();
+}
+
+/* the gateway answered the current block with code, the next one goes out
+ * once it asked for it with 2.31 */
+static void blk_next(unsigned code)
+{
+    blk_busy = false;
+    if (code == COAP_RSPCODE_CONTINUE) {
+        blk_tx.num++;
+        blk_send();
+    }
+    else if (code != COAP_RSPCODE_CHANGED) {
+        printf("SenML upload failed at block %u (%u.%02u)\n", (unsigned)blk_tx.num,
+               code >> 5, code & 0x1f);
+    }
+}
 
-    if (coap_build(snd_buf, &req_pkt_sz, &req_pkt) != 0) {
+static void fields_save(senml_field_t *saved)
+{
+    for (unsigned i = 0; i < FIELDS_NUMOF; i++) {
+        saved[i] = *fields[i];
+    }
+}
+
+static void fields_restore(const senml_field_t *saved)
+{
+    for (unsigned i = 0; i < FIELDS_NUMOF; i++) {
+        *fields[i] = saved[i];
+    }
+    printf("SenML pack too large, the report is sent again later\n");
+}
+
+void send_coap_post(size_t len)
+{
+    size_t pkt_len;
+
+    /* a pack that fits into one block goes out straight from the template */
+    if (len <= COAP_BLOCK_SIZE(COAP_BLOCK_SZX)) {
+        pkt_len = coap_tpl_finish(&senml_tpl, coap_mid_next(), len);
+        if (pkt_len == 0) {
             printf("CoAP build failed :(\n");
             return;
+        }
+        conn_udp_sendto(snd_buf, pkt_len, NULL, 0, &dst_addr, sizeof(dst_addr),
+                        AF_INET6, SPORT, UDP_PORT);
+        return;
     }
 
-    conn_udp_sendto(snd_buf, req_pkt_sz, NULL, 0, &dst_addr, sizeof(dst_addr),
-                    AF_INET6, SPORT, UDP_PORT);
+    /* larger ones are uploaded as link sized blocks (Block1) */
+    coap_block1_init(&blk_tx, &senml_tpl, (uint8_t *)p_buf, len, COAP_BLOCK_SZX);
+    blk_tx.con = true;
+    blk_send();
 }
 
 static void send_update(size_t pos, char *buf)
 {
-    char led = (gpio_read(LED0_PIN)) ? '0' : '1';
-    int lux, pres, pres_abs, temp, temp_abs;
-
-    lux = isl29020_read(&light_dev);
-
-    pres = lps331ap_read_pres(&tp_dev);
-    temp = lps331ap_read_temp(&tp_dev);
-    pres_abs = pres / 1000;
-    pres -= pres_abs * 1000;
-    temp_abs = temp / 1000;
-    temp -= temp_abs * 1000;
-
-    pos += sprintf(&buf[pos], "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"%c\"},",
-                   led);
-    pos += sprintf(&buf[pos], "{\"n\":\"s:light\", \"u\":\"lux\", \"v\":\"%d\"},",
-                   lux);
-    pos += sprintf(&buf[pos], "{\"n\":\"s:pressure\", \"u\":\"bar\", \"v\":\"%2i.%03i\"},",
-                   pres_abs, pres);
-    pos += sprintf(&buf[pos], "{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"%2i.%03i\"}]",
-                   temp_abs, temp);
-
-    send_coap_post((uint8_t *)buf, pos);
+    senml_enc_t enc;
+    senml_field_t saved[FIELDS_NUMOF];
+    uint32_t now = (uint32_t)(xtimer_now64() / 1000);
+    bool full;
+    int32_t led = !gpio_read(LED0_PIN);
+    int32_t light = isl29020_read(&light_dev);
+    /* pressure in mbar, temperature in m°C */
+    int32_t pres = lps331ap_read_pres(&tp_dev);
+    int32_t temp = lps331ap_read_temp(&tp_dev);
+
+    /* the previous pack is still being uploaded, the changes wait for the
+     * next update */
+    if (blk_busy) {
+        return;
+    }
+    fields_save(saved);
+    full = senml_heartbeat(&heartbeat, now);
+
+    senml_init(&enc, buf, p_size, pos);
+    if (senml_due(&fld_led, led, now, full)) {
+        senml_bool(&enc, "a:led", "bool", led);
+    }
+    if (senml_due(&fld_light, light, now, full)) {
+        senml_int(&enc, "s:light", "lux", light);
+    }
+    if (senml_due(&fld_pres, pres, now, full)) {
+        senml_fixed(&enc, "s:pressure", "bar", pres, 3);
+    }
+    if (senml_due(&fld_temp, temp, now, full)) {
+        senml_fixed(&enc, "s:temp", "°C", temp, 3);
+    }
+
+    /* nothing changed */
+    if (senml_pos(&enc) == pos) {
+        return;
+    }
+    if ((pos = senml_end(&enc)) > 0) {
+        send_coap_post(pos);
+    }
+    else {
+        fields_restore(saved);
+    }
+}
+
+static void sample(void)
+{
+    aggr_add(&aggr_light, isl29020_read(&light_dev));
+    aggr_add(&aggr_pres, lps331ap_read_pres(&tp_dev));
+    aggr_add(&aggr_temp, lps331ap_read_temp(&tp_dev));
+}
+
+/* mean, minimum, maximum and variance of a window as "<name>",
+ * "<name>_min", "<name>_max" and "<name>_var". The mean gets one decimal
+ * more than the readings, the variance (without unit) twice their decimals
+ * plus one */
+static void senml_stats(senml_enc_t *enc, const char *name, const char *unit,
+                        unsigned decimals, const aggr_t *aggr)
+{
+    char stat[16];
+    size_t len = strlen(name);
+
+    if (len > sizeof(stat) - sizeof("_min")) {
+        return;
+    }
+    memcpy(stat, name, len);
+
+    senml_fixed(enc, name, unit, aggr_mean(aggr, 1), decimals + 1);
+    memcpy(&stat[len], "_min", sizeof("_min"));
+    senml_fixed(enc, stat, unit, aggr->min, decimals);
+    memcpy(&stat[len], "_max", sizeof("_max"));
+    senml_fixed(enc, stat, unit, aggr->max, decimals);
+    memcpy(&stat[len], "_var", sizeof("_var"));
+    senml_units(enc, false);
+    senml_fixed(enc, stat, unit, aggr_var(aggr, 1), 2 * decimals + 1);
+    senml_units(enc, true);
+}
+
+/* the deadbands apply to mean, minimum and maximum, so a short peak within
+ * a window is reported as well */
+static bool aggr_due(senml_field_t *field, const aggr_t *aggr,
+                     uint32_t now, bool full)
+{
+    int32_t vals[3] = { aggr_mean(aggr, 0), aggr->min, aggr->max };
+
+    return senml_due_vector(field, vals, 3, now, full);
+}
+
+static void send_summary(size_t pos, char *buf)
+{
+    senml_enc_t enc;
+    senml_field_t saved[FIELDS_NUMOF];
+    uint32_t now = (uint32_t)(xtimer_now64() / 1000);
+    bool full;
+    int32_t led = !gpio_read(LED0_PIN);
+
+    /* the previous pack is still being uploaded, the window grows until
+     * it is done */
+    if (blk_busy) {
+        return;
+    }
+    fields_save(saved);
+    full = senml_heartbeat(&heartbeat, now);
+
+    senml_init(&enc, buf, p_size, pos);
+    if (senml_due(&fld_led, led, now, full)) {
+        senml_bool(&enc, "a:led", "bool", led);
+    }
+    if (aggr_due(&fld_light, &aggr_light, now, full)) {
+        senml_stats(&enc, "s:light", "lux", 0, &aggr_light);
+    }
+    if (aggr_due(&fld_pres, &aggr_pres, now, full)) {
+        senml_stats(&enc, "s:pressure", "bar", 3, &aggr_pres);
+    }
+    if (aggr_due(&fld_temp, &aggr_temp, now, full)) {
+        senml_stats(&enc, "s:temp", "°C", 3, &aggr_temp);
+    }
+    aggr_reset(&aggr_light);
+    aggr_reset(&aggr_pres);
+    aggr_reset(&aggr_temp);
+
+    /* nothing changed */
+    if (senml_pos(&enc) == pos) {
+        return;
+    }
+    if ((pos = senml_end(&enc)) > 0) {
+        send_coap_post(pos);
+    }
+    else {
+        fields_restore(saved);
+    }
 }
 
 void *beaconing(void *arg)
@@ -209,21 +487,47 @@ void *beaconing(void *arg)
     msg_t msg;
     msg_t update_msg;
     kernel_pid_t mypid = thread_getpid();
+    report_mode_t cur = mode;
 
-    /* initialize message queue */
+    /* initialize message queue, blk_done() sends here */
     msg_init_queue(_beac_msg_q, Q_SZ);
+    beac_pid = mypid;
 
     /* start periodic timer */
     update_msg.type = MSG_UPDATE_EVENT;
-    xtimer_set_msg(&status_timer, UPDATE_INTERVAL, &update_msg, mypid);
+    xtimer_set_msg(&status_timer, SAMPLE_INTERVAL, &update_msg, mypid);
 
     while(1) {
         msg_receive(&msg);
 
         switch (msg.type) {
             case MSG_UPDATE_EVENT:
-                xtimer_set_msg(&status_timer, UPDATE_INTERVAL, &update_msg, mypid);
-                send_update(initial_pos, p_buf);
+                /* a partial window goes out before switching, the first
+                 * report in the new mode is a full one */
+                if (cur != mode) {
+                    if (aggr_light.n > 0) {
+                        send_summary(initial_pos, p_buf);
+                    }
+                    cur = mode;
+                    heartbeat.valid = false;
+                }
+                if (cur == MODE_RAW) {
+                    xtimer_set_msg(&status_timer, UPDATE_INTERVAL, &update_msg, mypid);
+                    send_update(initial_pos, p_buf);
+                }
+                else {
+                    xtimer_set_msg(&status_timer, SAMPLE_INTERVAL, &update_msg, mypid);
+                    sample();
+                    if (aggr_light.n >= AGGR_WINDOW) {
+                        send_summary(initial_pos, p_buf);
+                    }
+                }
+                break;
+            case MSG_CON_TIMER:
+                con_timer_update();
+                break;
+            case MSG_BLOCK1_DONE:
+                blk_next((unsigned)msg.content.value);
                 break;
             default:
                 break;
@@ -246,22 +550,29 @@ int main(void)
 #endif
 
     eui64_t iid;
+    senml_enc_t senml;
     netopt_enable_t acks = NETOPT_DISABLE;
     kernel_pid_t ifs[GNRC_NETIF_NUMOF];
 
     gnrc_netif_get(ifs);
     gnrc_netapi_set(ifs[0], NETOPT_AUTOACK, 0, &acks, sizeof(acks));
     ipv6_addr_from_str(&dst_addr, "2001:affe:1234::1");
+    memcpy(gw_peer.addr, &dst_addr, sizeof(gw_peer.addr));
+    gw_peer.port = UDP_PORT;
     // ipv6_addr_from_str(&dst_addr, "fd38:3734:ad48:0:211d:50ce:a189:7cc4");
 
     /* initialize senml payload */
+    senml_tpl_init();
     gnrc_netapi_get(ifs[0], NETOPT_IPV6_IID, 0, &iid, sizeof(eui64_t));
 
-    initial_pos  = sprintf(&p_buf[initial_pos], "[{\"bn\":\"urn:dev:mac:");
-    initial_pos += sprintf(&p_buf[initial_pos], "%02x%02x%02x%02x%02x%02x%02x%02x",
-                           iid.uint8[0], iid.uint8[1], iid.uint8[2], iid.uint8[3],
-                           iid.uint8[4], iid.uint8[5], iid.uint8[6], iid.uint8[7]);
-    initial_pos += sprintf(&p_buf[initial_pos], "\"},");
+    /* message IDs and tokens start at a node specific value */
+    coap_seed((((uint32_t)iid.uint8[4] << 24) | ((uint32_t)iid.uint8[5] << 16) |
+               ((uint32_t)iid.uint8[6] << 8) | iid.uint8[7]) ^ xtimer_now());
+
+    /* the base record is written once, the reports continue behind it */
+    senml_init(&senml, p_buf, p_size, 0);
+    senml_base(&senml, "urn:dev:mac:", iid.uint8, sizeof(iid.uint8));
+    initial_pos = senml_pos(&senml);
 
     /* initialize ISL29020 Light Sensor */
     isl29020_init(&light_dev, ISL29020_I2C, ISL29020_ADDR, LIGHT_RANGE, LIGHT_MODE);
@@ -271,6 +582,8 @@ int main(void)
     LED2_OFF; /* orange */
     LED1_OFF; /* green */
 
+    /* build the CoAP routing table before the server thread starts */
+    coap_init();
     thread_create(coap_stack, sizeof(coap_stack), PRIO - 1, THREAD_CREATE_STACKTEST, microcoap_server,
                   NULL, "coap");
 #ifdef WITH_SHELL
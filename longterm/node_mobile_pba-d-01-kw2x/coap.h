@@ -12,8 +12,14 @@
  * Example endpoint handlers are defined in [endpoints.c](https://github.com/i2ot/microcoap/blob/master/endpoints.c).
  *
  * * GET/PUT/POST/DELETE
- * * No retries
- * * Piggybacked and seperate ACKs possible
+ * * ETags and 2.03 Valid for unchanged representations
+ * * Observe (RFC 7641) with up to COAP_OBS_MAX observers
+ * * Confirmable messages are retransmitted with exponential backoff, up to
+ *   COAP_CON_MAX at a time
+ * * Piggybacked ACKs and separate responses, up to COAP_SEP_MAX requests
+ *   can wait for theirs
+ * * Responses are matched to our own requests by token, up to COAP_REQ_MAX
+ *   at a time, with timeouts and round-trip times
  *
  * @author Toby Jaffey <toby@1248.io>
  * @author Lennart Dührsen <lennart.duehrsen@fu-berlin.de>
@@ -32,7 +38,9 @@ extern "C" {
 
 #define COAP_PORT 5683   //!< The port number used by the CoAP protocol.
 
-#define MAXOPT    16     //!< The maximum number of options supported in one packet.
+#ifndef MAXOPT
+#define MAXOPT    16     //!< The maximum number of options supported in one packet by coap_parse().
+#endif
 
 
 
@@ -68,10 +76,27 @@ typedef struct
 typedef struct
 {
         coap_buffer_t val;   //!< option value
-        uint8_t       num;   //!< option number
+        uint16_t      num;   //!< option number
 } coap_option_t;
 
 
+#define COAP_OPTIDX_NUMOF 6   //!< Number of option numbers with a direct entry in coap_optidx_t
+
+
+/**
+ * Lookup index over the options of a parsed packet, built on demand by
+ * coap_optidx_build() for handlers that look up many options of a packet
+ * with many options. For the few options of a typical request,
+ * coap_find_options() scanning them is as fast.
+ */
+typedef struct
+{
+        uint32_t present;                    //!< bit n is set if option number n (< 32) is present
+        uint8_t  first[COAP_OPTIDX_NUMOF];   //!< index into opts of the first instance per indexed option
+        uint8_t  count[COAP_OPTIDX_NUMOF];   //!< number of instances per indexed option
+} coap_optidx_t;
+
+
 typedef struct
 {
         coap_header_t header;         //!< header of the packet
@@ -82,6 +107,23 @@ typedef struct
 } coap_packet_t;
 
 
+typedef struct
+{
+        coap_header_t header;   //!< header of the packet
+        coap_buffer_t token;    //!< token value, size as specified by header.tkllen
+        coap_buffer_t opts;     //!< undecoded options and payload, i.e. everything behind the token
+} coap_raw_packet_t;
+
+
+typedef struct
+{
+        const uint8_t  *p;     //!< next byte to decode
+        const uint8_t  *end;   //!< end of the packet
+              uint16_t  num;   //!< number of the last decoded option
+              int       err;   //!< 0, or the coap_error_t that stopped the iteration
+} coap_opt_iter_t;
+
+
 typedef enum
 {
         COAP_OPTION_IF_MATCH       = 1,
@@ -97,10 +139,19 @@ typedef enum
         COAP_OPTION_URI_QUERY      = 15,
         COAP_OPTION_ACCEPT         = 17,
         COAP_OPTION_LOCATION_QUERY = 20,
+        COAP_OPTION_BLOCK2         = 23,
+        COAP_OPTION_BLOCK1         = 27,
         COAP_OPTION_PROXY_URI      = 35,
-        COAP_OPTION_PROXY_SCHEME   = 39
+        COAP_OPTION_PROXY_SCHEME   = 39,
+        COAP_OPTION_NO_RESPONSE    = 258
 } coap_option_num_t;
 
+// Values of the No-Response option, see [RFC 7967](https://tools.ietf.org/html/rfc7967)
+#define COAP_NORESP_2XX (0x02)                                              //!< Suppress 2.xx responses
+#define COAP_NORESP_4XX (0x08)                                              //!< Suppress 4.xx responses
+#define COAP_NORESP_5XX (0x10)                                              //!< Suppress 5.xx responses
+#define COAP_NORESP_ALL (COAP_NORESP_2XX | COAP_NORESP_4XX | COAP_NORESP_5XX)   //!< Suppress all responses
+
 
 typedef enum
 {
@@ -130,6 +181,7 @@ typedef enum
         COAP_RSPCODE_VALID                 = MAKE_RSPCODE(2, 3),
         COAP_RSPCODE_CHANGED               = MAKE_RSPCODE(2, 4),
         COAP_RSPCODE_CONTENT               = MAKE_RSPCODE(2, 5),
+        COAP_RSPCODE_CONTINUE              = MAKE_RSPCODE(2, 31),
         COAP_RSPCODE_BAD_REQUEST           = MAKE_RSPCODE(4, 0),
         COAP_RSPCODE_UNAUTHORIZED          = MAKE_RSPCODE(4, 1),
         COAP_RSPCODE_BAD_OPTION            = MAKE_RSPCODE(4, 2),
@@ -137,6 +189,9 @@ typedef enum
         COAP_RSPCODE_NOT_FOUND             = MAKE_RSPCODE(4, 4),
         COAP_RSPCODE_METHOD_NOT_ALLOWED    = MAKE_RSPCODE(4, 5),
         COAP_RSPCODE_NOT_ACCEPTABLE        = MAKE_RSPCODE(4, 6),
+        COAP_RSPCODE_ENTITY_INCOMPLETE     = MAKE_RSPCODE(4, 8),
+        COAP_RSPCODE_ENTITY_TOO_LARGE      = MAKE_RSPCODE(4, 13),
+        COAP_RSPCODE_UNSUPPORTED_FORMAT    = MAKE_RSPCODE(4, 15),
         COAP_RSPCODE_INTERNAL_SERVER_ERROR = MAKE_RSPCODE(5, 0),
         COAP_RSPCODE_NOT_IMPLEMENTED       = MAKE_RSPCODE(5, 1),
         COAP_RSPCODE_SERVICE_UNAVAILABLE   = MAKE_RSPCODE(5, 3)
@@ -150,7 +205,8 @@ typedef enum
                                                              and is problematic because the ct
                                                              values is interpreted as unsigned int) */
         COAP_CONTENTTYPE_TEXT_PLAIN             =  0,
-        COAP_CONTENTTYPE_APPLICATION_LINKFORMAT = 40
+        COAP_CONTENTTYPE_APPLICATION_LINKFORMAT = 40,
+        COAP_CONTENTTYPE_APPLICATION_CBOR       = 60
 } coap_content_type_t;
 
 
@@ -167,19 +223,194 @@ typedef enum
         COAP_ERR_OPTION_LEN_INVALID          = 8,
         COAP_ERR_BUFFER_TOO_SMALL            = 9,
         COAP_ERR_UNSUPPORTED                 = 10,
-        COAP_ERR_OPTION_DELTA_INVALID        = 11
+        COAP_ERR_OPTION_DELTA_INVALID        = 11,
+        COAP_ERR_TIMEOUT                     = 12,
+        COAP_ERR_RESET                       = 13,
+        COAP_ERR_TOO_MANY_OPTIONS            = 14
 } coap_error_t;
 
 
-typedef int (*coap_endpoint_func)(      coap_rw_buffer_t *scratch,
-                                  const coap_packet_t    *inpkt,
-                                        coap_packet_t    *outpkt,
-                                        uint8_t           id_hi,
-                                        uint8_t           id_lo);
+typedef struct
+{
+        uint8_t  addr[16];   //!< IPv6 address of the peer
+        uint16_t port;       //!< UDP port of the peer
+} coap_peer_t;
+
+
+/**
+ * Sends \p len bytes in \p buf to \p peer, used for messages the library
+ * originates itself, e.g. notifications. Must be sent from the server port.
+ *
+ * @return 0 on success, negative on error.
+ */
+typedef int (*coap_send_func)(const coap_peer_t *peer,
+                              const uint8_t     *buf,
+                                    size_t       len);
+
+
+/**
+ * Called once the transmission of a confirmable message is complete.
+ *
+ * @param[in] arg The argument given to coap_con_send().
+ * @param[in] result 0 if the message was acknowledged, COAP_ERR_RESET if the
+ * peer rejected it, or COAP_ERR_TIMEOUT if it was never acknowledged.
+ * @param[in] rsp The ACK or Reset, NULL on timeout. A piggybacked response
+ * is part of the ACK.
+ */
+typedef void (*coap_con_func)(      void          *arg,
+                                    int            result,
+                              const coap_packet_t *rsp);
+
+
+/**
+ * Called once a request sent by coap_req_send() is complete.
+ *
+ * @param[in] arg The argument given to coap_req_send().
+ * @param[in] result 0 if a response arrived, COAP_ERR_RESET if the peer
+ * rejected the request, or COAP_ERR_TIMEOUT if no response arrived in time.
+ * @param[in] rsp The response or Reset, NULL on timeout.
+ * @param[in] rtt Time in ms from sending the request to its completion,
+ * retransmissions included. 0 if the response was handed in through
+ * coap_handle_req(), which does not know the time.
+ */
+typedef void (*coap_resp_func)(      void          *arg,
+                                     int            result,
+                               const coap_packet_t *rsp,
+                                     uint32_t       rtt);
+
+
+typedef struct coap_ctx coap_ctx_t;
+
+
+typedef struct
+{
+              uint8_t     *buf;       //!< buffer the message is written to
+              size_t       len;       //!< size of buf in bytes
+              size_t       pos;       //!< number of bytes written so far, i.e. the length of the message
+              uint16_t     lastopt;   //!< number of the last option written, options must be added in ascending order
+              bool         payload;   //!< true once the payload marker has been written
+              coap_ctx_t  *ctx;       //!< request context the response belongs to, NULL if there is none
+        const coap_peer_t *peer;      //!< sender of the request answered, NULL if unknown
+} coap_encoder_t;
+
+
+typedef struct
+{
+        uint8_t  *buf;       //!< buffer holding the encoded prefix, the payload follows right behind
+        size_t    len;       //!< size of buf in bytes
+        size_t    prefix;    //!< length of header, token, options and payload marker
+        uint16_t  lastopt;   //!< number of the last option in the prefix
+} coap_template_t;
+
+
+#ifndef COAP_BLOCK_SZX
+#define COAP_BLOCK_SZX 2   //!< Largest block size exponent used by this node, 2 = 64 byte blocks fit into a single 802.15.4 frame
+#endif
+
+#define COAP_BLOCK_SIZE(szx) (1U << ((szx) + 4))   //!< Block size in bytes for the size exponent \p szx
+
+
+/**
+ * Value of a Block1 or Block2 option, see
+ * [RFC 7959](https://tools.ietf.org/html/rfc7959).
+ */
+typedef struct
+{
+        uint32_t num;    //!< block number, the block starts at num * COAP_BLOCK_SIZE(szx)
+        uint8_t  szx;    //!< block size exponent (0..6)
+        bool     more;   //!< true if more blocks follow
+} coap_block_t;
+
+
+/**
+ * State of a block-wise upload (Block1) of a request body.
+ */
+typedef struct
+{
+        const coap_template_t *tpl;    //!< request the body is sent with, the blocks copy its prefix
+        const uint8_t         *body;   //!< the complete request body
+              size_t           len;    //!< length of body in bytes
+              uint32_t         num;    //!< number of the next block to be sent
+              uint8_t          szx;    //!< block size exponent
+              bool             con;    //!< send the blocks confirmable, whatever the type of tpl
+} coap_block1_tx_t;
+
+
+/**
+ * Endpoint handler. Header and token of the response are already written to
+ * \p rsp when the handler is called, the handler adds the response code,
+ * options and payload, e.g. using coap_enc_response().
+ *
+ * @return 0 on success; on any other value the response written so far is
+ * replaced by an empty 5.00 response.
+ */
+typedef int (*coap_endpoint_func)(const coap_packet_t  *inpkt,
+                                        coap_encoder_t *rsp);
 
 
 #define MAX_SEGMENTS 8   //!< Maximum number of URI segments supported (e.g. 2 = /foo/bar, 3 = /foo/bar/baz)
 
+#ifndef COAP_CON_MAX
+#define COAP_CON_MAX 2   //!< Maximum number of confirmable messages in flight
+#endif
+
+#define COAP_ACK_TIMEOUT    (2000U)   //!< Initial retransmission timeout in ms, the first one is stretched by up to 50 %
+#define COAP_MAX_RETRANSMIT (4)       //!< Number of retransmissions before a message times out
+
+#ifndef COAP_DEDUP_SIZE
+#define COAP_DEDUP_SIZE 8   //!< Number of entries in the duplicate detection cache
+#endif
+
+#ifndef COAP_DEDUP_RSP_SIZE
+#define COAP_DEDUP_RSP_SIZE 24   //!< Piggybacked responses up to this size are kept to answer duplicates of confirmable requests
+#endif
+
+#define COAP_EXCHANGE_LIFETIME (247000U)   //!< Time in ms a message ID is remembered for duplicate detection
+
+#ifndef COAP_OBS_MAX
+#define COAP_OBS_MAX 2   //!< Maximum number of observers over all resources
+#endif
+
+#ifndef COAP_OBS_CON_EVERY
+#define COAP_OBS_CON_EVERY 8   //!< Every n-th notification to an observer is sent confirmable
+#endif
+
+#ifndef COAP_OBS_CON_SIZE
+#define COAP_OBS_CON_SIZE 64   //!< Space per observer for a confirmable notification, larger ones go out non-confirmable
+#endif
+
+#ifndef COAP_REQ_MAX
+#define COAP_REQ_MAX 2   //!< Maximum number of own requests waiting for their response
+#endif
+
+#ifndef COAP_SEP_MAX
+#define COAP_SEP_MAX 2   //!< Maximum number of requests waiting for a separate response
+#endif
+
+#ifndef COAP_CTX_NUMOF
+#define COAP_CTX_NUMOF 1   //!< Number of request contexts, i.e. requests that can be handled at the same time
+#endif
+
+#ifndef COAP_CTX_RX_SIZE
+#define COAP_CTX_RX_SIZE 512   //!< Size of the receive buffer of a request context
+#endif
+
+#ifndef COAP_CTX_TX_SIZE
+#define COAP_CTX_TX_SIZE 128   //!< Size of the response buffer of a request context
+#endif
+
+#ifndef COAP_CTX_SCRATCH_SIZE
+#define COAP_CTX_SCRATCH_SIZE 64   //!< Size of the scratch space handlers may use
+#endif
+
+#ifndef COAP_CORE_SIZE
+#define COAP_CORE_SIZE 128   //!< Size of the link-format listing served at /.well-known/core
+#endif
+
+#ifndef COAP_ROUTE_NODES
+#define COAP_ROUTE_NODES 16   //!< Maximum number of nodes in the routing trie (distinct path segments + 1 for the root)
+#endif
+
 typedef struct
 {
               int   count;                 //!< Number of segments (i.e. number of elements in \p elems)
@@ -190,12 +421,87 @@ typedef struct
 typedef struct
 {
               coap_method_t         method;      //!< Request method (GET, POST, PUT, or DELETE)
-              coap_endpoint_func    handler;     //!< callback function which handles this type of endpoint (and calls coap_make_response() at some point)
+              coap_endpoint_func    handler;     //!< callback function which handles this type of endpoint (and calls coap_enc_response() at some point)
         const coap_endpoint_path_t *path;        //!< path towards a resource (i.e. foo/bar/)
-        const char                 *core_attr;   //!< the 'ct' attribute, as defined in RFC7252, section 7.2.1.
+        const char                 *core_attr;   //!< the 'ct' attribute, as defined in RFC7252, section 7.2.1., add 'obs' to make a GET endpoint observable
 } coap_endpoint_t;
 
 
+/**
+ * Everything one request needs while it is handled. A server thread takes a
+ * context from the pool with coap_ctx_acquire(), receives into rx and sends
+ * tx, so several threads can serve requests at the same time.
+ */
+struct coap_ctx
+{
+        coap_peer_t   peer;                             //!< sender of the request
+        coap_packet_t pkt;                              //!< the parsed request, points into rx
+        size_t        rxlen;                            //!< length of the request in rx
+        size_t        txlen;                            //!< length of the response in tx, 0 if there is none
+        uint8_t       rx[COAP_CTX_RX_SIZE];             //!< receive buffer
+        uint8_t       tx[COAP_CTX_TX_SIZE];             //!< response buffer
+        uint8_t       scratch[COAP_CTX_SCRATCH_SIZE];   //!< free for use by the handler
+        bool          used;                             //!< true while the context is taken
+};
+
+
+#ifdef COAP_WITH_LOCK
+/**
+ * Locks the state microcoap shares between threads (observers, confirmable
+ * messages, duplicate cache, ID generators, context pool). Define
+ * COAP_WITH_LOCK and provide coap_lock() and coap_unlock() when the library
+ * is used from more than one thread. The lock is never held while a handler
+ * or callback runs, so it does not need to be recursive.
+ */
+void coap_lock(void);
+
+/**
+ * Releases the lock taken by coap_lock().
+ */
+void coap_unlock(void);
+#endif
+
+
+#ifdef COAP_WITH_STATS
+#ifndef COAP_STATS_EP_MAX
+#define COAP_STATS_EP_MAX 8   //!< Number of endpoints (from the start of the endpoints array) with own counters
+#endif
+
+#define COAP_STATS_BUCKETS 6   //!< Handler time buckets: < 64 us, < 256 us, < 1 ms, < 4 ms, < 16 ms, longer
+
+/**
+ * Counters kept when COAP_WITH_STATS is defined. They are not locked, with
+ * several server threads they are approximate. GET /.well-known/stats
+ * returns them as CBOR array:
+ * [rx_pkts, rx_bytes, tx_pkts, tx_bytes, unmatched, failed, [errors],
+ *  [[hits, time...] per endpoint]].
+ */
+typedef struct
+{
+        uint32_t rx_pkts;                                        //!< packets parsed by coap_parse()
+        uint32_t rx_bytes;                                       //!< bytes of those packets
+        uint32_t tx_pkts;                                        //!< packets built by coap_build() and responses
+        uint32_t tx_bytes;                                       //!< bytes of those packets
+        uint32_t unmatched;                                      //!< requests no endpoint took (4.04, 4.05, 5.01)
+        uint32_t failed;                                         //!< handlers that returned an error (5.00)
+        uint32_t errors[COAP_ERR_TOO_MANY_OPTIONS + 1];                     //!< parse and build errors per coap_error_t
+        uint32_t hits[COAP_STATS_EP_MAX];                        //!< requests per endpoint
+        uint16_t time[COAP_STATS_EP_MAX][COAP_STATS_BUCKETS];    //!< handler execution times per endpoint, saturating
+} coap_stats_t;
+
+/**
+ * Returns a monotonic time in microseconds, used to measure the handlers.
+ * Provided by the application when COAP_WITH_STATS is defined.
+ */
+uint32_t coap_stats_usec(void);
+
+/**
+ * Returns the counters.
+ */
+const coap_stats_t *coap_stats(void);
+#endif
+
+
 
 //////////////////////////////////////////////////////////////////////
 //////////               FUNCTION DEFINITIONS               //////////
@@ -251,13 +557,96 @@ void coap_dump_packet(coap_packet_t *pkt);
  * @param[in] buf The buffer containing the CoAP packet in binary format.
  * @param[in] buflen The lenth of \p buf in bytes.
  *
- * @return 0 on success, or the according coap_error_t
+ * @return 0 on success, or the according coap_error_t, e.g.
+ * COAP_ERR_TOO_MANY_OPTIONS if the packet has more than MAXOPT options
+ * (use coap_parse_raw() for those).
  */
 int coap_parse(       coap_packet_t *pkt,
                const  uint8_t       *buf,
                       size_t         buflen);
 
 
+#ifdef COAP_WITH_TRUSTED_PARSE
+/**
+ * Like coap_parse(), but for packets of a trusted source, e.g. responses of
+ * our own gateway: the header is read as one word and none of the checks
+ * a well-formed packet passes anyway are done (version, token length,
+ * options overrunning the packet). Never use it for packets that may be
+ * malformed, it reads beyond \p buf for those. Only available if
+ * COAP_WITH_TRUSTED_PARSE is defined.
+ *
+ * @param[out] pkt The coap_packet_t structure to be filled.
+ * @param[in] buf The buffer containing a well-formed CoAP packet of at
+ * least 4 bytes.
+ * @param[in] buflen The lenth of \p buf in bytes.
+ *
+ * @return 0, or COAP_ERR_TOO_MANY_OPTIONS if the packet has more than
+ * MAXOPT options.
+ */
+int coap_parse_trusted(       coap_packet_t *pkt,
+                       const  uint8_t       *buf,
+                              size_t         buflen);
+#endif
+
+
+/**
+ * Parses only the header and token of the CoAP packet in \p buf and
+ * remembers where its options start. Nothing is copied: options and payload
+ * are decoded on demand straight from \p buf using coap_opt_iter_init() and
+ * coap_opt_iter_next(), so \p buf must stay valid while \p pkt is in use.
+ * Other than coap_parse(), this does not limit the number of options to
+ * MAXOPT.
+ *
+ * @param[out] pkt The coap_raw_packet_t structure to be filled.
+ * @param[in] buf The buffer containing the CoAP packet in binary format.
+ * @param[in] buflen The lenth of \p buf in bytes.
+ *
+ * @return 0 on success, or the according coap_error_t
+ */
+int coap_parse_raw(       coap_raw_packet_t *pkt,
+                   const  uint8_t           *buf,
+                          size_t             buflen);
+
+
+/**
+ * Prepares \p it to walk over the options of \p pkt.
+ *
+ * @param[out] it The iterator to be initialized.
+ * @param[in] pkt A packet parsed by coap_parse_raw().
+ */
+void coap_opt_iter_init(      coap_opt_iter_t   *it,
+                        const coap_raw_packet_t *pkt);
+
+
+/**
+ * Decodes the next option of the packet. Options are returned in the order
+ * they appear in the packet, which is ascending by option number.
+ *
+ * @param[in,out] it The iterator.
+ * @param[out] opt The decoded option, its value points into the packet.
+ *
+ * @return true if \p opt was filled, false if there are no more options or
+ * the packet is malformed, in which case \p it->err holds the coap_error_t.
+ */
+bool coap_opt_iter_next(coap_opt_iter_t *it,
+                        coap_option_t   *opt);
+
+
+/**
+ * Skips all options not yet decoded by \p it and returns the payload of the
+ * packet.
+ *
+ * @param[in,out] it The iterator.
+ * @param[out] payload The payload, with p = NULL and len = 0 if the packet
+ * has none.
+ *
+ * @return 0 on success, or the according coap_error_t if the options of the
+ * packet are malformed.
+ */
+int coap_opt_iter_payload(coap_opt_iter_t *it,
+                          coap_buffer_t   *payload);
+
+
 /**
  * Converts the data in \p buf into a null-terminated C string and
  * copies the result to \p strbuf.
@@ -288,10 +677,41 @@ int coap_buffer_to_string(      char          *strbuf,
  * contains no such option.
  */
 const coap_option_t *coap_find_options(const coap_packet_t *pkt,
-                                             uint8_t        num,
+                                             uint16_t       num,
                                              uint8_t       *count);
 
 
+/**
+ * Builds the lookup index over the options of \p pkt in \p idx, so
+ * coap_optidx_find() takes constant time for Uri-Path, Content-Format,
+ * Observe, Uri-Query, Block1 and Block2, and for any option number below 32
+ * that is absent from the packet.
+ *
+ * @param[out] idx The index, valid as long as the options of \p pkt do not
+ * change.
+ * @param[in] pkt The parsed packet.
+ */
+void coap_optidx_build(      coap_optidx_t *idx,
+                       const coap_packet_t *pkt);
+
+
+/**
+ * Like coap_find_options(), using the index built by coap_optidx_build().
+ *
+ * @param[in] idx The index of \p pkt.
+ * @param[in] pkt The packet.
+ * @param[in] num The option number as defined in RFC7252.
+ * @param[out] count Stores how often the option occurs in \p pkt.
+ *
+ * @return A pointer to the first instance of the option, or NULL if the
+ * packet contains no such option.
+ */
+const coap_option_t *coap_optidx_find(const coap_optidx_t *idx,
+                                      const coap_packet_t *pkt,
+                                            uint16_t       num,
+                                            uint8_t       *count);
+
+
 /**
  * Creates a CoAP message from the data in \p pkt and writes the
  * result to \p buf. The actual size of the whole message (which
@@ -334,75 +754,425 @@ int coap_make_ack(      coap_packet_t    *pkt,
 
 
 /**
- * Creates a response-only (i.e. no piggybacked ACK) packet for a request, and
- * stores it in the coap_packet_t structure pointed to by \p pkt.
+ * Starts a new message in \p buf by writing its header and token. Options and
+ * payload are then appended in place by the other coap_enc_*() functions,
+ * nothing is staged in between.
  *
- * @param[out] scratch Buffer for the content type number.
- * @param[out] pkt Pointer to the coap_packet_t that will be filled.
- * @param[in] content The response payload.
- * @param[in] content_len Length of \p content in bytes.
+ * @param[out] enc The encoder to be initialized.
+ * @param[out] buf Byte buffer the message is written to.
+ * @param[in] buflen The size of \p buf in bytes.
+ * @param[in] type The message type.
+ * @param[in] code Request method or response code.
  * @param[in] msgid_hi The high byte of the message ID.
  * @param[in] msgid_lo The low byte of the message ID.
- * @param[in] tok Pointer to the token used.
- * @param[in] rspcode The response code.
- * @param[in] content_type The content type (i.e. what does the payload contain)
- * @param[in] confirmable If true, the response packet will marked as
- * confirmable; or non-confirmable otherwise.
+ * @param[in] tok Pointer to the token used, may be NULL. The token may point
+ * into \p buf.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if header and token do
+ * not fit into \p buf, or COAP_ERR_UNSUPPORTED if the token is longer than
+ * 8 bytes.
+ */
+int coap_enc_init(      coap_encoder_t *enc,
+                        uint8_t        *buf,
+                        size_t          buflen,
+                        coap_msgtype_t  type,
+                        uint8_t         code,
+                        uint8_t         msgid_hi,
+                        uint8_t         msgid_lo,
+                  const coap_buffer_t  *tok);
+
+
+/**
+ * Overwrites the code (request method or response code) of the message.
+ *
+ * @param[in,out] enc The encoder.
+ * @param[in] code The new code.
+ */
+void coap_enc_set_code(coap_encoder_t *enc,
+                       uint8_t         code);
+
+
+/**
+ * Appends an option to the message.
+ *
+ * @param[in,out] enc The encoder.
+ * @param[in] num The option number, must not be smaller than the number of
+ * the option added before.
+ * @param[in] val The option value.
+ * @param[in] len The length of \p val in bytes.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the option does not
+ * fit, or COAP_ERR_UNSUPPORTED if options are not added in ascending order
+ * or the payload has been started already.
+ */
+int coap_enc_option(      coap_encoder_t *enc,
+                          uint16_t        num,
+                    const uint8_t        *val,
+                          size_t          len);
+
+
+/**
+ * Appends an option with an unsigned integer value in its shortest form.
+ *
+ * @see coap_enc_option()
+ */
+int coap_enc_option_uint(coap_encoder_t *enc,
+                         uint16_t        num,
+                         uint32_t        val);
+
+
+/**
+ * Returns the position in the message buffer where the next payload bytes
+ * go, so payload can be composed in place. The payload marker is accounted
+ * for, it is written by coap_enc_payload_commit().
  *
- * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the length of the
- * buffer pointed to by scratch is smaller than 2.
+ * @param[in] enc The encoder.
+ * @param[out] avail The number of bytes that can be written.
+ *
+ * @return Pointer to the next payload byte.
  */
-int coap_make_response(      coap_rw_buffer_t    *scratch,
-                             coap_packet_t       *pkt,
-                       const uint8_t             *content,
-                             size_t               content_len,
-                             uint8_t              msgid_hi,
-                             uint8_t              msgid_lo,
-                       const coap_buffer_t       *tok,
-                             coap_responsecode_t  rspcode,
-                             coap_content_type_t  content_type,
-                             bool                 confirmable);
+uint8_t *coap_enc_payload_buf(coap_encoder_t *enc,
+                              size_t         *avail);
 
 
 /**
- * Creates a response packet to a request, including a piggybacked ACK for
- * the request packet, and stores it in \p pkt.
+ * Adds \p len bytes written to the buffer returned by coap_enc_payload_buf()
+ * to the message.
+ *
+ * @param[in,out] enc The encoder.
+ * @param[in] len The number of payload bytes written.
  *
- * @param[out] scratch Buffer for the content type number.
- * @param[out] pkt Pointer to the coap_packet_t that will be filled.
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if \p len is larger
+ * than the space available.
+ */
+int coap_enc_payload_commit(coap_encoder_t *enc,
+                            size_t          len);
+
+
+/**
+ * Appends \p data to the payload of the message. May be called repeatedly.
+ *
+ * @param[in,out] enc The encoder.
+ * @param[in] data The payload data.
+ * @param[in] len Length of \p data in bytes.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the data does not fit.
+ */
+int coap_enc_payload(      coap_encoder_t *enc,
+                     const uint8_t        *data,
+                           size_t          len);
+
+
+/**
+ * Completes a response started by coap_handle_req(): sets the response
+ * code, adds the Content-Format option (unless \p content_type is
+ * COAP_CONTENTTYPE_NONE) and the payload.
+ *
+ * @param[in,out] enc The encoder passed to the handler.
+ * @param[in] rspcode The response code.
+ * @param[in] content_type The content type (i.e. what does the payload contain)
  * @param[in] content The response payload.
  * @param[in] content_len Length of \p content in bytes.
- * @param[in] msgid_hi The high byte of the message ID.
- * @param[in] msgid_lo The low byte of the message ID.
- * @param[in] tok Pointer to the token used.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the response does
+ * not fit into the buffer.
+ */
+int coap_enc_response(      coap_encoder_t      *enc,
+                            coap_responsecode_t  rspcode,
+                            coap_content_type_t  content_type,
+                      const uint8_t             *content,
+                            size_t               content_len);
+
+
+/**
+ * Turns the message started in \p enc into a request template: the header,
+ * token and options written so far are kept as a fixed prefix, followed by
+ * the payload marker. The payload of each request is then written in place
+ * behind the prefix (see coap_tpl_payload()) and coap_tpl_finish() only
+ * patches the message ID, so the prefix is encoded once instead of on
+ * every request.
+ *
+ * @param[out] tpl The template to be initialized.
+ * @param[in,out] enc Encoder holding header, token and options, no payload.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if there is no room for
+ * the payload marker, or COAP_ERR_UNSUPPORTED if \p enc contains payload.
+ */
+int coap_tpl_init(coap_template_t *tpl,
+                  coap_encoder_t  *enc);
+
+
+/**
+ * Returns where the payload of the next request goes.
+ *
+ * @param[in] tpl The template.
+ * @param[out] avail The maximum payload length in bytes.
+ *
+ * @return Pointer to the first payload byte.
+ */
+uint8_t *coap_tpl_payload(const coap_template_t *tpl,
+                          size_t                *avail);
+
+
+/**
+ * Completes the next request from \p tpl after \p payload_len bytes of
+ * payload have been written to the buffer returned by coap_tpl_payload().
+ *
+ * @param[in,out] tpl The template.
+ * @param[in] msgid The message ID of this request.
+ * @param[in] payload_len The length of the payload in bytes.
+ *
+ * @return The length of the request (starting at tpl->buf), or 0 if
+ * \p payload_len exceeds the space available.
+ */
+size_t coap_tpl_finish(coap_template_t *tpl,
+                       uint16_t         msgid,
+                       size_t           payload_len);
+
+
+/**
+ * Decodes the value of a Block1 or Block2 option.
+ *
+ * @param[in] opt The option, e.g. as found by coap_find_options().
+ * @param[out] block The decoded block number, size and more flag.
+ *
+ * @return 0 on success, or COAP_ERR_OPTION_LEN_INVALID if the option is
+ * longer than 3 bytes, or COAP_ERR_UNSUPPORTED for the reserved size
+ * exponent 7.
+ */
+int coap_block_decode(const coap_option_t *opt,
+                            coap_block_t  *block);
+
+
+/**
+ * Appends a Block1 or Block2 option to the message.
+ *
+ * @param[in,out] enc The encoder.
+ * @param[in] num COAP_OPTION_BLOCK1 or COAP_OPTION_BLOCK2.
+ * @param[in] block The block to be described.
+ *
+ * @return 0 on success, or the according coap_error_t (see coap_enc_option()).
+ */
+int coap_enc_block(      coap_encoder_t *enc,
+                         uint16_t        num,
+                   const coap_block_t   *block);
+
+
+/**
+ * Like coap_enc_response(), but sends \p content block-wise (Block2) if it
+ * is larger than a block or if the request asks for a specific block. The
+ * block size is the smallest of the one requested, COAP_BLOCK_SZX and what
+ * fits into the response buffer, so handlers may return representations
+ * larger than the buffer. A block number behind the end of \p content is
+ * answered with 4.02 Bad Option.
+ *
+ * @param[in,out] enc The encoder passed to the handler.
+ * @param[in] inpkt The request.
  * @param[in] rspcode The response code.
  * @param[in] content_type The content type (i.e. what does the payload contain)
+ * @param[in] content The complete representation.
+ * @param[in] content_len Length of \p content in bytes.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if not even the
+ * smallest block fits into the buffer.
+ */
+int coap_enc_block2_response(      coap_encoder_t      *enc,
+                             const coap_packet_t       *inpkt,
+                                   coap_responsecode_t  rspcode,
+                                   coap_content_type_t  content_type,
+                             const uint8_t             *content,
+                                   size_t               content_len);
+
+
+/**
+ * Prepares the block-wise upload (Block1) of \p body. Each block is sent as
+ * a copy of the prefix of \p tpl with a Block1 option added, so the body
+ * may be composed in the payload area of \p tpl. The blocks have the type
+ * of \p tpl, set tx->con afterwards to send them confirmable anyway.
+ *
+ * @param[out] tx The upload state.
+ * @param[in] tpl The request template, must not contain options with a
+ * number larger than COAP_OPTION_BLOCK1.
+ * @param[in] body The request body.
+ * @param[in] len Length of \p body in bytes.
+ * @param[in] szx The block size exponent.
+ */
+void coap_block1_init(      coap_block1_tx_t *tx,
+                      const coap_template_t  *tpl,
+                      const uint8_t          *body,
+                            size_t            len,
+                            uint8_t           szx);
+
+
+/**
+ * Builds the request carrying block \p num of the upload, e.g. to send a
+ * lost block again.
+ *
+ * @param[in] tx The upload state.
+ * @param[in] num The block number.
+ * @param[out] buf Byte buffer the request is written to, must not be the
+ * buffer of the template.
+ * @param[in] buflen The size of \p buf in bytes.
+ * @param[in] msgid The message ID of this request.
+ *
+ * A No-Response option of the template is left out, the peer has to answer
+ * every block but the last one with 2.31 Continue.
+ *
+ * @return The length of the request, or 0 if \p num is behind the end of
+ * the body or the request does not fit into \p buf.
+ */
+size_t coap_block1_build(const coap_block1_tx_t *tx,
+                               uint32_t          num,
+                               uint8_t          *buf,
+                               size_t            buflen,
+                               uint16_t          msgid);
+
+
+/**
+ * Builds the request carrying the next block of the upload and advances
+ * \p tx. Call repeatedly until it returns 0 to stream the complete body.
+ *
+ * @see coap_block1_build()
+ */
+size_t coap_block1_next(coap_block1_tx_t *tx,
+                        uint8_t          *buf,
+                        size_t            buflen,
+                        uint16_t          msgid);
+
+
+/**
+ * Seeds the message ID and token generators. RFC 7252 wants the first
+ * message ID after a reboot to be unpredictable, so use something that
+ * differs per node and boot, e.g. the hardware address mixed with a
+ * counter or random number.
+ *
+ * @param[in] seed The seed.
+ */
+void coap_seed(uint32_t seed);
+
+
+/**
+ * Returns the message ID for the next message this node originates.
+ *
+ * @return The message ID.
+ */
+uint16_t coap_mid_next(void);
+
+
+/**
+ * Fills \p tok with a fresh token.
+ *
+ * @param[out] tok The token bytes.
+ * @param[in] len The token length, up to 8.
+ */
+void coap_token_next(uint8_t *tok,
+                     size_t   len);
+
+
+/**
+ * Checks if \p pkt is a repetition of a request already received from
+ * \p peer, i.e. one with the same message ID within COAP_EXCHANGE_LIFETIME,
+ * and remembers it otherwise. Duplicates must not reach coap_handle_req(),
+ * so link layer or CoAP retransmissions do not run the handler twice; a
+ * duplicate confirmable request is answered with coap_dedup_reply()
+ * instead. ACK and Reset messages are never reported as duplicates.
+ *
+ * @param[in] peer The sender of \p pkt.
+ * @param[in] pkt The received message.
+ * @param[in] now The current time in ms.
  *
- * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the length of the
- * buffer pointed to by \p scratch is smaller than 2.
+ * @return true if \p pkt is a duplicate.
  */
-int coap_make_pb_response(      coap_rw_buffer_t    *scratch,
-                                coap_packet_t       *pkt,
-                          const uint8_t             *content,
-                                size_t               content_len,
-                                uint8_t              msgid_hi,
-                                uint8_t              msgid_lo,
-                          const coap_buffer_t       *tok,
-                                coap_responsecode_t  rspcode,
-                                coap_content_type_t  content_type);
+bool coap_is_duplicate(const coap_peer_t   *peer,
+                       const coap_packet_t *pkt,
+                             uint32_t       now);
 
 
 /**
-  * Handles the request in \p inpkt, and creates a response packet which is
-  * stored in \p outpkt. If \p pb is true, the response will contain a
-  * piggybacked ACK. If \p con is true, the response will be marked as a
-  * confirmable packet.
+ * Remembers the response to \p pkt, so a duplicate of it can be answered
+ * again by coap_dedup_reply(). Only piggybacked responses (ACKs) of up to
+ * COAP_DEDUP_RSP_SIZE bytes are kept.
+ *
+ * @param[in] peer The sender of \p pkt.
+ * @param[in] pkt The request, as passed to coap_is_duplicate() before.
+ * @param[in] rsp The response sent.
+ * @param[in] rsplen The length of \p rsp, 0 if none was sent.
+ */
+void coap_dedup_store(const coap_peer_t   *peer,
+                      const coap_packet_t *pkt,
+                      const uint8_t       *rsp,
+                            size_t         rsplen);
+
+
+/**
+ * Builds the reply to a duplicate request (RFC 7252, section 4.5): a
+ * duplicate confirmable request gets the response kept by
+ * coap_dedup_store() again, or an empty ACK if none was kept. Duplicate
+ * non-confirmable requests are not answered.
+ *
+ * @param[in] peer The sender of \p pkt.
+ * @param[in] pkt The duplicate request.
+ * @param[out] buf The reply.
+ * @param[in] buflen The size of \p buf.
+ *
+ * @return The length of the reply, 0 if nothing is to be sent.
+ */
+size_t coap_dedup_reply(const coap_peer_t   *peer,
+                        const coap_packet_t *pkt,
+                              uint8_t       *buf,
+                              size_t         buflen);
+
+
+/**
+ * Builds the routing trie used by coap_handle_req() from the endpoints
+ * array. Each distinct path segment becomes one node of the trie, its length
+ * is computed once here, so dispatching a request takes one pass over its
+ * Uri-Path options. Call this once before the first request is handled,
+ * and before other threads use the library;
+ * coap_handle_req() calls it itself (under the lock) if this has not
+ * happened yet.
+ *
+ * The link-format listing served at /.well-known/core is built here as well,
+ * one link per path carrying the core_attr of its first endpoint, so
+ * discovery requests only copy it out (block-wise if it is larger than a
+ * block).
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if the endpoints have
+ * more distinct path segments than COAP_ROUTE_NODES can hold or the
+ * listing is longer than COAP_CORE_SIZE (it then ends after the last link
+ * that fit), or
+ * COAP_ERR_UNSUPPORTED if an endpoint path has more than MAX_SEGMENTS
+ * segments or a segment longer than 255 bytes.
+ */
+int coap_init(void);
+
+
+/**
+  * Handles the request in \p inpkt and writes the response directly to
+  * \p buf. If \p pb is true, the response will contain a piggybacked ACK.
+  * If \p con is true, the response will be marked as confirmable packet.
+  *
+  * A GET with an Observe option of 0 on an endpoint whose core_attr contains
+  * 'obs' registers \p peer as observer of that resource (see coap_notify()),
+  * an Observe option of 1 or a Reset message matching a notification ends
+  * the registration. ACK and Reset messages complete the matching
+  * confirmable message sent by coap_con_send() and get no response.
+  * Responses of a class the request's No-Response option rules out are
+  * dropped (buflen 0), a piggybacked one shrinks to an empty ACK.
   *
-  * @param[out] scratch Buffer for the content type number.
+  * A 2.05 response to a GET gets an ETag, a hash of its payload, unless the
+  * handler set one itself or the response is a single block. A request that
+  * names that ETag gets a 2.03 Valid instead, carrying nothing but ETag,
+  * Observe and Max-Age.
+  *
+  * @param[in] peer The sender of the request, may be NULL if the request
+  * should not be able to register an observer.
   * @param[in] inpkt Pointer to the coap_packet_t structure containing the
   * request.
-  * @param[out] outpkt Pointer to the coap_packet_t structure that will be
-  * filled, then containing the response.
+  * @param[out] buf Byte buffer the response is written to. Must not overlap
+  * with the buffer \p inpkt was parsed from.
+  * @param[in,out] buflen Contains the size of \p buf, then stores the length
+  * of the response, 0 if there is none.
   * @param[in] pb If true, the response will contain a piggybacked ACK for the
   * request packet.
   * @param[in] con If true, the response packet will marked as confirmable;
@@ -411,11 +1181,253 @@ int coap_make_pb_response(      coap_rw_buffer_t    *scratch,
   * @return The return code of the corresponding handler function, or 0 if
   * no corresponding handler exists.
   */
-int coap_handle_req(      coap_rw_buffer_t *scratch,
-                    const coap_packet_t    *inpkt,
-                          coap_packet_t    *outpkt,
-                          bool              pb,
-                          bool              con);
+int coap_handle_req(const coap_peer_t   *peer,
+                    const coap_packet_t *inpkt,
+                          uint8_t       *buf,
+                          size_t        *buflen,
+                          bool           pb,
+                          bool           con);
+
+
+/**
+ * Takes a request context from the pool.
+ *
+ * @return The context, or NULL if all COAP_CTX_NUMOF contexts are taken.
+ */
+coap_ctx_t *coap_ctx_acquire(void);
+
+
+/**
+ * Returns \p ctx to the pool.
+ *
+ * @param[in] ctx The context.
+ */
+void coap_ctx_release(coap_ctx_t *ctx);
+
+
+/**
+ * Parses the ctx->rxlen bytes in ctx->rx received from ctx->peer, answers
+ * duplicates with coap_dedup_reply() and handles the request like
+ * coap_handle_req(), with the response written to ctx->tx. The handler
+ * finds the context in the ctx member of its encoder, e.g. to use the
+ * scratch space. Only \p ctx and the locked shared state are touched, so
+ * each thread may handle requests on its own context concurrently.
+ *
+ * @param[in,out] ctx The request context, ctx->txlen is set to the length of
+ * the response, 0 if nothing is to be sent.
+ * @param[in] now The current time in ms.
+ * @param[in] pb If true, the response will contain a piggybacked ACK.
+ * @param[in] con If true, the response packet will marked as confirmable.
+ *
+ * @return 0 on success, the coap_error_t if the request could not be
+ * parsed, or the return code of the handler.
+ */
+int coap_ctx_handle(coap_ctx_t *ctx,
+                    uint32_t    now,
+                    bool        pb,
+                    bool        con);
+
+
+/**
+ * Sends a notification to every observer of the resource at \p path. The
+ * GET handler of the resource is called once per observer to encode the
+ * current representation, the library adds token and the Observe sequence
+ * number. A notification with a response code other than 2.xx ends the
+ * registration.
+ *
+ * Notifications are non-confirmable, except every COAP_OBS_CON_EVERY-th
+ * one to an observer: it is copied to the registration and sent with
+ * coap_con_send(), so coap_con_tick() has to run afterwards. An observer
+ * that rejects it or never acknowledges it is removed (RFC 7641, section
+ * 4.5).
+ *
+ * @param[in] path The path of the resource that changed, the same pointer
+ * as used in the endpoints array.
+ * @param[out] buf Byte buffer the notifications are encoded in.
+ * @param[in] buflen The size of \p buf in bytes.
+ * @param[in] now The current time in ms.
+ * @param[in] send Function used to send the notifications.
+ *
+ * @return The number of notifications sent.
+ */
+int coap_notify(const coap_endpoint_path_t *path,
+                      uint8_t              *buf,
+                      size_t                buflen,
+                      uint32_t              now,
+                      coap_send_func        send);
+
+
+/**
+ * Defers the response to \p inpkt, for handlers that can not answer right
+ * away, e.g. because a sensor read takes long. Called from the handler with
+ * the \p rsp it was given: the request is parked in the pending table and
+ * \p rsp is turned into an empty ACK (confirmable requests) or into no
+ * response at all (others). The handler then returns 0, and whichever
+ * thread gets the data answers later using coap_separate_init() and
+ * coap_separate_send().
+ *
+ * @param[in] inpkt The request passed to the handler.
+ * @param[in,out] rsp The response passed to the handler.
+ * @param[out] id Identifies the request in coap_separate_init().
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if COAP_SEP_MAX
+ * requests are waiting already, or COAP_ERR_UNSUPPORTED if the sender of
+ * the request is not known (see coap_handle_req()).
+ */
+int coap_defer(const coap_packet_t  *inpkt,
+                     coap_encoder_t *rsp,
+                     int            *id);
+
+
+/**
+ * Starts the separate response to the deferred request \p id and removes it
+ * from the pending table. Header and token are written to \p enc, the
+ * caller adds code, options and payload, e.g. using coap_enc_response().
+ * The response is confirmable if the request was.
+ *
+ * @param[out] enc The encoder to be initialized.
+ * @param[in] id The request, as returned by coap_defer().
+ * @param[out] buf Byte buffer the response is written to.
+ * @param[in] buflen The size of \p buf in bytes.
+ * @param[out] peer The sender of the request, i.e. where the response goes.
+ *
+ * @return 0 on success, or COAP_ERR_UNSUPPORTED if \p id is not waiting
+ * for a response, or the error of coap_enc_init().
+ */
+int coap_separate_init(coap_encoder_t *enc,
+                       int             id,
+                       uint8_t        *buf,
+                       size_t          buflen,
+                       coap_peer_t    *peer);
+
+
+/**
+ * Sends a separate response started with coap_separate_init(). A
+ * confirmable one goes through coap_con_send(), so the buffer of \p enc
+ * must stay untouched until the peer acknowledged it.
+ *
+ * @param[in] peer The destination, as returned by coap_separate_init().
+ * @param[in] enc The complete response.
+ * @param[in] now The current time in ms.
+ * @param[in] send Function used to send the response.
+ *
+ * @return 0 on success, or the error of \p send or coap_con_send().
+ */
+int coap_separate_send(const coap_peer_t    *peer,
+                       const coap_encoder_t *enc,
+                             uint32_t        now,
+                             coap_send_func  send);
+
+
+/**
+ * Sends the confirmable message in \p buf to \p peer and keeps it in the
+ * transmission table until it is acknowledged. Retransmissions are done by
+ * coap_con_tick(), ACKs are matched by coap_handle_req(), so the message
+ * should be sent from the server port.
+ *
+ * The message is not copied, \p buf must stay untouched until \p cb is
+ * called or the transmission is cancelled.
+ *
+ * @param[in] peer The destination.
+ * @param[in] buf The encoded message, its type must be COAP_TYPE_CON.
+ * @param[in] len The length of the message in bytes.
+ * @param[in] now The current time in ms.
+ * @param[in] send Function used to send the message and its repetitions.
+ * @param[in] cb Called when the transmission is complete, may be NULL.
+ * @param[in] arg Passed to \p cb.
+ *
+ * @return 0 on success, or COAP_ERR_BUFFER_TOO_SMALL if COAP_CON_MAX
+ * messages are in flight already, or COAP_ERR_UNSUPPORTED if \p buf is not a
+ * confirmable message.
+ */
+int coap_con_send(const coap_peer_t    *peer,
+                  const uint8_t        *buf,
+                        size_t          len,
+                        uint32_t        now,
+                        coap_send_func  send,
+                        coap_con_func   cb,
+                        void           *arg);
+
+
+/**
+ * Retransmits all messages whose timeout expired, doubling their timeout,
+ * and completes those that ran out of retransmissions. One timer is enough
+ * to drive all transmissions: call this whenever it fires and re-arm it
+ * with the returned delay.
+ *
+ * @param[in] now The current time in ms.
+ *
+ * @return The time in ms until this should be called again, or 0 if no
+ * message is in flight.
+ */
+uint32_t coap_con_tick(uint32_t now);
+
+
+/**
+ * Removes the message with ID \p msgid from the transmission table without
+ * calling its callback, e.g. because a newer message supersedes it.
+ *
+ * @param[in] msgid The message ID.
+ */
+void coap_con_cancel(uint16_t msgid);
+
+
+/**
+ * Sends the request in \p buf to \p peer and waits for its response,
+ * which is matched by token: the token bytes in \p buf are overwritten with
+ * a fresh token, so the request must be encoded with a token of the wanted
+ * length (any value). A confirmable request goes through coap_con_send(),
+ * \p buf must then stay untouched until \p cb is called. Responses and
+ * Resets are matched by coap_handle_req() and coap_ctx_handle(), so the
+ * request should be sent from the server port; confirmable separate
+ * responses are acknowledged there.
+ *
+ * Note that a peer honouring a No-Response option never sends the response
+ * waited for, so such requests end in a timeout.
+ *
+ * @param[in] peer The destination.
+ * @param[in,out] buf The encoded request, gets a new token.
+ * @param[in] len The length of the request in bytes.
+ * @param[in] now The current time in ms.
+ * @param[in] timeout Time in ms after which the request is given up.
+ * @param[in] send Function used to send the request and its repetitions.
+ * @param[in] cb Called with the response or error.
+ * @param[in] arg Passed to \p cb.
+ *
+ * @return 0 on success, COAP_ERR_BUFFER_TOO_SMALL if COAP_REQ_MAX requests
+ * are waiting already, COAP_ERR_UNSUPPORTED if \p buf has no token, or the
+ * error of \p send or coap_con_send().
+ */
+int coap_req_send(const coap_peer_t    *peer,
+                        uint8_t        *buf,
+                        size_t          len,
+                        uint32_t        now,
+                        uint32_t        timeout,
+                        coap_send_func  send,
+                        coap_resp_func  cb,
+                        void           *arg);
+
+
+/**
+ * Completes the requests whose timeout expired with COAP_ERR_TIMEOUT and
+ * stops their retransmissions. Like coap_con_tick(), call this whenever
+ * the timer fires and re-arm it with the returned delay.
+ *
+ * @param[in] now The current time in ms.
+ *
+ * @return The time in ms until this should be called again, or 0 if no
+ * request is waiting.
+ */
+uint32_t coap_req_tick(uint32_t now);
+
+
+/**
+ * Gives up the request with message ID \p msgid without calling its
+ * callback, and stops its retransmissions.
+ *
+ * @param[in] msgid The message ID.
+ */
+void coap_req_cancel(uint16_t msgid);
 
 
 #ifdef __cplusplus
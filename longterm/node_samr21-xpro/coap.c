@@ -16,6 +16,327 @@ extern const coap_endpoint_t endpoints[];
 extern coap_endpoint_t *endpoints;
 #endif
 
+// the application provides the lock if it uses microcoap from several threads
+#ifdef COAP_WITH_LOCK
+#define COAP_LOCK()   coap_lock()
+#define COAP_UNLOCK() coap_unlock()
+#else
+#define COAP_LOCK()
+#define COAP_UNLOCK()
+#endif
+
+// counting compiles to nothing without COAP_WITH_STATS
+#ifdef COAP_WITH_STATS
+#define COAP_STAT(x)      do { x; } while (0)
+#define COAP_STAT_ERR(rc) coap_stats_err(rc)
+#else
+#define COAP_STAT(x)
+#define COAP_STAT_ERR(rc) (rc)
+#endif
+
+
+// one node of the routing trie, node 0 is the root (i.e. the empty path)
+typedef struct
+{
+        const char    *seg;       // path segment leading to this node
+              uint8_t  len;       // length of seg
+              uint8_t  child;     // index of the first child, 0 if none
+              uint8_t  sibling;   // index of the next sibling, 0 if none
+              uint8_t  ep[4];     // index + 1 into endpoints per method, 0 if none
+} coap_route_t;
+
+static coap_route_t routes[COAP_ROUTE_NODES];
+static uint8_t      routes_used;
+
+
+// one registration of an observer, ep is NULL for unused entries
+typedef struct
+{
+              coap_peer_t      peer;       // who to notify
+        const coap_endpoint_t *ep;         // GET endpoint of the observed resource
+              uint32_t         seq;        // sequence number of the next notification (24 bit)
+              uint16_t         mid;        // message ID of the last notification, to match Reset
+              uint8_t          token[8];   // token of the registration
+              uint8_t          tkllen;     // length of token
+              uint8_t          nons;       // non-confirmable notifications since the last confirmable one
+              bool             con;        // a confirmable notification in conbuf is in flight
+              uint8_t          conbuf[COAP_OBS_CON_SIZE];   // the confirmable notification
+} coap_observer_t;
+
+static coap_observer_t observers[COAP_OBS_MAX];
+
+
+// one confirmable message in flight, buf is NULL for unused entries
+typedef struct
+{
+              coap_peer_t     peer;       // destination
+        const uint8_t        *buf;        // the message, owned by the caller
+              size_t          len;        // length of buf
+              coap_send_func  send;       // used for retransmissions
+              coap_con_func   cb;         // completion callback
+              void           *arg;        // argument of cb
+              uint32_t        due;        // time of the next retransmission in ms
+              uint32_t        timeout;    // current timeout in ms, doubled on every retransmission
+              uint16_t        mid;        // message ID, ACKs are matched against it
+              uint8_t         retries;    // retransmissions done so far
+} coap_con_t;
+
+static coap_con_t cons[COAP_CON_MAX];
+
+
+// one received message, for duplicate detection
+typedef struct
+{
+        coap_peer_t peer;                        // sender
+        uint32_t    expire;                      // end of the exchange lifetime in ms
+        uint16_t    mid;                         // message ID
+        uint8_t     rsplen;                      // length of rsp, 0 if none is kept
+        uint8_t     rsp[COAP_DEDUP_RSP_SIZE];    // piggybacked response
+} coap_dedup_t;
+
+static coap_dedup_t dedup[COAP_DEDUP_SIZE];
+
+
+// one request waiting for its separate response
+typedef struct
+{
+        coap_peer_t peer;       // sender of the request
+        uint8_t     token[8];   // token of the request
+        uint8_t     tkllen;     // length of token
+        bool        con;        // the request was confirmable
+        bool        used;       // false for unused entries
+} coap_sep_t;
+
+static coap_sep_t seps[COAP_SEP_MAX];
+
+
+// one request of ours waiting for its response, cb is NULL for unused entries
+typedef struct
+{
+        coap_peer_t     peer;       // destination
+        coap_resp_func  cb;         // called with the response
+        void           *arg;        // argument of cb
+        uint32_t        sent;       // time the request was sent in ms
+        uint32_t        due;        // time the request times out in ms
+        uint16_t        mid;        // message ID, a Reset is matched against it
+        uint8_t         token[8];   // token, responses are matched against it
+        uint8_t         tkllen;     // length of token
+        bool            con;        // sent as confirmable message
+} coap_req_t;
+
+static coap_req_t reqs[COAP_REQ_MAX];
+
+
+// message ID counter and xorshift state of the token generator
+static uint16_t next_mid;
+static uint32_t token_state = 0x2545F491;
+
+static coap_ctx_t ctx_pool[COAP_CTX_NUMOF];
+
+
+#ifdef COAP_WITH_STATS
+static coap_stats_t stats;
+
+static const coap_endpoint_path_t path_stats = { 2, { ".well-known", "stats" } };
+
+
+static int coap_stats_err(int rc)
+{
+        if ((rc > 0) && (rc < (int)(sizeof(stats.errors) / sizeof(stats.errors[0])))) {
+                stats.errors[rc]++;
+        }
+
+        return rc;
+}
+
+
+static void coap_stats_time(int ep, uint32_t usec)
+{
+        int b = 0;
+
+        while ((b < COAP_STATS_BUCKETS - 1) && (usec >= (64UL << (2 * b)))) {
+                b++;
+        }
+
+        stats.hits[ep]++;
+
+        // the buckets stay at their maximum instead of wrapping around
+        if (stats.time[ep][b] < UINT16_MAX) {
+                stats.time[ep][b]++;
+        }
+}
+
+
+// appends the head of a CBOR data item (major type and argument) to buf,
+// returns false if it does not fit
+static bool coap_cbor_head(uint8_t *buf, size_t len, size_t *pos, uint8_t major, uint32_t val)
+{
+        uint8_t ai = (val < 24) ? val : ((val <= 0xFF) ? 24 : ((val <= 0xFFFF) ? 25 : 26));
+        size_t  n  = (ai < 24) ? 0 : ((size_t)1 << (ai - 24));
+
+        if (*pos + 1 + n > len) {
+                return false;
+        }
+
+        buf[(*pos)++] = (major << 5) | ai;
+
+        while (n-- > 0) {
+                buf[(*pos)++] = (0xFF & (val >> (8 * n)));
+        }
+
+        return true;
+}
+
+
+// largest GET /.well-known/stats payload: a uint32_t takes up to 5 byte in
+// CBOR, a uint16_t 3 byte and the head of each array up to 3 byte
+#define COAP_STATS_SIZE (3 + 6 * 5 + 3 + COAP_ERR_TOO_MANY_OPTIONS * 5 + \
+                         3 + COAP_STATS_EP_MAX * (3 + 5 + COAP_STATS_BUCKETS * 3))
+
+
+// GET /.well-known/stats, the layout is documented at coap_stats_t
+static int coap_stats_handler(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+        const uint32_t counters[] = { stats.rx_pkts, stats.rx_bytes, stats.tx_pkts,
+                                      stats.tx_bytes, stats.unmatched, stats.failed };
+        const size_t   numerr     = sizeof(stats.errors) / sizeof(stats.errors[0]);
+              uint8_t  buf[COAP_STATS_SIZE];
+              size_t   pos = 0;
+              bool     ok;
+              int      numep;
+              size_t   i, j;
+
+        for (numep = 0; (numep < COAP_STATS_EP_MAX) && (endpoints[numep].handler != NULL); numep++) {
+                // count the endpoints with own counters
+        }
+
+        ok = coap_cbor_head(buf, sizeof(buf), &pos, 4, 8);
+
+        for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+                ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 0, counters[i]);
+        }
+
+        // errors start at 1, COAP_ERR_NONE is never counted
+        ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 4, numerr - 1);
+
+        for (i = 1; i < numerr; i++) {
+                ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 0, stats.errors[i]);
+        }
+
+        ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 4, numep);
+
+        for (i = 0; i < (size_t)numep; i++) {
+                ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 4, 1 + COAP_STATS_BUCKETS);
+                ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 0, stats.hits[i]);
+
+                for (j = 0; j < COAP_STATS_BUCKETS; j++) {
+                        ok = ok && coap_cbor_head(buf, sizeof(buf), &pos, 0, stats.time[i][j]);
+                }
+        }
+
+        if (!ok) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        return coap_enc_block2_response(rsp, inpkt, COAP_RSPCODE_CONTENT,
+                                        COAP_CONTENTTYPE_APPLICATION_CBOR, buf, pos);
+}
+
+
+const coap_stats_t *coap_stats(void)
+{
+        return &stats;
+}
+#endif
+
+
+// link-format listing of all resources, built once by coap_init()
+static char   core_buf[COAP_CORE_SIZE];
+static size_t core_len;
+
+static const coap_endpoint_path_t path_core = { 2, { ".well-known", "core" } };
+
+
+static int coap_core_handler(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+        return coap_enc_block2_response(rsp, inpkt, COAP_RSPCODE_CONTENT,
+                                        COAP_CONTENTTYPE_APPLICATION_LINKFORMAT,
+                                        (const uint8_t *)core_buf, core_len);
+}
+
+
+// resources of the library itself, endpoints with the same path win
+static const coap_endpoint_t builtins[] =
+{
+        { COAP_METHOD_GET, coap_core_handler, &path_core, "ct=40" },
+#ifdef COAP_WITH_STATS
+        { COAP_METHOD_GET, coap_stats_handler, &path_stats, "ct=60" },
+#endif
+};
+
+#define COAP_BUILTINS_NUMOF (sizeof(builtins) / sizeof(builtins[0]))
+
+
+// true if the Uri-Path options opt spell path
+static bool coap_path_match(const coap_option_t *opt, uint8_t count, const coap_endpoint_path_t *path)
+{
+        int i;
+
+        if ((opt == NULL) || (count != path->count)) {
+                return false;
+        }
+
+        for (i = 0; i < count; i++) {
+                if ((opt[i].val.len != strlen(path->elems[i]))
+                    || (memcmp(opt[i].val.p, path->elems[i], opt[i].val.len) != 0)) {
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+
+// appends s to the listing at *len, returns false if it does not fit
+static bool coap_core_put(size_t *len, const char *s)
+{
+        size_t n = strlen(s);
+
+        if (*len + n > sizeof(core_buf)) {
+                return false;
+        }
+
+        memcpy(core_buf + *len, s, n);
+        *len += n;
+
+        return true;
+}
+
+
+// appends the link of ep to the listing, returns false if it does not fit
+static bool coap_core_add(const coap_endpoint_t *ep)
+{
+        size_t len = core_len;
+        bool   ok  = coap_core_put(&len, (len > 0) ? ",<" : "<");
+        int    i;
+
+        for (i = 0; i < ep->path->count; i++) {
+                ok = ok && coap_core_put(&len, "/") && coap_core_put(&len, ep->path->elems[i]);
+        }
+
+        ok = ok && coap_core_put(&len, ">");
+
+        if ((ep->core_attr != NULL) && (ep->core_attr[0] != '\0')) {
+                ok = ok && coap_core_put(&len, ";") && coap_core_put(&len, ep->core_attr);
+        }
+
+        if (ok) {
+                core_len = len;
+        }
+
+        return ok;
+}
+
 
 #ifdef DEBUG
 void coap_dump_header(coap_header_t *header)
@@ -235,6 +556,11 @@ static int coap_parseOptionsAndPayload(coap_option_t *options, uint8_t *numOptio
                 optionIndex++;
         }
 
+        // more options than fit, rather than losing them and the payload
+        if ((p < end) && (*p != 0xFF)) {
+                return COAP_ERR_TOO_MANY_OPTIONS;
+        }
+
         *numOptions = optionIndex;
 
         if (p + 1 < end && *p == 0xFF) { // payload marker
@@ -250,160 +576,451 @@ static int coap_parseOptionsAndPayload(coap_option_t *options, uint8_t *numOptio
 }
 
 
-int coap_parse(coap_packet_t *pkt, const uint8_t *buf, size_t buflen)
+#ifdef COAP_WITH_TRUSTED_PARSE
+// byte i of the header loaded as one word
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#define COAP_HDR_BYTE(w, i) (0xFF & ((w) >> (24 - 8 * (i))))
+#else
+#define COAP_HDR_BYTE(w, i) (0xFF & ((w) >> (8 * (i))))
+#endif
+
+
+// the variants below are for packets of a trusted source only: they skip
+// every check a well-formed packet passes anyway, i.e. the version, the
+// token length and whether an option fits into the packet
+static void coap_parseHeaderTrusted(coap_header_t *hdr, const uint8_t *buf)
 {
-        int rc;
+        uint32_t w;
 
-        // coap_dump(buf, buflen, false);
+        memcpy(&w, buf, sizeof(w));   // one load, buf need not be aligned
 
-        if (0 != (rc = coap_parseHeader(&pkt->header, buf, buflen))) {
-                return rc;
-        }
+        hdr->version = COAP_HDR_BYTE(w, 0) >> 6;
+        hdr->type    = (COAP_HDR_BYTE(w, 0) >> 4) & 0x03;
+        hdr->tkllen  = COAP_HDR_BYTE(w, 0) & 0x0F;
+        hdr->code    = COAP_HDR_BYTE(w, 1);
+        hdr->mid[0]  = COAP_HDR_BYTE(w, 2);
+        hdr->mid[1]  = COAP_HDR_BYTE(w, 3);
+}
 
-        //    coap_dumpHeader(&hdr);
-        if (0 != (rc = coap_parseToken(&pkt->token, &pkt->header, buf, buflen))) {
-                return rc;
-        }
 
-        pkt->numopts = MAXOPT;
+// advances p
+static void coap_parseOptionTrusted(coap_option_t *option, uint16_t *running_delta, const uint8_t **buf)
+{
+        const uint8_t  *p     = *buf;
+              uint16_t  delta = p[0] >> 4;
+              uint16_t  len   = p[0] & 0x0F;
 
-        if (0 != (rc = coap_parseOptionsAndPayload(pkt->opts, &(pkt->numopts),
-                                                   &(pkt->payload), &pkt->header, buf, buflen))) {
-                return rc;
+        p++;
+
+        if (delta == 13) {
+                delta = p[0] + 13;
+                p++;
+        }
+        else if (delta == 14) {
+                delta = ((p[0] << 8) | p[1]) + 269;
+                p += 2;
         }
 
-        //    coap_dumpOptions(opts, numopt);
-        return 0;
+        if (len == 13) {
+                len = p[0] + 13;
+                p++;
+        }
+        else if (len == 14) {
+                len = ((p[0] << 8) | p[1]) + 269;
+                p += 2;
+        }
+
+        *running_delta  += delta;
+        option->num      = *running_delta;
+        option->val.p    = p;
+        option->val.len  = len;
+
+        *buf = p + len;
 }
 
 
-// options are always stored consecutively, so can return a block with same option num
-const coap_option_t *coap_find_options(const coap_packet_t *pkt, uint8_t num, uint8_t *count)
+static int coap_parseOptionsAndPayloadTrusted(coap_option_t *options, uint8_t *numOptions, coap_buffer_t *payload,
+                                              const coap_header_t *hdr, const uint8_t *buf, size_t buflen)
 {
-        // FIXME, options is always sorted, can find faster than this
-        size_t i;
-        const coap_option_t *first = NULL;
-        *count = 0;
-
-        for (i = 0; i < pkt->numopts; i++) {
-                if (pkt->opts[i].num == num) {
-                        if (NULL == first) {
-                                first = &pkt->opts[i];
-                        }
+        const uint8_t  *p           = buf + 4 + hdr->tkllen;
+        const uint8_t  *end         = buf + buflen;
+              uint8_t   optionIndex = 0;
+              uint16_t  delta       = 0;
 
-                        (*count)++;
-                }
-                else {
-                        if (NULL != first) {
-                                break;
-                        }
-                }
+        while ((optionIndex < *numOptions) && (p < end) && (*p != 0xFF)) {
+                coap_parseOptionTrusted(&options[optionIndex++], &delta, &p);
         }
 
-        return first;
-}
+        // the number of options is not up to the sender, the table is ours
+        if ((p < end) && (*p != 0xFF)) {
+                return COAP_ERR_TOO_MANY_OPTIONS;
+        }
 
+        *numOptions = optionIndex;
 
-int coap_buffer_to_string(char *strbuf, size_t strbuflen, const coap_buffer_t *buf)
-{
-        if (buf->len + 1 > strbuflen) {
-                return COAP_ERR_BUFFER_TOO_SMALL;
+        if (p + 1 < end && *p == 0xFF) {   // payload marker
+                payload->p   = p + 1;
+                payload->len = end - (p + 1);
+        }
+        else {
+                payload->p   = NULL;
+                payload->len = 0;
         }
 
-        memcpy(strbuf, buf->p, buf->len);
-        strbuf[buf->len] = 0;
         return 0;
 }
+#endif
 
 
-static void coap_option_nibble(uint32_t value, uint8_t *nibble)
+// slot of num in coap_optidx_t, or -1 if the option is not indexed
+static int coap_optidx_slot(uint16_t num)
 {
-        if (value < 13) {
-                *nibble = (0xFF & value);
-        }
-        else if (value <= 0xFF + 13) {
-                *nibble = 13;
-        }
-        else if (value <= 0xFFFF + 269) {
-                *nibble = 14;
+        switch (num) {
+                case COAP_OPTION_OBSERVE:        return 0;
+                case COAP_OPTION_URI_PATH:       return 1;
+                case COAP_OPTION_CONTENT_FORMAT: return 2;
+                case COAP_OPTION_URI_QUERY:      return 3;
+                case COAP_OPTION_BLOCK2:         return 4;
+                case COAP_OPTION_BLOCK1:         return 5;
+                default:                         return -1;
         }
 }
 
 
-int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt)
+void coap_optidx_build(coap_optidx_t *idx, const coap_packet_t *pkt)
 {
-        size_t    opts_len      = 0;
-        size_t    i;
-        uint8_t  *p;
-        uint16_t  running_delta = 0;
+        uint8_t i;
+        int     slot;
 
-        // build header
-        if (*buflen < (4U + pkt->header.tkllen)) {
-                return COAP_ERR_BUFFER_TOO_SMALL;
+        memset(idx, 0, sizeof(*idx));
+
+        for (i = 0; i < pkt->numopts; i++) {
+                if (pkt->opts[i].num < 32) {
+                        idx->present |= (1UL << pkt->opts[i].num);
+                }
+
+                if ((slot = coap_optidx_slot(pkt->opts[i].num)) >= 0) {
+                        // options are sorted, so the first one seen is the first instance
+                        if (idx->count[slot]++ == 0) {
+                                idx->first[slot] = i;
+                        }
+                }
         }
+}
 
-        buf[0] = (pkt->header.version & 0x03) << 6;
-        buf[0] |= (pkt->header.type & 0x03) << 4;
-        buf[0] |= (pkt->header.tkllen & 0x0F);
-        buf[1] = pkt->header.code;
-        buf[2] = pkt->header.mid[0];
-        buf[3] = pkt->header.mid[1];
 
-        // inject token
-        p = buf + 4;
+const coap_option_t *coap_optidx_find(const coap_optidx_t *idx, const coap_packet_t *pkt,
+                                      uint16_t num, uint8_t *count)
+{
+        int slot;
 
-        if ((pkt->header.tkllen > 0) && (pkt->header.tkllen != pkt->token.len)) {
-                return COAP_ERR_UNSUPPORTED;
+        if ((num < 32) && !(idx->present & (1UL << num))) {
+                *count = 0;
+                return NULL;
         }
 
-        if (pkt->header.tkllen > 0) {
-                memcpy(p, pkt->token.p, pkt->header.tkllen);
+        if ((slot = coap_optidx_slot(num)) >= 0) {
+                *count = idx->count[slot];
+                return &pkt->opts[idx->first[slot]];
         }
 
-        // inject options
-        p += pkt->header.tkllen;
+        return coap_find_options(pkt, num, count);
+}
 
-        for (i = 0; i < pkt->numopts; i++) {
-                uint32_t optDelta;
-                uint8_t  len = 0;
-                uint8_t  delta = 0;
 
-                if (((size_t)(p - buf)) > *buflen) {
-                        return COAP_ERR_BUFFER_TOO_SMALL;
-                }
+int coap_parse(coap_packet_t *pkt, const uint8_t *buf, size_t buflen)
+{
+        int rc;
 
-                optDelta = pkt->opts[i].num - running_delta;
-                coap_option_nibble(optDelta, &delta);
-                coap_option_nibble((uint32_t)pkt->opts[i].val.len, &len);
+        // coap_dump(buf, buflen, false);
 
-                *p++ = (0xFF & (delta << 4 | len));
+        if (0 != (rc = coap_parseHeader(&pkt->header, buf, buflen))) {
+                return COAP_STAT_ERR(rc);
+        }
 
-                if (delta == 13) {
-                        *p++ = (optDelta - 13);
-                }
-                else if (delta == 14) {
-                        *p++ = ((optDelta - 269) >> 8);
-                        *p++ = (0xFF & (optDelta - 269));
-                }
+        //    coap_dumpHeader(&hdr);
+        if (0 != (rc = coap_parseToken(&pkt->token, &pkt->header, buf, buflen))) {
+                return COAP_STAT_ERR(rc);
+        }
 
-                if (len == 13) {
-                        *p++ = (pkt->opts[i].val.len - 13);
-                }
-                else if (len == 14) {
-                        *p++ = (pkt->opts[i].val.len >> 8);
-                        *p++ = (0xFF & (pkt->opts[i].val.len - 269));
-                }
+        pkt->numopts = MAXOPT;
 
-                memcpy(p, pkt->opts[i].val.p, pkt->opts[i].val.len);
-                p += pkt->opts[i].val.len;
-                running_delta = pkt->opts[i].num;
+        if (0 != (rc = coap_parseOptionsAndPayload(pkt->opts, &(pkt->numopts),
+                                                   &(pkt->payload), &pkt->header, buf, buflen))) {
+                return COAP_STAT_ERR(rc);
         }
 
-        opts_len = (p - buf) - 4;   // number of bytes used by options
+        COAP_STAT(stats.rx_pkts++; stats.rx_bytes += buflen);
 
-        if (pkt->payload.len > 0) {
+        //    coap_dumpOptions(opts, numopt);
+        return 0;
+}
+
+
+#ifdef COAP_WITH_TRUSTED_PARSE
+int coap_parse_trusted(coap_packet_t *pkt, const uint8_t *buf, size_t buflen)
+{
+        int rc;
+
+        coap_parseHeaderTrusted(&pkt->header, buf);
+
+        pkt->token.p   = (pkt->header.tkllen > 0) ? (buf + 4) : NULL;
+        pkt->token.len = pkt->header.tkllen;
+
+        pkt->numopts = MAXOPT;
+
+        if (0 != (rc = coap_parseOptionsAndPayloadTrusted(pkt->opts, &(pkt->numopts), &(pkt->payload),
+                                                          &pkt->header, buf, buflen))) {
+                return COAP_STAT_ERR(rc);
+        }
+
+        COAP_STAT(stats.rx_pkts++; stats.rx_bytes += buflen);
+
+        return 0;
+}
+#endif
+
+
+int coap_parse_raw(coap_raw_packet_t *pkt, const uint8_t *buf, size_t buflen)
+{
+        int rc;
+
+        if (0 != (rc = coap_parseHeader(&pkt->header, buf, buflen))) {
+                return rc;
+        }
+
+        if (0 != (rc = coap_parseToken(&pkt->token, &pkt->header, buf, buflen))) {
+                return rc;
+        }
+
+        // coap_parseToken() made sure that header and token fit into buf
+        pkt->opts.p   = buf + 4 + pkt->header.tkllen;
+        pkt->opts.len = buflen - 4 - pkt->header.tkllen;
+
+        return 0;
+}
+
+
+void coap_opt_iter_init(coap_opt_iter_t *it, const coap_raw_packet_t *pkt)
+{
+        it->p   = pkt->opts.p;
+        it->end = pkt->opts.p + pkt->opts.len;
+        it->num = 0;
+        it->err = 0;
+}
+
+
+bool coap_opt_iter_next(coap_opt_iter_t *it, coap_option_t *opt)
+{
+        // 0xFF is payload marker
+        if ((it->err != 0) || (it->p >= it->end) || (*it->p == 0xFF)) {
+                return false;
+        }
+
+        it->err = coap_parseOption(opt, &it->num, &it->p, it->end - it->p);
+
+        return (it->err == 0);
+}
+
+
+int coap_opt_iter_payload(coap_opt_iter_t *it, coap_buffer_t *payload)
+{
+        coap_option_t opt;
+
+        while (coap_opt_iter_next(it, &opt)) {
+                // skip
+        }
+
+        if (it->err != 0) {
+                return it->err;
+        }
+
+        if (it->p + 1 < it->end && *it->p == 0xFF) { // payload marker
+                payload->p   = it->p + 1;
+                payload->len = it->end - (it->p + 1);
+        }
+        else {
+                payload->p   = NULL;
+                payload->len = 0;
+        }
+
+        return 0;
+}
+
+
+// options are always stored consecutively, so can return a block with same option num
+const coap_option_t *coap_find_options(const coap_packet_t *pkt, uint16_t num, uint8_t *count)
+{
+        size_t i;
+        const coap_option_t *first = NULL;
+        *count = 0;
+
+        // options are sorted by number, so stop as soon as we are past num
+        for (i = 0; i < pkt->numopts; i++) {
+                if (pkt->opts[i].num == num) {
+                        if (NULL == first) {
+                                first = &pkt->opts[i];
+                        }
+
+                        (*count)++;
+                }
+                else if (pkt->opts[i].num > num || NULL != first) {
+                        break;
+                }
+        }
+
+        return first;
+}
+
+
+int coap_buffer_to_string(char *strbuf, size_t strbuflen, const coap_buffer_t *buf)
+{
+        if (buf->len + 1 > strbuflen) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        memcpy(strbuf, buf->p, buf->len);
+        strbuf[buf->len] = 0;
+        return 0;
+}
+
+
+static void coap_option_nibble(uint32_t value, uint8_t *nibble)
+{
+        if (value < 13) {
+                *nibble = (0xFF & value);
+        }
+        else if (value <= 0xFF + 13) {
+                *nibble = 13;
+        }
+        else if (value <= 0xFFFF + 269) {
+                *nibble = 14;
+        }
+}
+
+
+// size of the option header (first byte, extended delta and length)
+static size_t coap_option_hdrlen(uint32_t delta, size_t len)
+{
+        uint8_t d = 0;
+        uint8_t l = 0;
+
+        coap_option_nibble(delta, &d);
+        coap_option_nibble((uint32_t)len, &l);
+
+        return 1 + ((d == 13) ? 1 : ((d == 14) ? 2 : 0))
+                 + ((l == 13) ? 1 : ((l == 14) ? 2 : 0));
+}
+
+
+// writes the header of an option to p and returns its size
+static size_t coap_option_header(uint8_t *p, uint32_t delta, size_t len)
+{
+        uint8_t *start = p;
+        uint8_t  d     = 0;
+        uint8_t  l     = 0;
+
+        coap_option_nibble(delta, &d);
+        coap_option_nibble((uint32_t)len, &l);
+
+        *p++ = (0xFF & (d << 4 | l));
+
+        if (d == 13) {
+                *p++ = (delta - 13);
+        }
+        else if (d == 14) {
+                *p++ = ((delta - 269) >> 8);
+                *p++ = (0xFF & (delta - 269));
+        }
+
+        if (l == 13) {
+                *p++ = (len - 13);
+        }
+        else if (l == 14) {
+                *p++ = ((len - 269) >> 8);
+                *p++ = (0xFF & (len - 269));
+        }
+
+        return p - start;
+}
+
+
+// writes one option (header, extended delta and length, value) to p and
+// returns the number of bytes used, or 0 if avail is too small
+static size_t coap_option_write(uint8_t *p, size_t avail, uint32_t delta,
+                                const uint8_t *val, size_t len)
+{
+        size_t n = coap_option_hdrlen(delta, len) + len;
+
+        if (n > avail) {
+                return 0;
+        }
+
+        p += coap_option_header(p, delta, len);
+
+        if (len > 0) {
+                memcpy(p, val, len);
+        }
+
+        return n;
+}
+
+
+int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt)
+{
+        size_t    opts_len      = 0;
+        size_t    i;
+        size_t    n;
+        uint8_t  *p;
+        uint16_t  running_delta = 0;
+
+        // build header
+        if (*buflen < (4U + pkt->header.tkllen)) {
+                return COAP_STAT_ERR(COAP_ERR_BUFFER_TOO_SMALL);
+        }
+
+        buf[0] = (pkt->header.version & 0x03) << 6;
+        buf[0] |= (pkt->header.type & 0x03) << 4;
+        buf[0] |= (pkt->header.tkllen & 0x0F);
+        buf[1] = pkt->header.code;
+        buf[2] = pkt->header.mid[0];
+        buf[3] = pkt->header.mid[1];
+
+        // inject token
+        p = buf + 4;
+
+        if ((pkt->header.tkllen > 0) && (pkt->header.tkllen != pkt->token.len)) {
+                return COAP_STAT_ERR(COAP_ERR_UNSUPPORTED);
+        }
+
+        if (pkt->header.tkllen > 0) {
+                memcpy(p, pkt->token.p, pkt->header.tkllen);
+        }
+
+        // inject options
+        p += pkt->header.tkllen;
+
+        for (i = 0; i < pkt->numopts; i++) {
+                if (pkt->opts[i].num < running_delta) {
+                        return COAP_STAT_ERR(COAP_ERR_UNSUPPORTED);   // options must be sorted
+                }
+
+                n = coap_option_write(p, *buflen - (p - buf), pkt->opts[i].num - running_delta,
+                                      pkt->opts[i].val.p, pkt->opts[i].val.len);
+
+                if (n == 0) {
+                        return COAP_STAT_ERR(COAP_ERR_BUFFER_TOO_SMALL);
+                }
+
+                p += n;
+                running_delta = pkt->opts[i].num;
+        }
+
+        opts_len = (p - buf) - 4;   // number of bytes used by token and options
+
+        if (pkt->payload.len > 0) {
                 if (*buflen < 4 + 1 + pkt->payload.len + opts_len) {
-                        return COAP_ERR_BUFFER_TOO_SMALL;
+                        return COAP_STAT_ERR(COAP_ERR_BUFFER_TOO_SMALL);
                 }
 
                 buf[4 + opts_len] = 0xFF;  // payload marker
@@ -414,6 +1031,8 @@ int coap_build(uint8_t *buf, size_t *buflen, const coap_packet_t *pkt)
                 *buflen = opts_len + 4;
         }
 
+        COAP_STAT(stats.tx_pkts++; stats.tx_bytes += *buflen);
+
         return 0;
 }
 
@@ -445,171 +1064,1783 @@ int coap_make_ack(      coap_packet_t    *pkt,
 }
 
 
-// FIXME This function always sends the content format option, even when the
-// response code is an error (e.g. 4.04 NOT FOUND)
-int coap_make_response(      coap_rw_buffer_t    *scratch,
-                             coap_packet_t       *pkt,
-                       const uint8_t             *content,
-                             size_t               content_len,
-                             uint8_t              msgid_hi,
-                             uint8_t              msgid_lo,
-                       const coap_buffer_t       *tok,
-                             coap_responsecode_t  rspcode,
-                             coap_content_type_t  content_type,
-                             bool                 confirmable)
+int coap_enc_init(      coap_encoder_t *enc,
+                        uint8_t        *buf,
+                        size_t          buflen,
+                        coap_msgtype_t  type,
+                        uint8_t         code,
+                        uint8_t         msgid_hi,
+                        uint8_t         msgid_lo,
+                  const coap_buffer_t  *tok)
 {
-        if (scratch->len < 2) {
+        size_t tkllen = (tok) ? tok->len : 0;
+
+        if (tkllen > 8) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        if (buflen < 4 + tkllen) {
                 return COAP_ERR_BUFFER_TOO_SMALL;
         }
-        
-        pkt->header.version = 0x01;
-        pkt->header.code    = rspcode;
-        pkt->header.mid[0]  = msgid_hi;
-        pkt->header.mid[1]  = msgid_lo;
-        pkt->numopts        = 1;
-        
-        if (confirmable) {
-                pkt->header.type = COAP_TYPE_CON;
-        } else {
-                pkt->header.type = COAP_TYPE_NONCON;
+
+        buf[0] = (0x01 << 6) | ((type & 0x03) << 4) | tkllen;
+        buf[1] = code;
+        buf[2] = msgid_hi;
+        buf[3] = msgid_lo;
+
+        // the token may live in buf already, e.g. when replying in place
+        if (tkllen > 0) {
+                memmove(buf + 4, tok->p, tkllen);
         }
-        
-        if (tok) {
-                pkt->header.tkllen =  tok->len;
-                pkt->token         = *tok;
-        } else {
-                pkt->header.tkllen = 0;
-                pkt->token         = (coap_buffer_t){.p = NULL, .len = 0};
+
+        enc->buf     = buf;
+        enc->len     = buflen;
+        enc->pos     = 4 + tkllen;
+        enc->lastopt = 0;
+        enc->payload = false;
+        enc->ctx     = NULL;
+        enc->peer    = NULL;
+
+        return 0;
+}
+
+
+void coap_enc_set_code(coap_encoder_t *enc, uint8_t code)
+{
+        enc->buf[1] = code;
+}
+
+
+int coap_enc_option(      coap_encoder_t *enc,
+                          uint16_t        num,
+                    const uint8_t        *val,
+                          size_t          len)
+{
+        size_t n;
+
+        if (enc->payload || (num < enc->lastopt)) {
+                return COAP_ERR_UNSUPPORTED;   // options must be sorted and precede the payload
         }
-        
-        pkt->opts[0].num   = COAP_OPTION_CONTENT_FORMAT;
-        pkt->opts[0].val.p = scratch->p;
-        
-        scratch->p[0] = ((uint16_t)content_type & 0xFF00) >> 8;
-        scratch->p[1] = ((uint16_t)content_type & 0x00FF);
-        
-        pkt->opts[0].val.len = 2;
-        
-        pkt->payload.p   = content;
-        pkt->payload.len = content_len;
-        
+
+        n = coap_option_write(enc->buf + enc->pos, enc->len - enc->pos, num - enc->lastopt,
+                              val, len);
+
+        if (n == 0) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        enc->pos     += n;
+        enc->lastopt  = num;
+
         return 0;
 }
 
 
-// FIXME This function always sends the content format option, even when the response code
-// is an error (e.g. 4.04 NOT FOUND)
-int coap_make_pb_response(      coap_rw_buffer_t    *scratch,
-                                coap_packet_t       *pkt,
-                          const uint8_t             *content,
-                                size_t               content_len,
-                                uint8_t              msgid_hi,
-                                uint8_t              msgid_lo,
-                          const coap_buffer_t       *tok,
-                                coap_responsecode_t  rspcode,
-                                coap_content_type_t  content_type)
+int coap_enc_option_uint(coap_encoder_t *enc, uint16_t num, uint32_t val)
+{
+        uint8_t tmp[4];
+        size_t  len = 0;
+
+        // minimal length, network byte order, 0 is encoded as empty value
+        while (val != 0) {
+                tmp[3 - len++] = (0xFF & val);
+                val >>= 8;
+        }
+
+        return coap_enc_option(enc, num, &tmp[4 - len], len);
+}
+
+
+uint8_t *coap_enc_payload_buf(coap_encoder_t *enc, size_t *avail)
 {
-        if (scratch->len < 2) {
+        // leave room for the payload marker, it is written once data is committed
+        size_t start = enc->pos + (enc->payload ? 0 : 1);
+
+        *avail = (start < enc->len) ? (enc->len - start) : 0;
+
+        return enc->buf + start;
+}
+
+
+int coap_enc_payload_commit(coap_encoder_t *enc, size_t len)
+{
+        size_t avail;
+
+        coap_enc_payload_buf(enc, &avail);
+
+        if (len > avail) {
                 return COAP_ERR_BUFFER_TOO_SMALL;
         }
-        
-        pkt->header.version = 0x01;
-        pkt->header.type    = COAP_TYPE_ACK;
-        pkt->header.code    = rspcode;
-        pkt->header.mid[0]  = msgid_hi;
-        pkt->header.mid[1]  = msgid_lo;
-        pkt->numopts        = 1;
 
-        // need token in response
-        if (tok) {
-                pkt->header.tkllen =  tok->len;
-                pkt->token         = *tok;
-        } else {
-                pkt->header.tkllen = 0;
-                pkt->token         = (coap_buffer_t){.p = NULL, .len = 0};
+        if (len == 0) {
+                return 0;   // no marker without payload
+        }
+
+        if (!enc->payload) {
+                enc->buf[enc->pos++] = 0xFF;   // payload marker
+                enc->payload = true;
         }
 
-        // safe because 1 < MAXOPT
-        pkt->opts[0].num   = COAP_OPTION_CONTENT_FORMAT;
-        pkt->opts[0].val.p = scratch->p;
+        enc->pos += len;
 
-        scratch->p[0] = ((uint16_t)content_type & 0xFF00) >> 8;
-        scratch->p[1] = ((uint16_t)content_type & 0x00FF);
-        
-        pkt->opts[0].val.len = 2;
-        
-        pkt->payload.p   = content;
-        pkt->payload.len = content_len;
-        
         return 0;
 }
 
 
-int coap_handle_req(      coap_rw_buffer_t *scratch,
-                    const coap_packet_t    *inpkt,
-                          coap_packet_t    *outpkt,
-                          bool              pb,
-                          bool              con)
+int coap_enc_payload(coap_encoder_t *enc, const uint8_t *data, size_t len)
+{
+        size_t   avail;
+        uint8_t *p = coap_enc_payload_buf(enc, &avail);
+
+        if (len > avail) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        if (len > 0) {
+                memcpy(p, data, len);
+        }
+
+        return coap_enc_payload_commit(enc, len);
+}
+
+
+int coap_enc_response(      coap_encoder_t      *enc,
+                            coap_responsecode_t  rspcode,
+                            coap_content_type_t  content_type,
+                      const uint8_t             *content,
+                            size_t               content_len)
+{
+        int rc;
+
+        coap_enc_set_code(enc, rspcode);
+
+        if (content_type != COAP_CONTENTTYPE_NONE) {
+                if (0 != (rc = coap_enc_option_uint(enc, COAP_OPTION_CONTENT_FORMAT,
+                                                    (uint16_t)content_type))) {
+                        return rc;
+                }
+        }
+
+        return coap_enc_payload(enc, content, content_len);
+}
+
+
+int coap_tpl_init(coap_template_t *tpl, coap_encoder_t *enc)
+{
+        if (enc->payload) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        if (enc->pos >= enc->len) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        enc->buf[enc->pos] = 0xFF;   // payload marker
+
+        tpl->buf     = enc->buf;
+        tpl->len     = enc->len;
+        tpl->prefix  = enc->pos + 1;
+        tpl->lastopt = enc->lastopt;
+
+        return 0;
+}
+
+
+uint8_t *coap_tpl_payload(const coap_template_t *tpl, size_t *avail)
+{
+        *avail = tpl->len - tpl->prefix;
+
+        return tpl->buf + tpl->prefix;
+}
+
+
+size_t coap_tpl_finish(coap_template_t *tpl, uint16_t msgid, size_t payload_len)
+{
+        if (payload_len > tpl->len - tpl->prefix) {
+                return 0;
+        }
+
+        tpl->buf[2] = (msgid >> 8);
+        tpl->buf[3] = (0xFF & msgid);
+
+        if (payload_len == 0) {
+                return tpl->prefix - 1;   // no payload, no marker
+        }
+
+        return tpl->prefix + payload_len;
+}
+
+
+int coap_block_decode(const coap_option_t *opt, coap_block_t *block)
+{
+        uint32_t val = 0;
+        size_t   i;
+
+        if (opt->val.len > 3) {
+                return COAP_ERR_OPTION_LEN_INVALID;
+        }
+
+        for (i = 0; i < opt->val.len; i++) {
+                val = (val << 8) | opt->val.p[i];
+        }
+
+        if ((val & 0x07) == 7) {
+                return COAP_ERR_UNSUPPORTED;   // reserved size exponent
+        }
+
+        block->num  = val >> 4;
+        block->more = (val & 0x08) != 0;
+        block->szx  = val & 0x07;
+
+        return 0;
+}
+
+
+int coap_enc_block(coap_encoder_t *enc, uint16_t num, const coap_block_t *block)
+{
+        return coap_enc_option_uint(enc, num, (block->num << 4) | (block->more ? 0x08 : 0)
+                                              | (block->szx & 0x07));
+}
+
+
+int coap_enc_block2_response(      coap_encoder_t      *enc,
+                             const coap_packet_t       *inpkt,
+                                   coap_responsecode_t  rspcode,
+                                   coap_content_type_t  content_type,
+                             const uint8_t             *content,
+                                   size_t               content_len)
+{
+        const coap_option_t *opt;
+              coap_block_t   block = { .num = 0, .szx = COAP_BLOCK_SZX, .more = false };
+              size_t         avail;
+              size_t         offset;
+              uint8_t        count;
+              int            rc;
+
+        opt = coap_find_options(inpkt, COAP_OPTION_BLOCK2, &count);
+
+        if (opt == NULL && content_len <= COAP_BLOCK_SIZE(COAP_BLOCK_SZX)) {
+                return coap_enc_response(enc, rspcode, content_type, content, content_len);
+        }
+
+        if (opt != NULL && coap_block_decode(opt, &block) != 0) {
+                coap_enc_set_code(enc, COAP_RSPCODE_BAD_OPTION);
+                return 0;
+        }
+
+        // room for the payload behind Content-Format (3 bytes) and Block2 (4 bytes)
+        coap_enc_payload_buf(enc, &avail);
+        avail = (avail > 7) ? (avail - 7) : 0;
+
+        // use smaller blocks than requested if need be, the block number scales along
+        while (block.szx > 0 && (block.szx > COAP_BLOCK_SZX || COAP_BLOCK_SIZE(block.szx) > avail)) {
+                block.szx--;
+                block.num <<= 1;
+        }
+
+        if (COAP_BLOCK_SIZE(block.szx) > avail) {
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        offset = (size_t)block.num * COAP_BLOCK_SIZE(block.szx);
+
+        if (offset >= content_len && !(offset == 0 && content_len == 0)) {
+                coap_enc_set_code(enc, COAP_RSPCODE_BAD_OPTION);
+                return 0;
+        }
+
+        block.more = (content_len - offset) > COAP_BLOCK_SIZE(block.szx);
+
+        coap_enc_set_code(enc, rspcode);
+
+        if (content_type != COAP_CONTENTTYPE_NONE) {
+                if (0 != (rc = coap_enc_option_uint(enc, COAP_OPTION_CONTENT_FORMAT,
+                                                    (uint16_t)content_type))) {
+                        return rc;
+                }
+        }
+
+        if (0 != (rc = coap_enc_block(enc, COAP_OPTION_BLOCK2, &block))) {
+                return rc;
+        }
+
+        return coap_enc_payload(enc, content + offset,
+                                block.more ? COAP_BLOCK_SIZE(block.szx) : (content_len - offset));
+}
+
+
+void coap_block1_init(      coap_block1_tx_t *tx,
+                      const coap_template_t  *tpl,
+                      const uint8_t          *body,
+                            size_t            len,
+                            uint8_t           szx)
+{
+        tx->tpl  = tpl;
+        tx->body = body;
+        tx->len  = len;
+        tx->num  = 0;
+        tx->szx  = (szx > 6) ? 6 : szx;
+        tx->con  = (((tpl->buf[0] >> 4) & 0x03) == COAP_TYPE_CON);
+}
+
+
+size_t coap_block1_build(const coap_block1_tx_t *tx,
+                               uint32_t          num,
+                               uint8_t          *buf,
+                               size_t            buflen,
+                               uint16_t          msgid)
+{
+        coap_encoder_t    enc;
+        coap_block_t      block;
+        coap_raw_packet_t raw;
+        coap_opt_iter_t   it;
+        coap_option_t     opt;
+        bool              blk    = false;
+        bool              con    = tx->con;
+        size_t            offset = (size_t)num * COAP_BLOCK_SIZE(tx->szx);
+        size_t            hdrlen = tx->tpl->prefix - 1;   // prefix without the payload marker
+
+        if ((offset >= tx->len && !(offset == 0 && tx->len == 0)) || (buflen < hdrlen)) {
+                return 0;
+        }
+
+        block.num  = num;
+        block.szx  = tx->szx;
+        block.more = (tx->len - offset) > COAP_BLOCK_SIZE(tx->szx);
+
+        enc.buf     = buf;
+        enc.len     = buflen;
+        enc.payload = false;
+        enc.ctx     = NULL;
+        enc.peer    = NULL;
+
+        if (tx->tpl->lastopt <= COAP_OPTION_BLOCK1) {
+                // continue encoding behind a copy of the template prefix
+                memcpy(buf, tx->tpl->buf, hdrlen);
+                enc.pos     = hdrlen;
+                enc.lastopt = tx->tpl->lastopt;
+        }
+        else {
+                // Block1 goes in between the options of the template, so they
+                // are encoded again behind a copy of header and token
+                if (coap_parse_raw(&raw, tx->tpl->buf, hdrlen) != 0) {
+                        return 0;
+                }
+
+                enc.pos     = 4 + raw.header.tkllen;
+                enc.lastopt = 0;
+                memcpy(buf, tx->tpl->buf, enc.pos);
+                coap_opt_iter_init(&it, &raw);
+
+                while (coap_opt_iter_next(&it, &opt)) {
+                        if (!blk && (opt.num > COAP_OPTION_BLOCK1)) {
+                                if (coap_enc_block(&enc, COAP_OPTION_BLOCK1, &block) != 0) {
+                                        return 0;
+                                }
+
+                                blk = true;
+                        }
+
+                        // the peer has to answer the blocks with 2.31 Continue
+                        if ((opt.num != COAP_OPTION_NO_RESPONSE)
+                            && (coap_enc_option(&enc, opt.num, opt.val.p, opt.val.len) != 0)) {
+                                return 0;
+                        }
+                }
+
+                if (it.err != 0) {
+                        return 0;
+                }
+        }
+
+        if (con) {
+                buf[0] = (buf[0] & ~0x30) | (COAP_TYPE_CON << 4);
+        }
+
+        buf[2] = (msgid >> 8);
+        buf[3] = (0xFF & msgid);
+
+        if ((!blk && (coap_enc_block(&enc, COAP_OPTION_BLOCK1, &block) != 0))
+            || (coap_enc_payload(&enc, tx->body + offset,
+                                 block.more ? COAP_BLOCK_SIZE(tx->szx) : (tx->len - offset)) != 0)) {
+                return 0;
+        }
+
+        return enc.pos;
+}
+
+
+size_t coap_block1_next(coap_block1_tx_t *tx, uint8_t *buf, size_t buflen, uint16_t msgid)
+{
+        size_t len = coap_block1_build(tx, tx->num, buf, buflen, msgid);
+
+        if (len > 0) {
+                tx->num++;
+        }
+
+        return len;
+}
+
+
+void coap_seed(uint32_t seed)
+{
+        COAP_LOCK();
+        next_mid    = (0xFFFF & (seed ^ (seed >> 16)));
+        token_state = (seed != 0) ? seed : 0x2545F491;
+        COAP_UNLOCK();
+}
+
+
+uint16_t coap_mid_next(void)
+{
+        uint16_t mid;
+
+        COAP_LOCK();
+        mid = next_mid++;
+        COAP_UNLOCK();
+
+        return mid;
+}
+
+
+void coap_token_next(uint8_t *tok, size_t len)
+{
+        size_t i;
+
+        COAP_LOCK();
+
+        for (i = 0; i < len && i < 8; i++) {
+                if ((i & 3) == 0) {
+                        token_state ^= token_state << 13;
+                        token_state ^= token_state >> 17;
+                        token_state ^= token_state << 5;
+                }
+
+                tok[i] = (0xFF & (token_state >> ((i & 3) * 8)));
+        }
+
+        COAP_UNLOCK();
+}
+
+
+// home slot of a message in the duplicate cache, FNV-1a over address, port
+// and message ID
+static size_t coap_dedup_home(const coap_peer_t *peer, uint16_t mid)
+{
+        uint32_t key = 2166136261UL;
+        size_t   i;
+
+        for (i = 0; i < sizeof(peer->addr); i++) {
+                key = (key ^ peer->addr[i]) * 16777619UL;
+        }
+
+        key = (key ^ (peer->port >> 8)) * 16777619UL;
+        key = (key ^ (0xFF & peer->port)) * 16777619UL;
+
+        return (key ^ mid) % COAP_DEDUP_SIZE;
+}
+
+
+// the entry of a message from peer, NULL if there is none, call with the lock
+// held. Entries are only ever looked up while valid, so an expired one that
+// still matches is harmless
+static coap_dedup_t *coap_dedup_find(const coap_peer_t *peer, uint16_t mid)
+{
+        size_t home = coap_dedup_home(peer, mid);
+        size_t i;
+
+        for (i = 0; i < 2; i++) {
+                coap_dedup_t *e = &dedup[(home + i) % COAP_DEDUP_SIZE];
+
+                if ((e->mid == mid) && (e->peer.port == peer->port)
+                    && (memcmp(e->peer.addr, peer->addr, sizeof(peer->addr)) == 0)) {
+                        return e;
+                }
+        }
+
+        return NULL;
+}
+
+
+bool coap_is_duplicate(const coap_peer_t *peer, const coap_packet_t *pkt, uint32_t now)
+{
+        coap_dedup_t *slot;
+        coap_dedup_t *victim;
+        int32_t       victim_left = 0;
+        uint16_t      mid = (pkt->header.mid[0] << 8) | pkt->header.mid[1];
+        size_t        i;
+
+        if (pkt->header.type == COAP_TYPE_ACK || pkt->header.type == COAP_TYPE_RESET) {
+                return false;
+        }
+
+        // two way set associative: look at the home slot and the next one,
+        // replace the one that expires first (expired ones count as 0)
+        slot   = &dedup[coap_dedup_home(peer, mid)];
+        victim = NULL;
+
+        COAP_LOCK();
+
+        for (i = 0; i < 2; i++) {
+                coap_dedup_t *e    = &dedup[((slot - dedup) + i) % COAP_DEDUP_SIZE];
+                int32_t       left = (int32_t)(e->expire - now);   // wrap-around safe
+
+                if (left > 0 && e->mid == mid && e->peer.port == peer->port
+                    && memcmp(e->peer.addr, peer->addr, sizeof(peer->addr)) == 0) {
+                        COAP_UNLOCK();
+                        return true;
+                }
+
+                if (left < 0) {
+                        left = 0;
+                }
+
+                if ((victim == NULL) || (left < victim_left)) {
+                        victim      = e;
+                        victim_left = left;
+                }
+        }
+
+        victim->peer   = *peer;
+        victim->mid    = mid;
+        victim->expire = now + COAP_EXCHANGE_LIFETIME;
+        victim->rsplen = 0;
+
+        COAP_UNLOCK();
+
+        return false;
+}
+
+
+void coap_dedup_store(const coap_peer_t *peer, const coap_packet_t *pkt,
+                      const uint8_t *rsp, size_t rsplen)
+{
+        coap_dedup_t *e;
+
+        // separate responses are not repeated, the ACK is empty then
+        if ((rsplen < 4) || (rsplen > COAP_DEDUP_RSP_SIZE)
+            || (((rsp[0] >> 4) & 0x03) != COAP_TYPE_ACK)) {
+                return;
+        }
+
+        COAP_LOCK();
+
+        // the entry may have been taken over by another message meanwhile
+        if (NULL != (e = coap_dedup_find(peer, (pkt->header.mid[0] << 8) | pkt->header.mid[1]))) {
+                memcpy(e->rsp, rsp, rsplen);
+                e->rsplen = rsplen;
+        }
+
+        COAP_UNLOCK();
+}
+
+
+size_t coap_dedup_reply(const coap_peer_t *peer, const coap_packet_t *pkt,
+                        uint8_t *buf, size_t buflen)
+{
+        coap_dedup_t *e;
+        size_t        len = 0;
+
+        if ((pkt->header.type != COAP_TYPE_CON) || (buflen < 4)) {
+                return 0;
+        }
+
+        COAP_LOCK();
+
+        e = coap_dedup_find(peer, (pkt->header.mid[0] << 8) | pkt->header.mid[1]);
+
+        if ((e != NULL) && (e->rsplen > 0) && (e->rsplen <= buflen)) {
+                memcpy(buf, e->rsp, e->rsplen);
+                len = e->rsplen;
+        }
+
+        COAP_UNLOCK();
+
+        // the response went out separately or was not kept, the ACK tells
+        // the sender to stop retransmitting
+        if (len == 0) {
+                buf[0] = (1 << 6) | (COAP_TYPE_ACK << 4);
+                buf[1] = 0;
+                buf[2] = pkt->header.mid[0];
+                buf[3] = pkt->header.mid[1];
+                len    = 4;
+        }
+
+        return len;
+}
+
+
+static int coap_route_child(uint8_t node, const uint8_t *seg, size_t len)
+{
+        uint8_t n;
+
+        for (n = routes[node].child; n != 0; n = routes[n].sibling) {
+                if ((routes[n].len == len) && (memcmp(routes[n].seg, seg, len) == 0)) {
+                        return n;
+                }
+        }
+
+        return -1;
+}
+
+
+int coap_init(void)
+{
+        const coap_endpoint_t *ep;
+        uint8_t                node;
+        int                    rc = 0;
+        int                    i;
+        int                    n;
+
+        memset(routes, 0, sizeof(routes));
+        routes_used = 1;
+        core_len    = 0;
+
+        for (ep = endpoints; ep->handler != NULL; ep++) {
+                if (ep->path->count > MAX_SEGMENTS) {
+                        return COAP_ERR_UNSUPPORTED;
+                }
+
+                node = 0;
+
+                for (i = 0; i < ep->path->count; i++) {
+                        const char *seg = ep->path->elems[i];
+                        size_t      len = strlen(seg);
+
+                        if (len > 0xFF) {
+                                return COAP_ERR_UNSUPPORTED;
+                        }
+
+                        n = coap_route_child(node, (const uint8_t *)seg, len);
+
+                        if (n < 0) {
+                                if (routes_used == COAP_ROUTE_NODES) {
+                                        return COAP_ERR_BUFFER_TOO_SMALL;
+                                }
+
+                                // prepend the new node to the children of node
+                                n = routes_used++;
+                                routes[n].seg     = seg;
+                                routes[n].len     = len;
+                                routes[n].sibling = routes[node].child;
+                                routes[node].child = n;
+                        }
+
+                        node = n;
+                }
+
+                // one link per path, with the attributes of its first endpoint
+                if ((routes[node].ep[0] == 0) && (routes[node].ep[1] == 0)
+                    && (routes[node].ep[2] == 0) && (routes[node].ep[3] == 0)
+                    && !coap_core_add(ep)) {
+                        rc = COAP_ERR_BUFFER_TOO_SMALL;
+                }
+
+                // like the linear search before, the first matching endpoint wins
+                if ((ep->method >= COAP_METHOD_GET) && (ep->method <= COAP_METHOD_DELETE)
+                    && (routes[node].ep[ep->method - 1] == 0)) {
+                        routes[node].ep[ep->method - 1] = (ep - endpoints) + 1;
+                }
+        }
+
+        // the listing itself is not listed
+        for (i = 1; i < (int)COAP_BUILTINS_NUMOF; i++) {
+                if (!coap_core_add(&builtins[i])) {
+                        rc = COAP_ERR_BUFFER_TOO_SMALL;
+                }
+        }
+
+        return rc;
+}
+
+
+// true if the 'obs' attribute is set in the core_attr of ep
+static bool coap_obs_allowed(const coap_endpoint_t *ep)
+{
+        const char *a = ep->core_attr;
+
+        if (ep->method != COAP_METHOD_GET || a == NULL) {
+                return false;
+        }
+
+        while (*a != '\0') {
+                if (strncmp(a, "obs", 3) == 0 && (a[3] == ';' || a[3] == '\0')) {
+                        return true;
+                }
+
+                // skip to the next attribute
+                while (*a != '\0' && *a++ != ';') {
+                }
+        }
+
+        return false;
+}
+
+
+// returns the registration of peer and token, or NULL
+static coap_observer_t *coap_obs_find(const coap_peer_t *peer, const coap_buffer_t *tok)
+{
+        int i;
+
+        for (i = 0; i < COAP_OBS_MAX; i++) {
+                coap_observer_t *obs = &observers[i];
+
+                if ((obs->ep != NULL) && (obs->peer.port == peer->port)
+                    && (memcmp(obs->peer.addr, peer->addr, sizeof(peer->addr)) == 0)
+                    && (obs->tkllen == tok->len)
+                    && ((tok->len == 0) || (memcmp(obs->token, tok->p, tok->len) == 0))) {
+                        return obs;
+                }
+        }
+
+        return NULL;
+}
+
+
+// handles the Observe option of a GET to ep, returns the registration to be
+// announced in the response or NULL
+static coap_observer_t *coap_obs_register(const coap_peer_t *peer, const coap_packet_t *inpkt,
+                                          const coap_endpoint_t *ep)
 {
-        const coap_endpoint_t *ep   = endpoints;
         const coap_option_t   *opt;
-        
+              coap_observer_t *obs;
+              uint32_t         val = 0;
+              uint8_t          count;
+              size_t           i;
+
+        if ((peer == NULL) || (inpkt->header.code != COAP_METHOD_GET)
+            || (NULL == (opt = coap_find_options(inpkt, COAP_OPTION_OBSERVE, &count)))) {
+                return NULL;
+        }
+
+        for (i = 0; i < opt->val.len && i < 3; i++) {
+                val = (val << 8) | opt->val.p[i];
+        }
+
+        obs = coap_obs_find(peer, &inpkt->token);
+
+        // 0 registers, 1 deregisters
+        if (val == 1) {
+                if (obs != NULL) {
+                        obs->ep = NULL;
+                }
+
+                return NULL;
+        }
+
+        if ((val != 0) || !coap_obs_allowed(ep)) {
+                return NULL;
+        }
+
+        // a new registration of the same peer and token replaces the old one,
+        // a slot whose last notification is still in flight is not free yet
+        for (i = 0; (obs == NULL) && (i < COAP_OBS_MAX); i++) {
+                if ((observers[i].ep == NULL) && !observers[i].con) {
+                        obs = &observers[i];
+                        obs->seq  = 0;
+                        obs->nons = 0;
+                }
+        }
+
+        if (obs == NULL) {
+                return NULL;   // table full, serve it as a plain GET
+        }
+
+        obs->peer   = *peer;
+        obs->ep     = ep;
+        obs->mid    = (inpkt->header.mid[0] << 8) | inpkt->header.mid[1];
+        obs->tkllen = inpkt->token.len;
+
+        if (inpkt->token.len > 0) {
+                memcpy(obs->token, inpkt->token.p, inpkt->token.len);
+        }
+
+        return obs;
+}
+
+
+// completes the confirmable message matching the ACK or Reset in pkt
+static void coap_con_done(const coap_peer_t *peer, const coap_packet_t *pkt)
+{
+        coap_con_func  cb  = NULL;
+        void          *arg = NULL;
+        uint16_t       mid = (pkt->header.mid[0] << 8) | pkt->header.mid[1];
+        int            i;
+
+        COAP_LOCK();
+
+        for (i = 0; i < COAP_CON_MAX; i++) {
+                coap_con_t *con = &cons[i];
+
+                if ((con->buf == NULL) || (con->mid != mid)
+                    || ((peer != NULL) && ((con->peer.port != peer->port)
+                                            || (memcmp(con->peer.addr, peer->addr, sizeof(peer->addr)) != 0)))) {
+                        continue;
+                }
+
+                con->buf = NULL;
+                cb       = con->cb;
+                arg      = con->arg;
+                break;
+        }
+
+        COAP_UNLOCK();
+
+        if (cb != NULL) {
+                cb(arg, (pkt->header.type == COAP_TYPE_RESET) ? COAP_ERR_RESET : 0, pkt);
+        }
+}
+
+
+// completes the request the response or Reset in pkt belongs to, a Reset
+// is matched by message ID, anything else by token; now is NULL if the
+// time is not known
+static bool coap_req_done(const coap_peer_t *peer, const coap_packet_t *pkt, const uint32_t *now)
+{
+        coap_req_t  req;
+        bool        rst   = (pkt->header.type == COAP_TYPE_RESET);
+        uint16_t    mid   = (pkt->header.mid[0] << 8) | pkt->header.mid[1];
+        bool        found = false;
+        int         i;
+
+        COAP_LOCK();
+
+        for (i = 0; i < COAP_REQ_MAX; i++) {
+                if ((reqs[i].cb == NULL)
+                    || ((peer != NULL) && ((reqs[i].peer.port != peer->port)
+                                            || (memcmp(reqs[i].peer.addr, peer->addr, sizeof(peer->addr)) != 0)))) {
+                        continue;
+                }
+
+                if (rst ? (reqs[i].mid != mid)
+                        : ((reqs[i].tkllen != pkt->header.tkllen)
+                           || (memcmp(reqs[i].token, pkt->token.p, reqs[i].tkllen) != 0))) {
+                        continue;
+                }
+
+                req          = reqs[i];
+                reqs[i].cb   = NULL;
+                found        = true;
+                break;
+        }
+
+        COAP_UNLOCK();
+
+        if (!found) {
+                return false;
+        }
+
+        // a separate response also tells that the request arrived
+        if (req.con) {
+                coap_con_cancel(req.mid);
+        }
+
+        req.cb(req.arg, rst ? COAP_ERR_RESET : 0, pkt, (now != NULL) ? (*now - req.sent) : 0);
+
+        return true;
+}
+
+
+// drops a response the client ruled out with a No-Response option, a
+// piggybacked one still has to acknowledge the request and becomes an empty ACK
+static void coap_noresp(const coap_packet_t *inpkt, uint8_t *buf, size_t *buflen)
+{
+        const coap_option_t *opt;
+              uint8_t        count;
+              uint8_t        cls;
+
+        if (*buflen < 4) {
+                return;   // nothing to send anyway, e.g. a deferred NON request
+        }
+
+        cls = buf[1] >> 5;
+
+        if ((NULL == (opt = coap_find_options(inpkt, COAP_OPTION_NO_RESPONSE, &count)))
+            || (opt->val.len != 1) || (cls == 0) || (cls > 5)
+            || !(opt->val.p[0] & (1 << (cls - 1)))) {
+                return;
+        }
+
+        if (((buf[0] >> 4) & 0x03) == COAP_TYPE_ACK) {
+                buf[0]  = (buf[0] & 0xF0);   // keep version and type, drop the token
+                buf[1]  = 0;
+                *buflen = 4;
+        }
+        else {
+                *buflen = 0;
+        }
+}
+
+
+// adds an ETag, a hash of the payload, to a 2.05 response and turns the
+// response into a bare 2.03 if the request names that ETag already; left
+// alone are responses whose handler set an ETag itself and single blocks
+static void coap_etag(const coap_packet_t *inpkt, coap_encoder_t *rsp)
+{
+        const coap_option_t     *req;
+              coap_raw_packet_t  raw;
+              coap_opt_iter_t    it;
+              coap_option_t      opt;
+              coap_buffer_t      payload;
+              uint32_t           hash = 2166136261UL;   // FNV-1a
+              uint8_t            tag[4];
+              uint8_t            obs[3];
+              size_t             obslen = 0;
+              bool               hasobs = false;
+              uint8_t            age[4];
+              size_t             agelen = 0;
+              bool               hasage = false;
+              uint16_t           firstnum = 0;   // first option of the response, 0 if none
+              size_t             firstlen = 0;
+              size_t             hdr, shift;
+              size_t             hold = 0;       // header size of the first option
+              uint8_t            count;
+              size_t             i;
+
+        if (coap_parse_raw(&raw, rsp->buf, rsp->pos) != 0) {
+                return;
+        }
+
+        hdr = 4 + raw.header.tkllen;
+        coap_opt_iter_init(&it, &raw);
+
+        while (coap_opt_iter_next(&it, &opt)) {
+                if ((opt.num <= COAP_OPTION_ETAG) || (opt.num == COAP_OPTION_BLOCK2)) {
+                        return;
+                }
+
+                if (firstnum == 0) {
+                        firstnum = opt.num;
+                        firstlen = opt.val.len;
+                        hold     = opt.val.p - (rsp->buf + hdr);
+                }
+
+                if ((opt.num == COAP_OPTION_OBSERVE) && (opt.val.len <= sizeof(obs))) {
+                        memcpy(obs, opt.val.p, opt.val.len);
+                        obslen = opt.val.len;
+                        hasobs = true;
+                }
+
+                if ((opt.num == COAP_OPTION_MAX_AGE) && (opt.val.len <= sizeof(age))) {
+                        memcpy(age, opt.val.p, opt.val.len);
+                        agelen = opt.val.len;
+                        hasage = true;
+                }
+        }
+
+        if (coap_opt_iter_payload(&it, &payload) != 0) {
+                return;
+        }
+
+        for (i = 0; i < payload.len; i++) {
+                hash = (hash ^ payload.p[i]) * 16777619UL;
+        }
+
+        tag[0] = (hash >> 24);
+        tag[1] = (0xFF & (hash >> 16));
+        tag[2] = (0xFF & (hash >> 8));
+        tag[3] = (0xFF & hash);
+
+        // the client has this representation, only the ETag goes back, plus
+        // the Observe sequence number and the freshness of the response
+        req = coap_find_options(inpkt, COAP_OPTION_ETAG, &count);
+
+        for (i = 0; (req != NULL) && (i < count); i++) {
+                if ((req[i].val.len == sizeof(tag)) && (memcmp(req[i].val.p, tag, sizeof(tag)) == 0)) {
+                        rsp->buf[1]  = COAP_RSPCODE_VALID;
+                        rsp->pos     = hdr;
+                        rsp->lastopt = 0;
+                        rsp->payload = false;
+                        coap_enc_option(rsp, COAP_OPTION_ETAG, tag, sizeof(tag));
+
+                        if (hasobs) {
+                                coap_enc_option(rsp, COAP_OPTION_OBSERVE, obs, obslen);
+                        }
+
+                        if (hasage) {
+                                coap_enc_option(rsp, COAP_OPTION_MAX_AGE, age, agelen);
+                        }
+
+                        return;
+                }
+        }
+
+        // ETag is the lowest option in a response, so it goes in front and
+        // the delta of the option that was first shrinks by 4
+        shift = 1 + sizeof(tag);
+
+        if (firstnum != 0) {
+                shift += coap_option_hdrlen(firstnum - COAP_OPTION_ETAG, firstlen) - hold;
+        }
+
+        if (rsp->pos + shift > rsp->len) {
+                return;
+        }
+
+        memmove(rsp->buf + hdr + hold + shift, rsp->buf + hdr + hold, rsp->pos - hdr - hold);
+        coap_option_header(rsp->buf + hdr, COAP_OPTION_ETAG, sizeof(tag));
+        memcpy(rsp->buf + hdr + 1, tag, sizeof(tag));
+
+        if (firstnum != 0) {
+                coap_option_header(rsp->buf + hdr + 1 + sizeof(tag),
+                                   firstnum - COAP_OPTION_ETAG, firstlen);
+        }
+
+        rsp->pos += shift;
+}
+
+
+static int coap_handle(      coap_ctx_t    *ctx,
+                       const coap_peer_t   *peer,
+                       const coap_packet_t *inpkt,
+                             uint8_t       *buf,
+                             size_t        *buflen,
+                             bool           pb,
+                             bool           con,
+                       const uint32_t      *now)
+{
+        const coap_endpoint_t *ep;
+              coap_observer_t *obs;
+              uint32_t         seq = 0;
+        const coap_option_t   *opt;
+              coap_encoder_t   rsp;
+              coap_msgtype_t   type;
+
         uint8_t count;
+        int     node;
+        int     epidx;
         int     i;
-                
+        int     rc;
+#ifdef COAP_WITH_STATS
+        uint32_t start;
+#endif
+
         coap_responsecode_t rsp_code;
-        
-        if (ep->handler == NULL) {   // no handler exists at all, set state to 5.01
-                rsp_code = COAP_RSPCODE_NOT_IMPLEMENTED;
+
+        // under the lock, other threads may be handling their first
+        // request as well
+        COAP_LOCK();
+
+        if (routes_used == 0) {
+                coap_init();
+        }
+
+        COAP_UNLOCK();
+
+        // ACK and Reset complete a message we sent and are never answered
+        if (inpkt->header.type == COAP_TYPE_ACK || inpkt->header.type == COAP_TYPE_RESET) {
+                coap_con_done(peer, inpkt);
+
+                // a piggybacked response or a rejected request of ours
+                if ((inpkt->header.type == COAP_TYPE_RESET) || (inpkt->header.code != 0)) {
+                        coap_req_done(peer, inpkt, now);
+                }
+
+                // a Reset in reply to a notification also cancels the observation
+                COAP_LOCK();
+
+                for (i = 0; (inpkt->header.type == COAP_TYPE_RESET) && (peer != NULL)
+                            && (i < COAP_OBS_MAX); i++) {
+                        if ((observers[i].ep != NULL) && (observers[i].peer.port == peer->port)
+                            && (memcmp(observers[i].peer.addr, peer->addr, sizeof(peer->addr)) == 0)
+                            && (observers[i].mid == ((inpkt->header.mid[0] << 8) | inpkt->header.mid[1]))) {
+                                observers[i].ep = NULL;
+                        }
+                }
+
+                COAP_UNLOCK();
+
+                *buflen = 0;
+                return 0;
+        }
+
+        // a separate or non-confirmable response to a request of ours, a
+        // confirmable one is acknowledged, or rejected if nobody waits for it
+        if ((inpkt->header.code >> 5) >= 2) {
+                rc = coap_req_done(peer, inpkt, now) ? COAP_TYPE_ACK : COAP_TYPE_RESET;
+
+                if ((inpkt->header.type != COAP_TYPE_CON) || (*buflen < 4)) {
+                        *buflen = 0;
+                        return 0;
+                }
+
+                buf[0]  = (1 << 6) | (rc << 4);
+                buf[1]  = 0;
+                buf[2]  = inpkt->header.mid[0];
+                buf[3]  = inpkt->header.mid[1];
+                *buflen = 4;
+                return 0;
+        }
+
+        if (pb) {
+                type = COAP_TYPE_ACK;
         } else {
-                rsp_code = COAP_RSPCODE_NOT_FOUND;
+                type = (con) ? COAP_TYPE_CON : COAP_TYPE_NONCON;
+        }
+
+        // the handler is expected to set the response code
+        if (0 != (rc = coap_enc_init(&rsp, buf, *buflen, type, COAP_RSPCODE_INTERNAL_SERVER_ERROR,
+                                     inpkt->header.mid[0], inpkt->header.mid[1], &inpkt->token))) {
+                *buflen = 0;
+                return COAP_STAT_ERR(rc);
+        }
+
+        rsp.ctx  = ctx;
+        rsp.peer = peer;
+
+        opt  = coap_find_options(inpkt, COAP_OPTION_URI_PATH, &count);
+        node = (opt != NULL) ? 0 : -1;
+
+        for (i = 0; (node >= 0) && (i < count); i++) {
+                node = coap_route_child(node, opt[i].val.p, opt[i].val.len);
+        }
+
+        // inner nodes of the trie have no endpoint
+        if ((node >= 0) && (routes[node].ep[0] == 0) && (routes[node].ep[1] == 0)
+            && (routes[node].ep[2] == 0) && (routes[node].ep[3] == 0)) {
+                node = -1;
+        }
+
+        if (node < 0) {
+                // not an endpoint of the application, maybe one of the library
+                for (i = 0; (i < (int)COAP_BUILTINS_NUMOF) && !coap_path_match(opt, count, builtins[i].path); i++) {
+                        // search
+                }
+
+                if (i == (int)COAP_BUILTINS_NUMOF) {
+                        rsp_code = (endpoints[0].handler == NULL) ? COAP_RSPCODE_NOT_IMPLEMENTED
+                                                                  : COAP_RSPCODE_NOT_FOUND;
+                        goto error;
+                }
+
+                if (inpkt->header.code != builtins[i].method) {
+                        rsp_code = COAP_RSPCODE_METHOD_NOT_ALLOWED;
+                        goto error;
+                }
+
+                epidx = -1;
+                ep    = &builtins[i];
+        }
+        else {
+                // URI in request matches an endpoint URI, now check if methods match
+                if ((inpkt->header.code < COAP_METHOD_GET) || (inpkt->header.code > COAP_METHOD_DELETE)
+                    || (routes[node].ep[inpkt->header.code - 1] == 0)) {
+                        rsp_code = COAP_RSPCODE_METHOD_NOT_ALLOWED;
+                        goto error;
+                }
+
+                epidx = routes[node].ep[inpkt->header.code - 1] - 1;
+                ep    = &endpoints[epidx];
         }
-        
-        while (ep->handler != NULL) {
-                opt = coap_find_options(inpkt, COAP_OPTION_URI_PATH, &count);
-                
-                if (opt != NULL) {
-                        if (count != ep->path->count) {
-                                goto next;
+
+        // valid request, now call handler, it writes its response straight to buf
+
+        COAP_LOCK();
+
+        if (NULL != (obs = coap_obs_register(peer, inpkt, ep))) {
+                seq = obs->seq;
+        }
+
+        COAP_UNLOCK();
+
+        // Observe is the first option a response to a GET can carry besides ETag
+        if (obs != NULL) {
+                coap_enc_option_uint(&rsp, COAP_OPTION_OBSERVE, seq);
+        }
+
+        COAP_STAT(start = coap_stats_usec());
+
+        rc = ep->handler(inpkt, &rsp);
+
+        COAP_STAT(if ((epidx >= 0) && (epidx < COAP_STATS_EP_MAX)) {
+                          coap_stats_time(epidx, coap_stats_usec() - start);
+                  });
+
+        if (rc != 0) {
+                COAP_STAT(stats.failed++);
+
+                // drop whatever the handler wrote and reply with a bare 5.00
+                coap_enc_init(&rsp, buf, *buflen, type, COAP_RSPCODE_INTERNAL_SERVER_ERROR,
+                              inpkt->header.mid[0], inpkt->header.mid[1], &inpkt->token);
+        }
+
+        // only successful responses establish an observation
+        if ((obs != NULL) && ((rc != 0) || ((buf[1] >> 5) != 2))) {
+                COAP_LOCK();
+                obs->ep = NULL;
+                COAP_UNLOCK();
+        }
+
+        if ((rc == 0) && (inpkt->header.code == COAP_METHOD_GET) && (buf[1] == COAP_RSPCODE_CONTENT)) {
+                coap_etag(inpkt, &rsp);
+        }
+
+        *buflen = rsp.pos;
+        coap_noresp(inpkt, buf, buflen);
+
+        COAP_STAT(stats.tx_pkts += (*buflen > 0); stats.tx_bytes += *buflen);
+
+        return rc;
+
+        error:
+
+        coap_enc_set_code(&rsp, rsp_code);
+        *buflen = rsp.pos;
+        coap_noresp(inpkt, buf, buflen);
+
+        COAP_STAT(stats.unmatched++; stats.tx_pkts += (*buflen > 0); stats.tx_bytes += *buflen);
+
+        return 0;
+}
+
+
+int coap_handle_req(const coap_peer_t   *peer,
+                    const coap_packet_t *inpkt,
+                          uint8_t       *buf,
+                          size_t        *buflen,
+                          bool           pb,
+                          bool           con)
+{
+        return coap_handle(NULL, peer, inpkt, buf, buflen, pb, con, NULL);
+}
+
+
+coap_ctx_t *coap_ctx_acquire(void)
+{
+        coap_ctx_t *ctx = NULL;
+        int         i;
+
+        COAP_LOCK();
+
+        for (i = 0; (ctx == NULL) && (i < COAP_CTX_NUMOF); i++) {
+                if (!ctx_pool[i].used) {
+                        ctx = &ctx_pool[i];
+                        ctx->used = true;
+                }
+        }
+
+        COAP_UNLOCK();
+
+        return ctx;
+}
+
+
+void coap_ctx_release(coap_ctx_t *ctx)
+{
+        COAP_LOCK();
+        ctx->used = false;
+        COAP_UNLOCK();
+}
+
+
+int coap_ctx_handle(coap_ctx_t *ctx, uint32_t now, bool pb, bool con)
+{
+        size_t len = sizeof(ctx->tx);
+        int    rc;
+
+        ctx->txlen = 0;
+
+        if (0 != (rc = coap_parse(&ctx->pkt, ctx->rx, ctx->rxlen))) {
+                return rc;
+        }
+
+        if (coap_is_duplicate(&ctx->peer, &ctx->pkt, now)) {
+                ctx->txlen = coap_dedup_reply(&ctx->peer, &ctx->pkt, ctx->tx, sizeof(ctx->tx));
+                return 0;
+        }
+
+        rc = coap_handle(ctx, &ctx->peer, &ctx->pkt, ctx->tx, &len, pb, con, &now);
+        ctx->txlen = len;
+        coap_dedup_store(&ctx->peer, &ctx->pkt, ctx->tx, len);
+
+        return rc;
+}
+
+
+// completes a confirmable notification, an observer that rejected it or
+// did not acknowledge it is gone (RFC 7641, section 4.5)
+static void coap_obs_con_done(void *arg, int result, const coap_packet_t *rsp)
+{
+        coap_observer_t *obs = arg;
+
+        (void)rsp;
+
+        COAP_LOCK();
+
+        obs->con = false;
+
+        if (result != 0) {
+                obs->ep = NULL;
+        }
+
+        COAP_UNLOCK();
+}
+
+
+int coap_notify(const coap_endpoint_path_t *path,
+                      uint8_t              *buf,
+                      size_t                buflen,
+                      uint32_t              now,
+                      coap_send_func        send)
+{
+        coap_observer_t obs;
+        coap_packet_t   req;
+        coap_encoder_t  enc;
+        uint32_t        seq;
+        uint16_t        mid;
+        bool            con;
+        int             sent = 0;
+        int             i;
+
+        for (i = 0; i < COAP_OBS_MAX; i++) {
+                // work on a copy, the handler and send run without the lock
+                COAP_LOCK();
+
+                if ((observers[i].ep == NULL) || (observers[i].ep->path != path)) {
+                        COAP_UNLOCK();
+                        continue;
+                }
+
+                obs = observers[i];
+
+                COAP_UNLOCK();
+
+                seq = (obs.seq + 1) & 0xFFFFFF;
+
+                // the handler sees a GET without options carrying the token of
+                // the registration, the message ID is filled in once the
+                // notification is known to go out
+                memset(&req, 0, sizeof(req));
+                req.header.version = 1;
+                req.header.type    = COAP_TYPE_NONCON;
+                req.header.tkllen  = obs.tkllen;
+                req.header.code    = COAP_METHOD_GET;
+                req.token.p        = obs.token;
+                req.token.len      = obs.tkllen;
+
+                if ((coap_enc_init(&enc, buf, buflen, COAP_TYPE_NONCON,
+                                   COAP_RSPCODE_INTERNAL_SERVER_ERROR, 0, 0, &req.token) != 0)
+                    || (coap_enc_option_uint(&enc, COAP_OPTION_OBSERVE, seq) != 0)
+                    || (obs.ep->handler(&req, &enc) != 0)) {
+                        continue;
+                }
+
+                COAP_LOCK();
+
+                // deregistered while the handler ran
+                if (observers[i].ep != obs.ep) {
+                        COAP_UNLOCK();
+                        continue;
+                }
+
+                mid              = next_mid++;
+                observers[i].mid = mid;
+                observers[i].seq = seq;
+
+                // an error response is the last notification
+                if ((buf[1] >> 5) != 2) {
+                        observers[i].ep = NULL;
+                }
+
+                // every COAP_OBS_CON_EVERY-th one is confirmable, so an
+                // observer that went away is noticed
+                con = (observers[i].ep != NULL) && !observers[i].con
+                      && (observers[i].nons + 1 >= COAP_OBS_CON_EVERY)
+                      && (enc.pos <= sizeof(observers[i].conbuf));
+
+                buf[2] = (mid >> 8);
+                buf[3] = (0xFF & mid);
+
+                if (con) {
+                        buf[0] = (buf[0] & 0xCF) | (COAP_TYPE_CON << 4);
+                        memcpy(observers[i].conbuf, buf, enc.pos);
+                        observers[i].con  = true;
+                        observers[i].nons = 0;
+                }
+                else if (observers[i].nons < 0xFF) {
+                        observers[i].nons++;
+                }
+
+                COAP_UNLOCK();
+
+                if (con) {
+                        if (coap_con_send(&obs.peer, observers[i].conbuf, enc.pos, now, send,
+                                          coap_obs_con_done, &observers[i]) == 0) {
+                                sent++;
+                                continue;
                         }
-                        
-                        for (i = 0; i < count; i++) {
-                                if (opt[i].val.len != strlen(ep->path->elems[i])) {
-                                        goto next;
-                                }
-                                
-                                if (memcmp(ep->path->elems[i], opt[i].val.p, opt[i].val.len) != 0) {
-                                        goto next;
-                                }
+
+                        // no room in the transmission table, try again next time
+                        COAP_LOCK();
+                        observers[i].con  = false;
+                        observers[i].nons = 0xFF;
+                        COAP_UNLOCK();
+
+                        buf[0] = (buf[0] & 0xCF) | (COAP_TYPE_NONCON << 4);
+                }
+
+                if (send(&obs.peer, buf, enc.pos) == 0) {
+                        sent++;
+                }
+        }
+
+        return sent;
+}
+
+
+int coap_defer(const coap_packet_t  *inpkt,
+                     coap_encoder_t *rsp,
+                     int            *id)
+{
+        coap_sep_t *sep = NULL;
+        int         i;
+
+        if ((rsp->peer == NULL) || (inpkt->token.len > sizeof(sep->token))) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        COAP_LOCK();
+
+        for (i = 0; (sep == NULL) && (i < COAP_SEP_MAX); i++) {
+                if (!seps[i].used) {
+                        sep = &seps[i];
+                        *id = i;
+                }
+        }
+
+        if (sep == NULL) {
+                COAP_UNLOCK();
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        sep->peer   = *rsp->peer;
+        sep->tkllen = inpkt->token.len;
+        sep->con    = (inpkt->header.type == COAP_TYPE_CON);
+        sep->used   = true;
+        memcpy(sep->token, inpkt->token.p, inpkt->token.len);
+
+        COAP_UNLOCK();
+
+        // an empty ACK stops the client from retransmitting, header byte 2
+        // and 3 already hold the message ID of the request
+        if (sep->con) {
+                rsp->buf[0] = (0x01 << 6) | (COAP_TYPE_ACK << 4);
+                rsp->buf[1] = 0;
+                rsp->pos    = 4;
+        }
+        else {
+                rsp->pos = 0;
+        }
+
+        // the handler must not add anything to it
+        rsp->len = rsp->pos;
+
+        return 0;
+}
+
+
+int coap_separate_init(coap_encoder_t *enc,
+                       int             id,
+                       uint8_t        *buf,
+                       size_t          buflen,
+                       coap_peer_t    *peer)
+{
+        coap_buffer_t token;
+        uint8_t       tok[8];
+        uint16_t      mid;
+        bool          con;
+
+        if ((id < 0) || (id >= COAP_SEP_MAX)) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        COAP_LOCK();
+
+        if (!seps[id].used) {
+                COAP_UNLOCK();
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        *peer     = seps[id].peer;
+        token.len = seps[id].tkllen;
+        con       = seps[id].con;
+        memcpy(tok, seps[id].token, token.len);
+        seps[id].used = false;
+
+        COAP_UNLOCK();
+
+        token.p = tok;
+        mid     = coap_mid_next();
+
+        // the handler is expected to set the response code
+        return coap_enc_init(enc, buf, buflen, con ? COAP_TYPE_CON : COAP_TYPE_NONCON,
+                             COAP_RSPCODE_INTERNAL_SERVER_ERROR, (mid >> 8), (0xFF & mid), &token);
+}
+
+
+int coap_separate_send(const coap_peer_t    *peer,
+                       const coap_encoder_t *enc,
+                             uint32_t        now,
+                             coap_send_func  send)
+{
+        if (((enc->buf[0] >> 4) & 0x03) == COAP_TYPE_CON) {
+                return coap_con_send(peer, enc->buf, enc->pos, now, send, NULL, NULL);
+        }
+
+        return send(peer, enc->buf, enc->pos);
+}
+
+
+int coap_con_send(const coap_peer_t    *peer,
+                  const uint8_t        *buf,
+                        size_t          len,
+                        uint32_t        now,
+                        coap_send_func  send,
+                        coap_con_func   cb,
+                        void           *arg)
+{
+        coap_con_t *con = NULL;
+        int         i;
+
+        if ((len < 4) || (((buf[0] >> 4) & 0x03) != COAP_TYPE_CON)) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        COAP_LOCK();
+
+        for (i = 0; (con == NULL) && (i < COAP_CON_MAX); i++) {
+                if (cons[i].buf == NULL) {
+                        con = &cons[i];
+                }
+        }
+
+        if (con == NULL) {
+                COAP_UNLOCK();
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        con->peer    = *peer;
+        con->buf     = buf;
+        con->len     = len;
+        con->send    = send;
+        con->cb      = cb;
+        con->arg     = arg;
+        con->mid     = (buf[2] << 8) | buf[3];
+        con->retries = 0;
+
+        // RFC 7252 wants a random initial timeout between ACK_TIMEOUT and 1.5
+        // times that, the message ID is random enough to spread the nodes
+        con->timeout = COAP_ACK_TIMEOUT + (con->mid % (COAP_ACK_TIMEOUT / 2));
+        con->due     = now + con->timeout;
+
+        COAP_UNLOCK();
+
+        send(peer, buf, len);
+
+        return 0;
+}
+
+
+uint32_t coap_con_tick(uint32_t now)
+{
+        uint32_t next = 0;
+        int      i;
+
+        for (i = 0; i < COAP_CON_MAX; i++) {
+                coap_con_t *con = &cons[i];
+                coap_con_t  act;
+                bool        expired = false;
+                bool        resend  = false;
+
+                // decide under the lock, call out without it
+                COAP_LOCK();
+
+                if (con->buf == NULL) {
+                        COAP_UNLOCK();
+                        continue;
+                }
+
+                // wrap-around safe "due <= now"
+                if ((int32_t)(con->due - now) <= 0) {
+                        if (con->retries == COAP_MAX_RETRANSMIT) {
+                                con->buf = NULL;
+                                expired  = true;
                         }
-                        
-                        // URI in request matches an endpoint URI, now check if methods match
-                        
-                        if (inpkt->header.code != ep->method) {
-                                rsp_code = COAP_RSPCODE_METHOD_NOT_ALLOWED;
-                                goto next;
+                        else {
+                                con->retries++;
+                                con->timeout *= 2;
+                                con->due      = now + con->timeout;
+                                resend        = true;
+                        }
+                }
+
+                act = *con;
+
+                COAP_UNLOCK();
+
+                if (expired) {
+                        if (act.cb != NULL) {
+                                act.cb(act.arg, COAP_ERR_TIMEOUT, NULL);
                         }
-                        
-                        // valid request, now call handler
-                                                
-                        return ep->handler(scratch, inpkt, outpkt,
-                                           inpkt->header.mid[0], inpkt->header.mid[1]);
+
+                        continue;
+                }
+
+                if (resend) {
+                        act.send(&act.peer, act.buf, act.len);
+                }
+
+                if ((next == 0) || (act.due - now < next)) {
+                        next = act.due - now;
                 }
-                
-                next:
-                
-                ep++;
         }
-        
-        if (pb) {
-                coap_make_pb_response(scratch, outpkt, NULL, 0, inpkt->header.mid[0],
-                                      inpkt->header.mid[1], &inpkt->token, rsp_code,
-                                      COAP_CONTENTTYPE_NONE);
-        } else {
-                coap_make_response(scratch, outpkt, NULL, 0, inpkt->header.mid[0],
-                                   inpkt->header.mid[1], &inpkt->token, rsp_code,
-                                   COAP_CONTENTTYPE_NONE, con);
+
+        return next;
+}
+
+
+void coap_con_cancel(uint16_t msgid)
+{
+        int i;
+
+        COAP_LOCK();
+
+        for (i = 0; i < COAP_CON_MAX; i++) {
+                if ((cons[i].buf != NULL) && (cons[i].mid == msgid)) {
+                        cons[i].buf = NULL;
+                }
         }
-        
-        return 0;
+
+        COAP_UNLOCK();
+}
+
+
+int coap_req_send(const coap_peer_t    *peer,
+                        uint8_t        *buf,
+                        size_t          len,
+                        uint32_t        now,
+                        uint32_t        timeout,
+                        coap_send_func  send,
+                        coap_resp_func  cb,
+                        void           *arg)
+{
+        coap_req_t *req = NULL;
+        uint8_t     tkl;
+        int         i;
+        int         rc;
+
+        if ((len < 4) || (cb == NULL)) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        // without a token the response could not be told apart
+        tkl = buf[0] & 0x0F;
+
+        if ((tkl == 0) || (tkl > 8) || (len < 4U + tkl)) {
+                return COAP_ERR_UNSUPPORTED;
+        }
+
+        coap_token_next(&buf[4], tkl);
+
+        COAP_LOCK();
+
+        for (i = 0; (req == NULL) && (i < COAP_REQ_MAX); i++) {
+                if (reqs[i].cb == NULL) {
+                        req = &reqs[i];
+                }
+        }
+
+        if (req == NULL) {
+                COAP_UNLOCK();
+                return COAP_ERR_BUFFER_TOO_SMALL;
+        }
+
+        req->peer   = *peer;
+        req->cb     = cb;
+        req->arg    = arg;
+        req->sent   = now;
+        req->due    = now + timeout;
+        req->mid    = (buf[2] << 8) | buf[3];
+        req->tkllen = tkl;
+        req->con    = (((buf[0] >> 4) & 0x03) == COAP_TYPE_CON);
+        memcpy(req->token, &buf[4], tkl);
+
+        COAP_UNLOCK();
+
+        if (req->con) {
+                rc = coap_con_send(peer, buf, len, now, send, NULL, NULL);
+        }
+        else {
+                rc = send(peer, buf, len);
+        }
+
+        if (rc != 0) {
+                COAP_LOCK();
+                req->cb = NULL;
+                COAP_UNLOCK();
+        }
+
+        return rc;
+}
+
+
+uint32_t coap_req_tick(uint32_t now)
+{
+        uint32_t next = 0;
+        int      i;
+
+        for (i = 0; i < COAP_REQ_MAX; i++) {
+                coap_req_t req;
+                bool       expired = false;
+
+                COAP_LOCK();
+
+                if (reqs[i].cb == NULL) {
+                        COAP_UNLOCK();
+                        continue;
+                }
+
+                // wrap-around safe "due <= now"
+                req = reqs[i];
+
+                if ((int32_t)(req.due - now) <= 0) {
+                        reqs[i].cb = NULL;
+                        expired    = true;
+                }
+
+                COAP_UNLOCK();
+
+                if (expired) {
+                        if (req.con) {
+                                coap_con_cancel(req.mid);
+                        }
+
+                        req.cb(req.arg, COAP_ERR_TIMEOUT, NULL, now - req.sent);
+                        continue;
+                }
+
+                if ((next == 0) || (req.due - now < next)) {
+                        next = req.due - now;
+                }
+        }
+
+        return next;
+}
+
+
+void coap_req_cancel(uint16_t msgid)
+{
+        int i;
+
+        COAP_LOCK();
+
+        for (i = 0; i < COAP_REQ_MAX; i++) {
+                if ((reqs[i].cb != NULL) && (reqs[i].mid == msgid)) {
+                        reqs[i].cb = NULL;
+                }
+        }
+
+        COAP_UNLOCK();
+
+        coap_con_cancel(msgid);
 }
@@ -28,18 +28,23 @@
 #include "board.h"
 #include "shell.h"
 #include "xtimer.h"
+#include "mutex.h"
 #include "net/gnrc.h"
 #include "net/gnrc/ipv6.h"
 #include "net/gnrc/udp.h"
 #include "net/conn.h"
 #include "net/conn/udp.h"
 #include "coap.h"
+#include "senml.h"
 #include "periph/gpio.h"
 #include "color.h"
 #include "rgbled.h"
 
 #define UPDATE_INTERVAL     (1000 * 1000U)
+#define HEARTBEAT_INTERVAL  (60 * 1000U)    /* full report at least this often [in ms] */
 #define MSG_UPDATE_EVENT    (0x3338)
+#define MSG_CON_TIMER       (0x333a)
+#define MSG_BLOCK1_DONE     (0x333b)
 
 #define Q_SZ                (4)
 #define PRIO                (THREAD_PRIORITY_MAIN - 1)
@@ -55,30 +60,39 @@ static char beac_stack[THREAD_STACKSIZE_DEFAULT];
 static msg_t _coap_msg_q[Q_SZ], _beac_msg_q[Q_SZ];
 static char coap_stack[THREAD_STACKSIZE_DEFAULT];
 
-static uint8_t udp_buf[512];
-static uint8_t scratch_raw[1024];      /* microcoap scratch buffer */
-static coap_rw_buffer_t scratch_buf = { scratch_raw, sizeof(scratch_raw) };
 static ipv6_addr_t dst_addr;
+
+/* the gateway, the blocks of larger packs are sent to it confirmable */
+static coap_peer_t gw_peer;
+static xtimer_t con_timer;
+static msg_t con_msg = { .type = MSG_CON_TIMER };
+static kernel_pid_t beac_pid = KERNEL_PID_UNDEF;
 static color_rgb_t rgb;
 static rgbled_t led;
 
-/* buffer for composing SemML messages in */
-static char p_buf[512];
+/* request template for SenML reports, the pack is composed in place behind
+ * the CoAP header */
+static uint8_t snd_buf[512];
+static coap_template_t senml_tpl;
+static char *p_buf;
+static size_t p_size;
 static size_t initial_pos;
 
-static const coap_header_t req_hdr = {
-        .version = 1,
-        .type    = COAP_TYPE_NONCON,
-        .tkllen  = 0,
-        .code    = COAP_METHOD_POST,
-        .mid     = {5, 57}            // is equivalent to 1337 when converted to uint16_t
-};
+/* one block of a SenML pack plus header, Uri-Path and Block1 option */
+static uint8_t blk_buf[COAP_BLOCK_SIZE(COAP_BLOCK_SZX) + 32];
+
+/* larger packs are uploaded one confirmable block at a time, the pack and
+ * blk_buf belong to the upload until the gateway answered the last block */
+static coap_block1_tx_t blk_tx;
+static bool blk_busy;
+
+/* reporting policy, the color is sent when it changes and with every heartbeat */
+static senml_field_t heartbeat = SENML_FIELD(0, 0, HEARTBEAT_INTERVAL);
+static senml_field_t fld_rgb = SENML_FIELD(0, 0, 0);
 
 static const coap_endpoint_path_t path_rgb = {1, {"rgb"} };
 
-static int handle_post_rgb(coap_rw_buffer_t *scratch,
-                           const coap_packet_t *inpkt, coap_packet_t *outpkt,
-                           uint8_t id_hi, uint8_t id_lo)
+static int handle_post_rgb(const coap_packet_t *inpkt, coap_encoder_t *rsp)
 {
     coap_responsecode_t resp = COAP_RSPCODE_CHANGED;
     const char *str = (const char *) inpkt->payload.p;
@@ -88,9 +102,7 @@ static int handle_post_rgb(coap_rw_buffer_t *scratch,
         rgbled_set(&led, &rgb);
     }
 
-    return coap_make_response(scratch, outpkt, NULL, 0,
-                              id_hi, id_lo, &inpkt->token, resp,
-                              COAP_CONTENTTYPE_TEXT_PLAIN, false);
+    return coap_enc_response(rsp, resp, COAP_CONTENTTYPE_TEXT_PLAIN, NULL, 0);
 }
 
 const coap_endpoint_t endpoints[] =
@@ -100,39 +112,54 @@ const coap_endpoint_t endpoints[] =
     { (coap_method_t)0, NULL, NULL, NULL }
 };
 
+/* microcoap's shared state (messages in flight, observers, duplicate cache,
+ * IDs) is used from more than one thread */
+static mutex_t coap_mutex = MUTEX_INIT;
+
+void coap_lock(void)
+{
+    mutex_lock(&coap_mutex);
+}
+
+void coap_unlock(void)
+{
+    mutex_unlock(&coap_mutex);
+}
+
+#ifdef COAP_WITH_STATS
+/* handler times for GET /.well-known/stats */
+uint32_t coap_stats_usec(void)
+{
+    return xtimer_now();
+}
+#endif
+
 void *microcoap_server(void *arg)
 {
     (void) arg;
     msg_init_queue(_coap_msg_q, Q_SZ);
 
     uint8_t laddr[16] = { 0 };
-    uint8_t raddr[16] = { 0 };
     size_t raddr_len;
-    uint16_t rport;
     conn_udp_t conn;
     int rc = conn_udp_create(&conn, laddr, sizeof(laddr), AF_INET6, COAP_SERVER_PORT);
+    /* this thread is the only worker, it keeps its context for good */
+    coap_ctx_t *ctx = coap_ctx_acquire();
 
     while (1) {
-        if ((rc = conn_udp_recvfrom(&conn, (char *)udp_buf, sizeof(udp_buf),
-                                    raddr, &raddr_len, &rport)) < 0) {
+        if ((rc = conn_udp_recvfrom(&conn, (char *)ctx->rx, sizeof(ctx->rx),
+                                    ctx->peer.addr, &raddr_len, &ctx->peer.port)) < 0) {
             continue;
         }
+        ctx->rxlen = rc;
 
-        coap_packet_t pkt;
-        /* parse UDP packet to CoAP */
-        if (0 == (rc = coap_parse(&pkt, udp_buf, rc))) {
-            coap_packet_t rsppkt;
-
-            /* handle CoAP request */
-            coap_handle_req(&scratch_buf, &pkt, &rsppkt, false, false);
-
-            /* build reply */
-            size_t rsplen = sizeof(udp_buf);
-            if ((rc = coap_build(udp_buf, &rsplen, &rsppkt)) == 0) {
-                /* send reply via UDP */
-                rc = conn_udp_sendto(udp_buf, rsplen, NULL, 0, raddr, raddr_len,
-                                     AF_INET6, COAP_SERVER_PORT, rport);
-            }
+        /* parse, drop duplicates and handle, the reply is encoded into ctx->tx */
+        coap_ctx_handle(ctx, (uint32_t)(xtimer_now64() / 1000), false, false);
+
+        /* send reply via UDP */
+        if (ctx->txlen > 0) {
+            rc = conn_udp_sendto(ctx->tx, ctx->txlen, NULL, 0, ctx->peer.addr, raddr_len,
+                                 AF_INET6, COAP_SERVER_PORT, ctx->peer.port);
         }
     }
 
@@ -140,43 +167,132 @@ void *microcoap_server(void *arg)
     return NULL;
 }
 
-static void send_coap_post(uint8_t *data, size_t len)
+static void senml_tpl_init(void)
 {
-    uint8_t  snd_buf[128];
-    size_t   req_pkt_sz;
+    coap_encoder_t enc;
+    size_t len;
+
+    coap_enc_init(&enc, snd_buf, sizeof(snd_buf), COAP_TYPE_NONCON,
+                  COAP_METHOD_POST, 0, 0, NULL);
+    coap_enc_option(&enc, COAP_OPTION_URI_PATH, (const uint8_t *)"senml", 5);
+#if SENML_CONTENT_FORMAT >= 0
+    coap_enc_option_uint(&enc, COAP_OPTION_CONTENT_FORMAT, SENML_CONTENT_FORMAT);
+#endif
+    /* the node never reads the reply, ask the gateway not to send one */
+    coap_enc_option_uint(&enc, COAP_OPTION_NO_RESPONSE, COAP_NORESP_ALL);
+    coap_tpl_init(&senml_tpl, &enc);
+    p_buf = (char *)coap_tpl_payload(&senml_tpl, &len);
+    p_size = len;
+}
 
-    coap_buffer_t payload = {
-            .p   = data,
-            .len = len
-    };
+static int send_from_server(const coap_peer_t *peer, const uint8_t *buf, size_t len)
+{
+    /* sent from the server port, so ACKs and Resets end up in microcoap_server() */
+    int rc = conn_udp_sendto(buf, len, NULL, 0, peer->addr, sizeof(peer->addr),
+                             AF_INET6, COAP_SERVER_PORT, peer->port);
 
-    coap_packet_t req_pkt = {
-            .header  = req_hdr,
-            .token   = (coap_buffer_t) { 0 },
-            .numopts = 1,
-            .opts    = {{{(uint8_t *)"senml", 5}, (uint8_t)COAP_OPTION_URI_PATH}},
-            .payload = payload
-    };
+    return (rc < 0) ? rc : 0;
+}
 
-    req_pkt_sz = sizeof(req_pkt);
+/* runs due retransmissions and re-arms the timer for the next one */
+static void con_timer_update(void)
+{
+    uint32_t next = coap_con_tick((uint32_t)(xtimer_now64() / 1000));
+
+    if (next > 0) {
+        xtimer_set_msg(&con_timer, next * 1000, &con_msg, thread_getpid());
+    }
+}
+
+static void blk_done(void *arg, int result, const coap_packet_t *rsp)
+{
+    msg_t m = { .type = MSG_BLOCK1_DONE };
+    (void)arg;
 
-    if (coap_build(snd_buf, &req_pkt_sz, &req_pkt) != 0) {
+    /* the ACK arrives in the server thread, the upload goes on in the
+     * beaconing thread; 0 stands for a block that got lost */
+    m.content.value = ((result == 0) && (rsp != NULL)) ? rsp->header.code : 0;
+    msg_send(&m, beac_pid);
+}
+
+/* sends block blk_tx.num, it is repeated until the gateway acknowledges it */
+static void blk_send(void)
+{
+    size_t pkt_len = coap_block1_build(&blk_tx, blk_tx.num, blk_buf, sizeof(blk_buf),
+                                       coap_mid_next());
+
+    blk_busy = (pkt_len > 0) &&
+               (coap_con_send(&gw_peer, blk_buf, pkt_len, (uint32_t)(xtimer_now64() / 1000),
+                              send_from_server, blk_done, NULL) == 0);
+    if (!blk_busy) {
+        printf("SenML upload failed at block %u\n", (unsigned)blk_tx.num);
+    }
+    con_timer_update();
+}
+
+/* the gateway answered the current block with code, the next one goes out
+ * once it asked for it with 2.31 */
+static void blk_next(unsigned code)
+{
+    blk_busy = false;
+    if (code == COAP_RSPCODE_CONTINUE) {
+        blk_tx.num++;
+        blk_send();
+    }
+    else if (code != COAP_RSPCODE_CHANGED) {
+        printf("SenML upload failed at block %u (%u.%02u)\n", (unsigned)blk_tx.num,
+               code >> 5, code & 0x1f);
+    }
+}
+
+static void send_coap_post(size_t len)
+{
+    size_t pkt_len;
+
+    /* a pack that fits into one block goes out straight from the template */
+    if (len <= COAP_BLOCK_SIZE(COAP_BLOCK_SZX)) {
+        pkt_len = coap_tpl_finish(&senml_tpl, coap_mid_next(), len);
+        if (pkt_len == 0) {
+            return;
+        }
+        conn_udp_sendto(snd_buf, pkt_len, NULL, 0, &dst_addr, sizeof(dst_addr),
+                        AF_INET6, SPORT, UDP_PORT);
         return;
     }
 
-    conn_udp_sendto(snd_buf, req_pkt_sz, NULL, 0, &dst_addr, sizeof(dst_addr),
-                    AF_INET6, SPORT, UDP_PORT);
+    /* larger ones are uploaded as link sized blocks (Block1) */
+    coap_block1_init(&blk_tx, &senml_tpl, (uint8_t *)p_buf, len, COAP_BLOCK_SZX);
+    blk_tx.con = true;
+    blk_send();
 }
 
 static void send_update(size_t pos, char *buf)
 {
+    senml_enc_t enc;
+    uint32_t now = (uint32_t)(xtimer_now64() / 1000);
+    bool full;
     uint32_t hex_rgb = 0x0;
+
+    /* the previous pack is still being uploaded, the changes wait for the
+     * next update */
+    if (blk_busy) {
+        return;
+    }
+    full = senml_heartbeat(&heartbeat, now);
     color_rgb2hex(&rgb, &hex_rgb);
 
-    pos += sprintf(&buf[pos], "{\"n\":\"a:rgb\", \"u\":\"rgb[#hex]\", \"v\":\"#%"PRIx32"\"}]",
-                   hex_rgb);
+    senml_init(&enc, buf, p_size, pos);
+    if (senml_due(&fld_rgb, (int32_t)hex_rgb, now, full)) {
+        senml_hex(&enc, "a:rgb", "rgb[#hex]", "#", hex_rgb);
+    }
 
-    send_coap_post((uint8_t *)buf, pos);
+    /* nothing changed */
+    if (senml_pos(&enc) == pos) {
+        return;
+    }
+    if ((pos = senml_end(&enc)) > 0) {
+        send_coap_post(pos);
+    }
 }
 
 void *beaconing(void *arg)
@@ -187,8 +303,9 @@ void *beaconing(void *arg)
     msg_t update_msg;
     kernel_pid_t mypid = thread_getpid();
 
-    /* initialize message queue */
+    /* initialize message queue, blk_done() sends here */
     msg_init_queue(_beac_msg_q, Q_SZ);
+    beac_pid = mypid;
 
     /* start periodic timer */
     update_msg.type = MSG_UPDATE_EVENT;
@@ -202,6 +319,12 @@ void *beaconing(void *arg)
                 xtimer_set_msg(&status_timer, UPDATE_INTERVAL, &update_msg, mypid);
                 send_update(initial_pos, p_buf);
                 break;
+            case MSG_CON_TIMER:
+                con_timer_update();
+                break;
+            case MSG_BLOCK1_DONE:
+                blk_next((unsigned)msg.content.value);
+                break;
             default:
                 break;
         }
@@ -244,25 +367,34 @@ int main(void)
 #endif
 
     eui64_t iid;
+    senml_enc_t senml;
     netopt_enable_t acks = NETOPT_DISABLE;
     kernel_pid_t ifs[GNRC_NETIF_NUMOF];
 
     gnrc_netif_get(ifs);
     gnrc_netapi_set(ifs[0], NETOPT_AUTOACK, 0, &acks, sizeof(acks));
     ipv6_addr_from_str(&dst_addr, "2001:affe:1234::1");
+    memcpy(gw_peer.addr, &dst_addr, sizeof(gw_peer.addr));
+    gw_peer.port = UDP_PORT;
     // ipv6_addr_from_str(&dst_addr, "fd38:3734:ad48:0:211d:50ce:a189:7cc4");
 
     /* initialize senml payload */
+    senml_tpl_init();
     gnrc_netapi_get(ifs[0], NETOPT_IPV6_IID, 0, &iid, sizeof(eui64_t));
 
-    initial_pos  = sprintf(&p_buf[initial_pos], "[{\"bn\":\"urn:dev:mac:");
-    initial_pos += sprintf(&p_buf[initial_pos], "%02x%02x%02x%02x%02x%02x%02x%02x",
-                           iid.uint8[0], iid.uint8[1], iid.uint8[2], iid.uint8[3],
-                           iid.uint8[4], iid.uint8[5], iid.uint8[6], iid.uint8[7]);
-    initial_pos += sprintf(&p_buf[initial_pos], "\"},");
+    /* message IDs and tokens start at a node specific value */
+    coap_seed((((uint32_t)iid.uint8[4] << 24) | ((uint32_t)iid.uint8[5] << 16) |
+               ((uint32_t)iid.uint8[6] << 8) | iid.uint8[7]) ^ xtimer_now());
+
+    /* the base record is written once, the reports continue behind it */
+    senml_init(&senml, p_buf, p_size, 0);
+    senml_base(&senml, "urn:dev:mac:", iid.uint8, sizeof(iid.uint8));
+    initial_pos = senml_pos(&senml);
 
     rgbled_init(&led, PWM_1, 2, 0, 1);
 
+    /* build the CoAP routing table before the server thread starts */
+    coap_init();
     thread_create(coap_stack, sizeof(coap_stack), PRIO - 1, THREAD_CREATE_STACKTEST, microcoap_server,
                   NULL, "coap");
 #ifdef WITH_SHELL
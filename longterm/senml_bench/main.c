@@ -0,0 +1,630 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @{
+ *
+ * @file
+ * @brief       Host benchmark for the SenML encoder of the longterm nodes
+ *
+ * Builds the periodic reports of the nodes once with the sprintf() chains
+ * the nodes used before and once with the senml_* encoder, and reports per
+ * update: the time spent, the length of the pack and the peak stack usage.
+ * The encoder output is checked against a few fixed packs first. Built with
+ * SENML_WITH_CBOR, the encoder writes SenML-CBOR instead of JSON.
+ *
+ * A last run feeds an hour of simulated node_iotlab-m3 readings through the
+ * reporting policy of the node (senml_due()) and compares the traffic with
+ * sending every reading.
+ *
+ * The last table compares sending each node_imu reading in its own pack with
+ * sending them in batches, with a base time and the time of each reading.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#define _GNU_SOURCE
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "senml.h"
+
+#define ITERATIONS          (200000U)
+#define WARMUP              (1000U)
+#define BUF_SIZE            (512U)
+#define SAMPLES             (16U)
+
+#define TRAFFIC_TIME        (3600U)     /* simulated reporting time [in s] */
+#define HEARTBEAT_INTERVAL  (60 * 1000U)
+
+#define IMU_READINGS        (100U)      /* 10s at 10Hz */
+#define IMU_INTERVAL        (100U)      /* time between readings [in ms] */
+#define IMU_BUF_SIZE        (2048U)
+#define BLOCK_SIZE          (64U)       /* Block1 size of the nodes */
+
+#define STACK_SIZE          (16 * 1024U)
+#define STACK_MAGIC         (0xa5)
+
+/**
+ * @brief   One set of sensor readings, covering all nodes
+ */
+typedef struct {
+    int led;
+    int btn;
+    int lux;
+    int pres;                   /**< iotlab-m3 pressure [mbar] */
+    int temp;                   /**< iotlab-m3 temperature [m°C] */
+    int16_t acc[3];
+    int16_t mag[3];
+    int hdc_temp;               /**< pba-d-01-kw2x temperature [1/100 °C] */
+    int hdc_hum;                /**< pba-d-01-kw2x humidity [1/100 %RH] */
+    uint32_t pres_pa;           /**< pba-d-01-kw2x pressure [Pa] */
+    uint32_t rgb[3];
+} sample_t;
+
+/**
+ * @brief   One report, built both ways
+ */
+typedef struct {
+    const char *name;
+    size_t (*sprintf_path)(const sample_t *s, char *buf, size_t pos);
+    size_t (*senml_path)(const sample_t *s, char *buf, size_t pos);
+} bench_report_t;
+
+/**
+ * @brief   An expected pack
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+} bench_pack_t;
+
+#define PACK(str)           { str, sizeof(str) - 1 }
+
+static char buf[BUF_SIZE];
+static size_t base_len;
+static sample_t samples[SAMPLES];
+
+static uint8_t bench_stack[STACK_SIZE];
+static ucontext_t ctx_main, ctx_bench;
+static size_t (*stack_path)(const sample_t *s, char *buf, size_t pos);
+
+static const uint8_t iid[8] = { 0x02, 0x15, 0xfe, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e };
+
+/* node_iotlab-m3 */
+static size_t iotlab_sprintf(const sample_t *s, char *buf, size_t pos)
+{
+    char led = (s->led) ? '1' : '0';
+    int lux, pres, pres_abs, temp, temp_abs;
+
+    lux = s->lux;
+    pres = s->pres;
+    temp = s->temp;
+    pres_abs = pres / 1000;
+    pres -= pres_abs * 1000;
+    temp_abs = temp / 1000;
+    temp -= temp_abs * 1000;
+
+    pos += sprintf(&buf[pos], "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"%c\"},",
+                   led);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:light\", \"u\":\"lux\", \"v\":\"%d\"},",
+                   lux);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:pressure\", \"u\":\"bar\", \"v\":\"%2i.%03i\"},",
+                   pres_abs, pres);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"%2i.%03i\"}]",
+                   temp_abs, temp);
+    return pos;
+}
+
+static size_t iotlab_senml(const sample_t *s, char *buf, size_t pos)
+{
+    senml_enc_t enc;
+
+    senml_init(&enc, buf, BUF_SIZE, pos);
+    senml_bool(&enc, "a:led", "bool", s->led);
+    senml_int(&enc, "s:light", "lux", s->lux);
+    senml_fixed(&enc, "s:pressure", "bar", s->pres, 3);
+    senml_fixed(&enc, "s:temp", "°C", s->temp, 3);
+    return senml_end(&enc);
+}
+
+/* node_mobile_pba-d-01-kw2x */
+static size_t mobile_sprintf(const sample_t *s, char *buf, size_t pos)
+{
+    char led = (s->led) ? '1' : '0';
+    char btn = (s->btn) ? '1' : '0';
+
+    pos += sprintf(&buf[pos], "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"%c\"},", led);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:btn\", \"u\":\"bool\", \"v\":\"%c\"},", btn);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:acc\", \"u\":\"g\", \"v\":[%d, %d, %d]},",
+                   s->acc[0], s->acc[1], s->acc[2]);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:mag\", \"u\":\"uT\", \"v\":[%d, %d, %d]}]",
+                   s->mag[0], s->mag[1], s->mag[2]);
+    return pos;
+}
+
+static size_t mobile_senml(const sample_t *s, char *buf, size_t pos)
+{
+    senml_enc_t enc;
+    int32_t acc[3] = { s->acc[0], s->acc[1], s->acc[2] };
+    int32_t mag[3] = { s->mag[0], s->mag[1], s->mag[2] };
+
+    senml_init(&enc, buf, BUF_SIZE, pos);
+    senml_bool(&enc, "a:led", "bool", s->led);
+    senml_bool(&enc, "s:btn", "bool", s->btn);
+    senml_vector(&enc, "s:acc", "g", acc, 3);
+    senml_vector(&enc, "s:mag", "uT", mag, 3);
+    return senml_end(&enc);
+}
+
+/* node_pba-d-01-kw2x */
+static size_t pba_sprintf(const sample_t *s, char *buf, size_t pos)
+{
+    uint32_t pressure = s->pres_pa;
+    int temp = s->hdc_temp, hum = s->hdc_hum, temp_abs, hum_abs, pressure_abs;
+
+    temp_abs = temp / 100;
+    hum_abs = hum / 100;
+    temp -= temp_abs * 100;
+    hum -= hum_abs * 100;
+    pressure_abs = pressure / 100000;
+    pressure -= pressure_abs * 100000;
+
+    pos += sprintf(&buf[pos], "{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"%2i.%03i\"},",
+                   temp_abs, temp);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:hum\", \"u\":\"%%RH\", \"v\":\"%2i.%03i\"},",
+                   hum_abs, hum);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:pres\", \"u\":\"bar\", \"v\":\"%2i.%03i\"},",
+                   pressure_abs, (unsigned int) pressure);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:rgb\", \"u\":\"RGB\", \"v\":\"[%"PRIu32", %"PRIu32", %"PRIu32"]\"}]",
+                   s->rgb[0], s->rgb[1], s->rgb[2]);
+    return pos;
+}
+
+static size_t pba_senml(const sample_t *s, char *buf, size_t pos)
+{
+    senml_enc_t enc;
+    int32_t rgb[3] = { s->rgb[0], s->rgb[1], s->rgb[2] };
+
+    senml_init(&enc, buf, BUF_SIZE, pos);
+    senml_fixed(&enc, "s:temp", "°C", s->hdc_temp, 2);
+    senml_fixed(&enc, "s:hum", "%RH", s->hdc_hum, 2);
+    senml_fixed(&enc, "s:pres", "bar", (int32_t)s->pres_pa, 5);
+    senml_vector(&enc, "s:rgb", "RGB", rgb, 3);
+    return senml_end(&enc);
+}
+
+/* the reports node_pba-d-01-kw2x sends between two full ones, without
+ * base name and units */
+static size_t pba_short_senml(const sample_t *s, char *buf, size_t pos)
+{
+    senml_enc_t enc;
+    int32_t rgb[3] = { s->rgb[0], s->rgb[1], s->rgb[2] };
+
+    (void)pos;
+    senml_init(&enc, buf, BUF_SIZE, 0);
+    senml_open(&enc);
+    senml_units(&enc, false);
+    senml_fixed(&enc, "s:temp", "°C", s->hdc_temp, 2);
+    senml_fixed(&enc, "s:hum", "%RH", s->hdc_hum, 2);
+    senml_fixed(&enc, "s:pres", "bar", (int32_t)s->pres_pa, 5);
+    senml_vector(&enc, "s:rgb", "RGB", rgb, 3);
+    return senml_end(&enc);
+}
+
+static const bench_report_t reports[] = {
+    { "iotlab-m3", iotlab_sprintf, iotlab_senml },
+    { "mobile", mobile_sprintf, mobile_senml },
+    { "pba", pba_sprintf, pba_senml },
+    { "pba-short", NULL, pba_short_senml },
+};
+
+#define REPORTS_NUMOF       (sizeof(reports) / sizeof(reports[0]))
+
+/* readings that change from sample to sample, with negative values in the
+ * mix as the sensors deliver them in the cold */
+static void samples_init(void)
+{
+    for (unsigned i = 0; i < SAMPLES; i++) {
+        sample_t *s = &samples[i];
+
+        s->led = i & 1;
+        s->btn = (i >> 1) & 1;
+        s->lux = 37 * i;
+        s->pres = 1013250 - 731 * i;
+        s->temp = 23125 - 3217 * i;
+        for (int j = 0; j < 3; j++) {
+            s->acc[j] = (int16_t)(((int)i - 8) * 127 * (j + 1));
+            s->mag[j] = (int16_t)(1000 - 173 * (int)i * (j + 1));
+            s->rgb[j] = 4711 * i + j;
+        }
+        s->hdc_temp = 2150 - 311 * i;
+        s->hdc_hum = 4510 + 97 * i;
+        s->pres_pa = 101325 - 53 * i;
+    }
+}
+
+/* the base record, written once as on the nodes */
+static void base_init(void)
+{
+    senml_enc_t enc;
+
+    senml_init(&enc, buf, BUF_SIZE, 0);
+    senml_base(&enc, "urn:dev:mac:", iid, sizeof(iid));
+    base_len = senml_pos(&enc);
+}
+
+/* print the pack if it differs from the expected one */
+static int compare(const char *name, size_t len, const bench_pack_t *expect)
+{
+    if (len == expect->len && memcmp(buf, expect->data, len) == 0) {
+        return 0;
+    }
+    printf("check %s: got", name);
+    for (size_t j = 0; j < len; j++) {
+        printf((buf[j] >= 0x20 && buf[j] < 0x7f) ? "%c" : "\\x%02x",
+               (uint8_t)buf[j]);
+    }
+    puts("");
+    return -1;
+}
+
+/* the encoder output for fixed readings, as the gateway expects it */
+static int check(void)
+{
+    static const sample_t s = {
+        .led = 1, .btn = 0, .lux = 412, .pres = 1013250, .temp = -250,
+        .acc = { -1, 0, 1024 }, .mag = { -32768, 32767, 7 },
+        .hdc_temp = -5, .hdc_hum = 4501, .pres_pa = 99870,
+        .rgb = { 0, 255, 70000 },
+    };
+#ifndef SENML_WITH_CBOR
+#define BASE "[{\"bn\":\"urn:dev:mac:0215fe0a0b0c0d0e\"}"
+    static const bench_pack_t expect[] = {
+        PACK(BASE
+             ",{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"1\"}"
+             ",{\"n\":\"s:light\", \"u\":\"lux\", \"v\":\"412\"}"
+             ",{\"n\":\"s:pressure\", \"u\":\"bar\", \"v\":\"1013.250\"}"
+             ",{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"-0.250\"}]"),
+        PACK(BASE
+             ",{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"1\"}"
+             ",{\"n\":\"s:btn\", \"u\":\"bool\", \"v\":\"0\"}"
+             ",{\"n\":\"s:acc\", \"u\":\"g\", \"v\":[-1, 0, 1024]}"
+             ",{\"n\":\"s:mag\", \"u\":\"uT\", \"v\":[-32768, 32767, 7]}]"),
+        PACK(BASE
+             ",{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"-0.05\"}"
+             ",{\"n\":\"s:hum\", \"u\":\"%RH\", \"v\":\"45.01\"}"
+             ",{\"n\":\"s:pres\", \"u\":\"bar\", \"v\":\"0.99870\"}"
+             ",{\"n\":\"s:rgb\", \"u\":\"RGB\", \"v\":[0, 255, 70000]}]"),
+        PACK("[{}"
+             ",{\"n\":\"s:temp\", \"v\":\"-0.05\"}"
+             ",{\"n\":\"s:hum\", \"v\":\"45.01\"}"
+             ",{\"n\":\"s:pres\", \"v\":\"0.99870\"}"
+             ",{\"n\":\"s:rgb\", \"v\":[0, 255, 70000]}]"),
+    };
+    static const bench_pack_t expect_batch =
+        PACK("[{\"bn\":\"urn:dev:mac:0215fe0a0b0c0d0e\", \"bt\":-0.15}"
+             ",{\"n\":\"s:acc\", \"u\":\"g\", \"t\":0, \"v\":[-1, 0, 1024]}"
+             ",{\"n\":\"s:acc\", \"t\":1.05, \"v\":[-1, 0, 1024]}]");
+#else
+#define BASE "\x9f\xa1\x21\x78\x1c" "urn:dev:mac:0215fe0a0b0c0d0e"
+    static const bench_pack_t expect[] = {
+        PACK(BASE
+             "\xa3\x00\x65" "a:led" "\x01\x64" "bool" "\x04\xf5"
+             "\xa3\x00\x67" "s:light" "\x01\x63" "lux" "\x02\x19\x01\x9c"
+             "\xa3\x00\x6a" "s:pressure" "\x01\x63" "bar" "\x02\xc4\x82\x22\x1a\x00\x0f\x76\x02"
+             "\xa3\x00\x66" "s:temp" "\x01\x63" "°C" "\x02\xc4\x82\x22\x38\xf9"
+             "\xff"),
+        PACK(BASE
+             "\xa3\x00\x65" "a:led" "\x01\x64" "bool" "\x04\xf5"
+             "\xa3\x00\x65" "s:btn" "\x01\x64" "bool" "\x04\xf4"
+             "\xa3\x00\x65" "s:acc" "\x01\x61" "g" "\x02\x83\x20\x00\x19\x04\x00"
+             "\xa3\x00\x65" "s:mag" "\x01\x62" "uT" "\x02\x83\x39\x7f\xff\x19\x7f\xff\x07"
+             "\xff"),
+        PACK(BASE
+             "\xa3\x00\x66" "s:temp" "\x01\x63" "°C" "\x02\xc4\x82\x21\x24"
+             "\xa3\x00\x65" "s:hum" "\x01\x63" "%RH" "\x02\xc4\x82\x21\x19\x11\x95"
+             "\xa3\x00\x66" "s:pres" "\x01\x63" "bar" "\x02\xc4\x82\x24\x1a\x00\x01\x86\x1e"
+             "\xa3\x00\x65" "s:rgb" "\x01\x63" "RGB" "\x02\x83\x00\x18\xff\x1a\x00\x01\x11\x70"
+             "\xff"),
+        PACK("\x9f"
+             "\xa2\x00\x66" "s:temp" "\x02\xc4\x82\x21\x24"
+             "\xa2\x00\x65" "s:hum" "\x02\xc4\x82\x21\x19\x11\x95"
+             "\xa2\x00\x66" "s:pres" "\x02\xc4\x82\x24\x1a\x00\x01\x86\x1e"
+             "\xa2\x00\x65" "s:rgb" "\x02\x83\x00\x18\xff\x1a\x00\x01\x11\x70"
+             "\xff"),
+    };
+    static const bench_pack_t expect_batch =
+        PACK("\x9f\xa2\x21\x78\x1c" "urn:dev:mac:0215fe0a0b0c0d0e"
+             "\x22\xc4\x82\x21\x2e"
+             "\xa4\x00\x65" "s:acc" "\x01\x61" "g" "\x06\x00"
+             "\x02\x83\x20\x00\x19\x04\x00"
+             "\xa3\x00\x65" "s:acc" "\x06\xc4\x82\x21\x18\x69"
+             "\x02\x83\x20\x00\x19\x04\x00"
+             "\xff");
+#endif
+    int res = 0;
+
+    for (unsigned i = 0; i < REPORTS_NUMOF; i++) {
+        base_init();
+        if (compare(reports[i].name, reports[i].senml_path(&s, buf, base_len),
+                    &expect[i]) != 0) {
+            res = -1;
+        }
+    }
+    base_init();
+
+    /* two readings of a batch, the first one 150ms before sending */
+    {
+        senml_enc_t enc;
+        static const int32_t acc[3] = { -1, 0, 1024 };
+
+        senml_init(&enc, buf, BUF_SIZE, 0);
+        senml_base_time(&enc, "urn:dev:mac:", iid, sizeof(iid), -150);
+        senml_time(&enc, 0);
+        senml_vector(&enc, "s:acc", "g", acc, 3);
+        senml_units(&enc, false);
+        senml_time(&enc, 1050);
+        senml_vector(&enc, "s:acc", "g", acc, 3);
+        if (compare("batch", senml_end(&enc), &expect_batch) != 0) {
+            res = -1;
+        }
+    }
+
+    /* a pack that does not fit must not be sent, nor written past the end */
+    {
+        senml_enc_t enc;
+        char small[48];
+
+        memset(small, STACK_MAGIC, sizeof(small));
+        senml_init(&enc, small, 40, 0);
+        senml_base(&enc, "urn:dev:mac:", iid, sizeof(iid));
+        senml_bool(&enc, "a:led", "bool", true);
+        if (senml_end(&enc) != 0 || (uint8_t)small[40] != STACK_MAGIC) {
+            puts("check overflow: failed");
+            res = -1;
+        }
+    }
+    return res;
+}
+
+static void stack_entry(void)
+{
+    stack_path(&samples[0], buf, base_len);
+}
+
+/* run the path once on a painted stack and return the number of bytes used */
+static size_t stack_usage(size_t (*path)(const sample_t *, char *, size_t))
+{
+    size_t unused = 0;
+
+    memset(bench_stack, STACK_MAGIC, sizeof(bench_stack));
+    stack_path = path;
+
+    getcontext(&ctx_bench);
+    ctx_bench.uc_stack.ss_sp = bench_stack;
+    ctx_bench.uc_stack.ss_size = sizeof(bench_stack);
+    ctx_bench.uc_link = &ctx_main;
+    makecontext(&ctx_bench, stack_entry, 0);
+    swapcontext(&ctx_main, &ctx_bench);
+
+    while ((unused < sizeof(bench_stack)) && (bench_stack[unused] == STACK_MAGIC)) {
+        unused++;
+    }
+    return sizeof(bench_stack) - unused;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec;
+}
+
+static void run(const char *report, const char *path_name,
+                size_t (*path)(const sample_t *, char *, size_t),
+                unsigned iterations, size_t stack_base)
+{
+    volatile size_t sink = 0;
+    uint64_t start, ns;
+    size_t len = 0;
+
+    for (unsigned i = 0; i < WARMUP; i++) {
+        sink += path(&samples[i % SAMPLES], buf, base_len);
+    }
+    start = now_ns();
+    for (unsigned i = 0; i < iterations; i++) {
+        len = path(&samples[i % SAMPLES], buf, base_len);
+        sink += len;
+    }
+    ns = now_ns() - start;
+    (void)sink;
+
+    printf("%-12s %-8s %10.1f %5u %6u\n", report, path_name,
+           (double)ns / iterations, (unsigned)len,
+           (unsigned)(stack_usage(path) - stack_base));
+}
+
+static size_t nop_path(const sample_t *s, char *buf, size_t pos)
+{
+    (void)s;
+    (void)buf;
+    return pos;
+}
+
+/* next value of a small pseudo random generator, for sensor noise */
+static int32_t noise(uint32_t *state, int32_t amplitude)
+{
+    *state = *state * 1103515245U + 12345U;
+    return (int32_t)((*state >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+/* one reading per second: the LED toggles every 10 minutes, light, pressure
+ * and temperature drift slowly and carry some noise */
+static void traffic(void)
+{
+    senml_field_t heartbeat = SENML_FIELD(0, 0, HEARTBEAT_INTERVAL);
+    senml_field_t fld_led = SENML_FIELD(0, 0, 0);
+    senml_field_t fld_light = SENML_FIELD(5, 50, 30000);
+    senml_field_t fld_pres = SENML_FIELD(2, 0, 30000);
+    senml_field_t fld_temp = SENML_FIELD(100, 0, 30000);
+    unsigned all_pkts = 0, pkts = 0, records = 0;
+    size_t all_bytes = 0, bytes = 0;
+    uint32_t rnd = 1;
+
+    for (unsigned t = 0; t < TRAFFIC_TIME; t++) {
+        uint32_t now = t * 1000;
+        bool full = senml_heartbeat(&heartbeat, now);
+        int32_t led = (t / 600) & 1;
+        int32_t light = 400 + (int32_t)(t / 30) + noise(&rnd, 3);
+        int32_t pres = 1013 + noise(&rnd, 1);
+        int32_t temp = 21000 + (int32_t)(t * 2) + noise(&rnd, 40);
+        senml_enc_t enc;
+        size_t len;
+
+        senml_init(&enc, buf, BUF_SIZE, base_len);
+        senml_bool(&enc, "a:led", "bool", led);
+        senml_int(&enc, "s:light", "lux", light);
+        senml_fixed(&enc, "s:pressure", "bar", pres, 3);
+        senml_fixed(&enc, "s:temp", "°C", temp, 3);
+        all_bytes += senml_end(&enc);
+        all_pkts++;
+
+        senml_init(&enc, buf, BUF_SIZE, base_len);
+        if (senml_due(&fld_led, led, now, full)) {
+            senml_bool(&enc, "a:led", "bool", led);
+            records++;
+        }
+        if (senml_due(&fld_light, light, now, full)) {
+            senml_int(&enc, "s:light", "lux", light);
+            records++;
+        }
+        if (senml_due(&fld_pres, pres, now, full)) {
+            senml_fixed(&enc, "s:pressure", "bar", pres, 3);
+            records++;
+        }
+        if (senml_due(&fld_temp, temp, now, full)) {
+            senml_fixed(&enc, "s:temp", "°C", temp, 3);
+            records++;
+        }
+        if (senml_pos(&enc) == base_len) {
+            continue;
+        }
+        len = senml_end(&enc);
+        bytes += len;
+        pkts++;
+    }
+
+    printf("\nnode_iotlab-m3 reporting, %u s at 1 report/s\n\n", TRAFFIC_TIME);
+    printf("%-12s %6s %8s %8s\n", "policy", "pkts", "records", "bytes");
+    printf("%-12s %6u %8u %8u\n", "every", all_pkts, all_pkts * 4, (unsigned)all_bytes);
+    printf("%-12s %6u %8u %8u\n", "changes", pkts, records, (unsigned)bytes);
+}
+
+/* node_imu readings: one pack per reading as the node sent them before, or
+ * batches with a base time. Larger packs go out in Block1 blocks, one link
+ * frame each. The node keeps its packs to 4 blocks, each one waits for the
+ * 2.31 of the one before */
+static void imu_batching(void)
+{
+    static const char *types[] = { "s:acc", "s:mag", "s:gyro" };
+    static const unsigned batches[] = { 1, 2, 10 };
+    static char pack[IMU_BUF_SIZE];
+    int32_t val[IMU_READINGS][3][3];
+    uint32_t rnd = 1;
+
+    for (unsigned n = 0; n < IMU_READINGS; n++) {
+        for (int j = 0; j < 3; j++) {
+            val[n][0][j] = ((j == 2) ? 1000 : 0) + noise(&rnd, 40);
+            val[n][1][j] = 200 * (j + 1) + noise(&rnd, 20);
+            val[n][2][j] = noise(&rnd, 500);
+        }
+    }
+
+    printf("\nnode_imu, %u readings at %u ms\n\n", IMU_READINGS, IMU_INTERVAL);
+    printf("%-12s %6s %8s %8s %8s\n", "readings", "msgs", "frames", "bytes", "largest");
+    for (unsigned b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        unsigned batch = batches[b], msgs = 0, frames = 0;
+        size_t bytes = 0, largest = 0;
+
+        for (unsigned first = 0; first < IMU_READINGS; first += batch) {
+            senml_enc_t enc;
+            size_t len;
+
+            senml_init(&enc, pack, sizeof(pack), 0);
+            if (batch == 1) {
+                senml_base(&enc, "urn:dev:mac:", iid, sizeof(iid));
+            }
+            else {
+                senml_base_time(&enc, "urn:dev:mac:", iid, sizeof(iid),
+                                -(int32_t)((batch - 1) * IMU_INTERVAL));
+            }
+            for (unsigned n = 0; n < batch; n++) {
+                if (batch > 1) {
+                    senml_units(&enc, n == 0);
+                    senml_time(&enc, n * IMU_INTERVAL);
+                }
+                for (int i = 0; i < 3; i++) {
+                    senml_vector(&enc, types[i], "g", val[first + n][i], 3);
+                }
+            }
+            len = senml_end(&enc);
+            bytes += len;
+            largest = (len > largest) ? len : largest;
+            frames += (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            msgs++;
+        }
+        printf("%-12u %6u %8u %8u %8u\n", batch, msgs, frames, (unsigned)bytes,
+               (unsigned)largest);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned iterations = ITERATIONS;
+    size_t stack_base;
+
+    if (argc > 1) {
+        iterations = (unsigned)strtoul(argv[1], NULL, 0);
+        if (iterations == 0) {
+            printf("usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    samples_init();
+    if (check() != 0) {
+        puts("error: encoder output differs from the expected packs");
+        return 1;
+    }
+    stack_base = stack_usage(nop_path);
+
+    printf("SenML host benchmark, %u iterations per path\n\n", iterations);
+    printf("%-12s %-8s %10s %5s %6s\n", "report", "path", "ns/upd", "len", "stack");
+    for (unsigned i = 0; i < REPORTS_NUMOF; i++) {
+        if (reports[i].sprintf_path != NULL) {
+            run(reports[i].name, "sprintf", reports[i].sprintf_path, iterations, stack_base);
+        }
+        run(reports[i].name, "senml", reports[i].senml_path, iterations, stack_base);
+    }
+
+    base_init();
+    traffic();
+    imu_batching();
+
+    return 0;
+}
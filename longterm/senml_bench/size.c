@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 Freie Universität Berlin
+ *
+ * This file is subject to the terms and conditions of the GNU Lesser
+ * General Public License v2.1. See the file LICENSE in the top level
+ * directory for more details.
+ */
+
+/**
+ * @{
+ *
+ * @file
+ * @brief       Smallest program building the node_iotlab-m3 report, for the
+ *              code size comparison of the senml_bench
+ *
+ * Built with -DWITH_SPRINTF it uses the sprintf() chain the nodes used
+ * before, else the senml_* encoder. The result goes out with write(), so
+ * nothing else pulls in stdio.
+ *
+ * @author      Hauke Petersen <hauke.petersen@fu-berlin.de>
+ *
+ * @}
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef WITH_SPRINTF
+#include <stdio.h>
+#else
+#include "senml.h"
+#endif
+
+static char buf[512];
+
+int main(int argc, char **argv)
+{
+    /* stand-ins for the sensor readings the compiler can not fold */
+    int led = argc & 1;
+    int lux = argc * 37;
+    int pres = 1013250 - argc;
+    int temp = 23125 - (int)(uintptr_t)argv[0] % 1000;
+    size_t pos;
+
+#ifdef WITH_SPRINTF
+    int pres_abs, temp_abs;
+
+    pres_abs = pres / 1000;
+    pres -= pres_abs * 1000;
+    temp_abs = temp / 1000;
+    temp -= temp_abs * 1000;
+
+    pos = sprintf(buf, "[{\"bn\":\"urn:dev:mac:0215fe0a0b0c0d0e\"},");
+    pos += sprintf(&buf[pos], "{\"n\":\"a:led\", \"u\":\"bool\", \"v\":\"%c\"},",
+                   (led) ? '1' : '0');
+    pos += sprintf(&buf[pos], "{\"n\":\"s:light\", \"u\":\"lux\", \"v\":\"%d\"},",
+                   lux);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:pressure\", \"u\":\"bar\", \"v\":\"%2i.%03i\"},",
+                   pres_abs, pres);
+    pos += sprintf(&buf[pos], "{\"n\":\"s:temp\", \"u\":\"°C\", \"v\":\"%2i.%03i\"}]",
+                   temp_abs, temp);
+#else
+    static const uint8_t iid[8] = { 0x02, 0x15, 0xfe, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e };
+    senml_enc_t enc;
+
+    senml_init(&enc, buf, sizeof(buf), 0);
+    senml_base(&enc, "urn:dev:mac:", iid, sizeof(iid));
+    senml_bool(&enc, "a:led", "bool", led);
+    senml_int(&enc, "s:light", "lux", lux);
+    senml_fixed(&enc, "s:pressure", "bar", pres, 3);
+    senml_fixed(&enc, "s:temp", "°C", temp, 3);
+    pos = senml_end(&enc);
+#endif
+
+    return (write(1, buf, pos) == (ssize_t)pos) ? 0 : 1;
+}